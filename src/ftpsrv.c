@@ -5,8 +5,10 @@
 #include "ftpsrv.h"
 #include "ftpsrv_vfs.h"
 #include "ftpsrv_socket.h"
+#include "ftpsrv_hash.h"
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -28,19 +30,97 @@
     #include <sys/sendfile.h>
 #endif
 
+// number of worker threads used for disk io, 0 = disabled.
+#ifndef FTP_IO_THREADS
+    #define FTP_IO_THREADS 0
+#endif
+
+#if FTP_IO_THREADS
+    #include <pthread.h>
+#endif
+
+// number of transfers that can use MODE Z at the same time, 0 = disabled.
+#if defined(HAVE_ZLIB) && HAVE_ZLIB
+    #include <zlib.h>
+    #ifndef FTP_ZLIB_STREAMS
+        #define FTP_ZLIB_STREAMS 8
+    #endif
+#else
+    #undef FTP_ZLIB_STREAMS
+    #define FTP_ZLIB_STREAMS 0
+#endif
+
+// size of the buffer each MODE Z stream (de)compresses into.
+#ifndef FTP_ZLIB_BUFFER_SIZE
+    #define FTP_ZLIB_BUFFER_SIZE (1024 * 64) /* 64 KiB */
+#endif
+
+// explicit FTPS (AUTH TLS), needs openssl.
+#if defined(HAVE_OPENSSL) && HAVE_OPENSSL
+    #include <openssl/ssl.h>
+    #include <openssl/err.h>
+    #define FTP_TLS 1
+#else
+    #define FTP_TLS 0
+#endif
+
+// size of the buffer each TLS connection writes its records into when the kernel doesn't
+// encrypt them (kTLS), it needs room for a whole record so that writes never have to be retried.
+#ifndef FTP_TLS_BUFFER_SIZE
+    #define FTP_TLS_BUFFER_SIZE (1024 * 40) /* 40 KiB */
+#endif
+
+// how long the control connection is given to finish the handshake, or to take the replies
+// queued for it, when using TLS before the session is closed. used if the config doesn't set it.
+#ifndef FTP_TLS_WAIT_MS
+    #define FTP_TLS_WAIT_MS 5000
+#endif
+
+// how long a transfer command waits for the data connection that wasn't ready when it arrived,
+// used if the config doesn't set it.
+#ifndef FTP_DATA_OPEN_WAIT_MS
+    #define FTP_DATA_OPEN_WAIT_MS 10000
+#endif
+
 // helper which returns the size of array
 #define FTP_ARR_SZ(x) (sizeof(x) / sizeof(x[0]))
 
-// number of max concurrent sessions
+// number of max concurrent sessions, used if the config doesn't set it.
 #ifndef FTP_MAX_SESSIONS
     #define FTP_MAX_SESSIONS 128
 #endif
 
-// size of the buffer used for file transfers
+// bytes of commands each session can queue whilst a transfer is in progress, they're run once it ends.
+// 0 = commands other than ABOR, NOOP, STAT and SIZE are refused during a transfer.
+#ifndef FTP_CMD_QUEUE_SIZE
+    #define FTP_CMD_QUEUE_SIZE 512
+#endif
+
+// PASV listeners are made ahead of time and handed out from a pool, rather than opening, binding
+// and listening on a new socket each time. 0 = a listener is made for each PASV and closed afterwards.
+#ifndef FTP_PASV_POOL_SIZE
+    #define FTP_PASV_POOL_SIZE 16
+#endif
+
+// ports PASV uses if the range isn't set in the config.
+#ifndef FTP_PASV_PORT_MIN
+    #define FTP_PASV_PORT_MIN 49152
+#endif
+#ifndef FTP_PASV_PORT_MAX
+    #define FTP_PASV_PORT_MAX 65535
+#endif
+
+// size of the buffer used for file transfers, used if the config doesn't set it.
 #ifndef FTP_FILE_BUFFER_SIZE
     #define FTP_FILE_BUFFER_SIZE (1024 * 64) /* 64 KiB */
 #endif
 
+// size of the buffer the line endings of TYPE A transfers are converted into, RETR reads
+// half of this at a time as each LF may become CRLF. 0 = TYPE A data is sent as is.
+#ifndef FTP_ASCII_BUFFER_SIZE
+    #define FTP_ASCII_BUFFER_SIZE FTP_FILE_BUFFER_SIZE
+#endif
+
 // size of the max length of pathname
 #ifndef FTP_PATHNAME_SIZE
     #define FTP_PATHNAME_SIZE 4096
@@ -49,10 +129,140 @@
     #error FTP_PATHNAME_SSCANF should be the size of (FTP_PATHNAME_SIZE-1) to prevent sscanf overflow
 #endif
 
+// size of each write buffer, writes during STOR are coalesced into these
+// and flushed in large chunks, as small writes are very slow on some fs.
+#ifndef FTP_WRITE_BUFFER_SIZE
+    #define FTP_WRITE_BUFFER_SIZE (1024 * 1024) /* 1 MiB */
+#endif
+
+// number of write buffers shared between all sessions, 0 = disabled.
+#ifndef FTP_WRITE_BUFFER_COUNT
+    #define FTP_WRITE_BUFFER_COUNT 0
+#endif
+
+// during STOR the file is grown ahead of the writes, starting at this size
+// and doubling each time, so that the fs can lay it out in one go, 0 = disabled.
+#ifndef FTP_PREALLOCATE_MIN
+    #define FTP_PREALLOCATE_MIN (1024 * 1024) /* 1 MiB */
+#endif
+
+// largest amount the file is grown by in one go during STOR.
+#ifndef FTP_PREALLOCATE_MAX
+    #define FTP_PREALLOCATE_MAX (1024 * 1024 * 128) /* 128 MiB */
+#endif
+
+// STOR leaves holes for whole blocks of zeros of this size rather than writing them,
+// must be a multiple of 64, 0 = disabled.
+#ifndef FTP_SPARSE_BLOCK_SIZE
+    #define FTP_SPARSE_BLOCK_SIZE (1024 * 4) /* 4 KiB */
+#endif
+
+// when using the drop behind cache policy, data is dropped from the
+// page cache each time this many bytes have been transferred.
+#ifndef FTP_DROP_BEHIND_SIZE
+    #define FTP_DROP_BEHIND_SIZE (1024 * 1024 * 8) /* 8 MiB */
+#endif
+
+// buffers used for file io are aligned so that they can be used with O_DIRECT.
+#if defined(HAVE_O_DIRECT) && HAVE_O_DIRECT && defined(__GNUC__)
+    #define FTP_FILE_BUFFER_ALIGN __attribute__((aligned(4096)))
+    #define FTP_FILE_BUFFER_ALIGNMENT 4096
+#else
+    #define FTP_FILE_BUFFER_ALIGN
+    #define FTP_FILE_BUFFER_ALIGNMENT 64
+#endif
+
+// connections waiting to be accepted by the server socket, used if the config doesn't set it.
+#ifndef FTP_LISTEN_BACKLOG
+    #define FTP_LISTEN_BACKLOG 5
+#endif
+
+// number of transfer contexts shared by the sessions, used if the config doesn't set it.
+// a session only holds one whilst running a command, transferring, or between RNFR and RNTO.
+// 0 = one for each session.
+#ifndef FTP_MAX_TRANSFERS
+    #define FTP_MAX_TRANSFERS 0
+#endif
+
+// a rate limited transfer can send a burst of up to 1/FTP_RATE_LIMIT_HZ
+// of a second worth of data, and waits until it can send at least
+// FTP_RATE_LIMIT_MIN bytes (or a full burst if that's smaller).
+#ifndef FTP_RATE_LIMIT_HZ
+    #define FTP_RATE_LIMIT_HZ 10
+#endif
+
+#ifndef FTP_RATE_LIMIT_MIN
+    #define FTP_RATE_LIMIT_MIN (1024 * 16) /* 16 KiB */
+#endif
+
+// each time a transfer is polled, it can move up to this many bytes plus
+// whatever it didn't use the last time (deficit round robin), this keeps
+// a single fast transfer from hogging the loop.
+#ifndef FTP_SCHED_QUANTUM
+    #define FTP_SCHED_QUANTUM FTP_FILE_BUFFER_SIZE
+#endif
+
+// max number of entries a LIST / NLST builds each time it's polled.
+#ifndef FTP_SCHED_LIST_ENTRIES
+    #define FTP_SCHED_LIST_ENTRIES 64
+#endif
+
+// in block mode, a restart marker is sent each time this many bytes of a
+// file have been sent, 0 = disabled.
+#ifndef FTP_BLOCK_MARKER_SIZE
+    #define FTP_BLOCK_MARKER_SIZE (1024 * 1024 * 64) /* 64 MiB */
+#endif
+
+// number of data connections that striped (MODE E) transfers can use
+// between all sessions, 0 = disabled.
+#ifndef FTP_STRIPE_COUNT
+    #define FTP_STRIPE_COUNT 16
+#endif
+
+// max number of data connections a single striped transfer can use.
+#ifndef FTP_STRIPE_MAX
+    #define FTP_STRIPE_MAX 8
+#endif
+
+// striped transfers hand out the file to the data connections in blocks of this size.
+#ifndef FTP_STRIPE_BLOCK_SIZE
+    #define FTP_STRIPE_BLOCK_SIZE (1024 * 256) /* 256 KiB */
+#endif
+
+// number of digests remembered for HASH / XCRC / XMD5, 0 = disabled.
+#ifndef FTP_HASH_CACHE_ENTRIES
+    #define FTP_HASH_CACHE_ENTRIES 16
+#endif
+
+// largest block size accepted by SITE BLOCKSUMS.
+#ifndef FTP_BLOCKSUMS_MAX_SIZE
+    #define FTP_BLOCKSUMS_MAX_SIZE (1024 * 1024 * 16)
+#endif
+
+// SITE RMTREE sends a progress reply each time this many entries are removed, 0 = disabled.
+#ifndef FTP_RMTREE_PROGRESS
+    #define FTP_RMTREE_PROGRESS 4096
+#endif
+
+// deepest directory that RETR <dir>.tar goes into, a directory is kept open per level, 0 = disabled.
+#ifndef FTP_TAR_DEPTH
+    #define FTP_TAR_DEPTH 32
+#endif
+
+// appended to the file name whilst a delta upload (SITE DELTA) is being assembled.
+#ifndef FTP_DELTA_SUFFIX
+    #define FTP_DELTA_SUFFIX ".ftpsrv-delta"
+#endif
+
+// number of double buffered transfers that can be serviced by the io threads.
+#ifndef FTP_IO_SLOTS
+    #define FTP_IO_SLOTS 8
+#endif
+
 #define TELNET_EOL "\r\n"
 
 enum FTP_TYPE {
-    FTP_TYPE_ASCII,  // unsupported
+    FTP_TYPE_ASCII,  // LF is sent as CRLF, and CRLF is stored as LF
     FTP_TYPE_EBCDIC, // unsupported
     FTP_TYPE_IMAGE,
     FTP_TYPE_LOCAL,  // unsupported
@@ -60,8 +270,59 @@ enum FTP_TYPE {
 
 enum FTP_MODE {
     FTP_MODE_STREAM,
-    FTP_MODE_BLOCK,      // unsupported
+    FTP_MODE_BLOCK,
     FTP_MODE_COMPRESSED, // unsupported
+    FTP_MODE_DEFLATE,    // MODE Z, needs zlib
+    FTP_MODE_EXTENDED,   // MODE E, extended block mode (gridftp)
+};
+
+// block header descriptor codes, see rfc959 3.4.2.
+enum FTP_BLOCK_DESCRIPTOR {
+    FTP_BLOCK_DESCRIPTOR_EOR = 128,    // end of record
+    FTP_BLOCK_DESCRIPTOR_EOF = 64,     // end of file
+    FTP_BLOCK_DESCRIPTOR_ERRORS = 32,  // suspected errors in the data
+    FTP_BLOCK_DESCRIPTOR_MARKER = 16,  // the data is a restart marker
+    FTP_BLOCK_DESCRIPTOR_EOD = 8,      // end of data on this connection (MODE E)
+};
+
+// header is the descriptor followed by the 16-bit byte count.
+#define FTP_BLOCK_HEADER_SIZE 3
+// MODE E header is the descriptor followed by the 64-bit byte count and 64-bit offset.
+#define FTP_BLOCK_EXTENDED_HEADER_SIZE 17
+#define FTP_BLOCK_MAX_COUNT 0xFFFF
+
+// delta upload record ops, each record is the op followed by the 64-bit count and 64-bit offset.
+enum FTP_DELTA_OP {
+    FTP_DELTA_OP_LITERAL = 'L', // count bytes of new data follow the record
+    FTP_DELTA_OP_COPY = 'C',    // copy count bytes from offset in the old file
+    FTP_DELTA_OP_END = 'E',     // end of the upload, count is the size of the new file
+};
+
+#define FTP_DELTA_HEADER_SIZE 17
+// SITE BLOCKSUMS record is the 32-bit rolling checksum followed by the MD5 of the block.
+#define FTP_BLOCKSUMS_RECORD_SIZE 20
+
+// tar archives are made of 512 byte records, each entry is a header record followed by its data.
+#define FTP_TAR_RECORD_SIZE 512
+#define FTP_TAR_NAME_SIZE 100
+
+// what the data of the entry being extracted by SITE UNTAR is used for.
+enum FTP_UNTAR_DATA {
+    FTP_UNTAR_DATA_SKIP, // not needed, or an entry that isn't extracted
+    FTP_UNTAR_DATA_FILE, // written to file_vfs
+    FTP_UNTAR_DATA_NAME, // a GNU long name or pax header, put together in temp_path
+};
+
+// parts of the entry being sent by RETR <dir>.tar, in the order they're sent.
+enum FTP_TAR_PART {
+    FTP_TAR_PART_LONG_HEADER, // GNU header for a name that doesn't fit in the header
+    FTP_TAR_PART_LONG_NAME,   // the name, sent from temp_path
+    FTP_TAR_PART_LONG_PAD,
+    FTP_TAR_PART_HEADER,
+    FTP_TAR_PART_BODY,        // the file, sent from file_vfs
+    FTP_TAR_PART_PAD,
+    FTP_TAR_PART_NEXT,        // nothing queued, the next entry has to be read
+    FTP_TAR_PART_END,         // the two zero records that end the archive
 };
 
 enum FTP_STRUCTURE {
@@ -82,6 +343,17 @@ enum FTP_TRANSFER_MODE {
     FTP_TRANSFER_MODE_STOR, // transfer using STOR
     FTP_TRANSFER_MODE_LIST, // transfer using LIST
     FTP_TRANSFER_MODE_NLST, // transfer using NLST
+    FTP_TRANSFER_MODE_HASH, // hashing a file for HASH / XCRC / XMD5, no data connection
+    FTP_TRANSFER_MODE_BLOCKSUMS, // sending block checksums using SITE BLOCKSUMS
+    FTP_TRANSFER_MODE_COPY, // copying a file for SITE CPTO, no data connection
+    FTP_TRANSFER_MODE_RMTREE, // removing a directory tree for SITE RMTREE, no data connection
+    FTP_TRANSFER_MODE_TAR, // sending a directory as a tar archive using RETR <dir>.tar
+};
+
+enum FTP_PATH_PENDING {
+    FTP_PATH_PENDING_NONE, // no path held
+    FTP_PATH_PENDING_RNFR, // source of a rename, used by RNTO
+    FTP_PATH_PENDING_CPFR, // source of a copy, used by SITE CPTO
 };
 
 enum FTP_AUTH_MODE {
@@ -100,16 +372,240 @@ struct Pathname {
     char s[FTP_PATHNAME_SIZE];
 };
 
+#if FTP_WRITE_BUFFER_COUNT
+struct FtpWriteBuffer {
+    int in_use;
+    size_t offset; // bytes buffered
+    size_t size;   // flush once this many bytes are buffered
+    unsigned char data[FTP_WRITE_BUFFER_SIZE] FTP_FILE_BUFFER_ALIGN;
+};
+#endif
+
+#if FTP_IO_THREADS
+enum FTP_IO_STATE {
+    FTP_IO_STATE_EMPTY,   // free, or being filled by recv (STOR)
+    FTP_IO_STATE_FULL,    // waiting to be written (STOR)
+    FTP_IO_STATE_PENDING, // queued or being serviced by a worker
+    FTP_IO_STATE_DONE,    // worker finished, waiting to be reaped
+    FTP_IO_STATE_READY,   // data waiting to be sent (RETR)
+};
+
+struct FtpIoBuffer {
+    enum FTP_IO_STATE state;
+    int result; // result of the vfs read / write
+    int error;  // errno if result < 0
+    size_t offset; // bytes sent so far (RETR)
+    size_t size;   // bytes in the buffer
+    unsigned char data[FTP_FILE_BUFFER_SIZE] FTP_FILE_BUFFER_ALIGN;
+};
+
+struct FtpIoSlot {
+    struct FtpSession* session; // owner, NULL if free
+    int eof;         // set when the file (RETR) or socket (STOR) is drained
+    int error;       // errno of a failed write (STOR)
+    unsigned cur;    // buffer used by the socket side
+    unsigned head;   // next buffer to be read / written by a worker
+    unsigned pending; // buffer being read / written by a worker
+    int flush;       // set if the write buffer should be flushed after the write (STOR)
+    size_t read_offset; // bytes queued to be read (RETR)
+    struct FtpIoBuffer bufs[2];
+};
+#endif
+
+#if FTP_ZLIB_STREAMS
+struct FtpZlibStream {
+    int in_use;
+    int init;      // set once deflateInit() / inflateInit() has been called
+    int inflate;   // set if decompressing (STOR)
+    int level;     // deflate level
+    int finished;  // set once the end of the stream has been reached
+    z_stream strm;
+    size_t offset; // bytes of data sent (deflate)
+    size_t size;   // bytes in data (deflate)
+    unsigned char data[FTP_ZLIB_BUFFER_SIZE];
+};
+#endif
+
+#if FTP_TLS
+// a TLS connection. the handshake is done over the socket so that openssl can hand the
+// encryption to the kernel (kTLS), otherwise records are written to the bio pair and sent from it.
+struct FtpTls {
+    SSL* ssl;
+    BIO* bio;       // network side of the bio pair records are written to, NULL with kTLS
+    int ready;      // set once the handshake is done
+    int want_write; // set if the handshake is waiting for the socket to be writable
+    int ktls_send;  // set if the kernel encrypts whatever is sent on the socket
+};
+#endif
+
+// a PASV socket that is bound and listening, kept open to be handed out again.
+struct FtpPasvListener {
+    int sock;
+    unsigned port;
+};
+
+// token bucket, each token is a byte that can be transferred.
+struct FtpRateLimit {
+    long long tokens; // goes negative when more is sent than was allowed for, e.g. MODE E headers
+    unsigned long long last_ms; // time of the last refill
+};
+
+struct FtpRateLimitIp {
+    unsigned refs; // number of sessions using this, 0 if free
+    struct in_addr addr;
+    struct FtpRateLimit bucket;
+};
+
+// MODE B state, the same buffer is used for the headers (and restart markers)
+// waiting to be sent, and for the header (and restart marker) being received.
+struct FtpBlock {
+    unsigned char buf[32];
+    size_t offset; // bytes of buf sent
+    size_t size;   // bytes in buf
+    size_t count;  // data bytes left in the current block
+    size_t marker; // file offset of the next restart marker (RETR)
+    size_t data_offset; // offset of the next block (MODE E)
+    int flags;     // descriptor of the block being received (STOR)
+    int eof;       // set once the EOF block has been queued / received
+};
+
+#if FTP_STRIPE_COUNT
+// a data connection used by a striped transfer, each one sends / receives
+// whole blocks which can be at any offset in the file.
+struct FtpStripe {
+    struct FtpSession* session; // owner, NULL if free
+    int sock;      // -1 whilst reserved for a connection that isn't open yet
+    int eod;       // set once EOD has been sent / received
+    unsigned char header[FTP_BLOCK_EXTENDED_HEADER_SIZE];
+    size_t header_offset; // bytes of the header sent / received
+    size_t header_size;   // bytes of the header waiting to be sent (RETR)
+    int flags;     // descriptor of the current block
+    size_t count;  // data bytes left in the current block
+    size_t offset; // file offset of the next byte in the current block
+};
+#endif
+
+#if FTP_HASH_CACHE_ENTRIES
+struct FtpHashCacheEntry {
+    struct Pathname path;
+    size_t size;  // file size and mtime when the digest was made
+    time_t mtime;
+    size_t start; // range of the file that was hashed
+    size_t end;
+    enum FtpHashType type;
+    unsigned char digest[FTP_HASH_MAX_SIZE];
+    unsigned long long used; // 0 if unused, otherwise when it was last used
+};
+#endif
+
+// used by SITE BLOCKSUMS and by STOR after SITE DELTA.
+struct FtpDelta {
+    int active;           // set if STOR is a delta upload
+    int done;             // set once the new file has replaced the old one (STOR)
+    struct FtpVfsFile basis; // the old file, read by COPY records (STOR)
+    unsigned char header[FTP_DELTA_HEADER_SIZE];
+    size_t header_size;   // bytes of the record header received (STOR)
+    int op;               // op of the current record (STOR)
+    size_t count;         // bytes left in the current record (STOR)
+    size_t offset;        // old file offset of the next COPY byte (STOR)
+    size_t size;          // bytes of the new file so far (STOR)
+
+    size_t block_size;    // (BLOCKSUMS)
+    size_t block_offset;  // bytes of the current block summed so far (BLOCKSUMS)
+    uint32_t a, b;        // rolling checksum of the current block (BLOCKSUMS)
+    size_t out_offset;    // bytes of list_buf sent (BLOCKSUMS)
+    size_t out_size;      // bytes of records waiting in list_buf (BLOCKSUMS)
+};
+
+#if FTP_TAR_DEPTH
+// used by RETR <dir>.tar, temp_path is the path of the entry being sent, directories end with a '/'.
+struct FtpTar {
+    struct FtpVfsDir dirs[FTP_TAR_DEPTH]; // directories being read, the last one is the deepest
+    unsigned depth;       // directories open
+    size_t base;          // offset of the name used in the archive in temp_path
+    enum FTP_TAR_PART part;
+    size_t offset;        // bytes of the part sent
+    size_t size;          // size of the part
+    size_t body;          // size of the file being sent
+};
+#endif
+
+// used by STOR after SITE UNTAR, temp_path is the directory being extracted to followed
+// by the name of the entry, and the header is put together in list_buf.
+struct FtpUntar {
+    int active;           // set if STOR is extracting an archive
+    int eof;              // set once the end of the archive is received
+    size_t base;          // length of the directory in temp_path
+    size_t header_size;   // bytes of the header received
+    char type;            // type of the entry
+    enum FTP_UNTAR_DATA data;
+    size_t size;          // data bytes of the entry
+    size_t count;         // data bytes of the entry left
+    size_t pad;           // bytes left to the end of the last record of the entry
+    size_t name_size;     // bytes of the long name / pax header received
+    int long_name;        // set if temp_path already has the name of the next entry
+    unsigned long long pax_size; // size of the next entry from a pax header, 0 if none
+};
+
 struct FtpTransfer {
     enum FTP_TRANSFER_MODE mode;
+    int finishing; // set whilst the end of the data is being sent (MODE Z / MODE B)
+    int keep_open; // set if the data connection is to be reused after the transfer (MODE B)
 
     size_t offset;
     size_t size; // only set during RETR, LIST and NLIST.
-    size_t index; // only used for NLIST and LIST devices.
+    size_t index; // only used for NLIST and LIST devices, and by SITE RMTREE.
+    size_t deficit; // bytes that can be moved before yielding to other sessions
 
     struct FtpVfsFile file_vfs;
     struct FtpVfsDir dir_vfs;
 
+    size_t write_offset; // file offset of the next write (STOR)
+    size_t alloc_size;   // bytes reserved using ftp_vfs_allocate(), 0 if none (STOR)
+    int alloc_failed;    // set once the fs refuses to preallocate (STOR)
+    int sparse;          // set if runs of zeros are left as holes (STOR)
+    int sparse_seek;     // set whilst the file offset is behind write_offset after a hole (STOR)
+    size_t sparse_end;   // holes below this are punched as the file may have data there (STOR)
+    int ascii;           // set if line endings are converted (TYPE A)
+    int ascii_cr;        // set if the last byte sent was a CR (RETR), or a CR is held back (STOR)
+
+    enum FtpVfsCache cache;  // page cache policy in use
+    int cache_checked;       // set once the cache policy has been applied
+    size_t drop_offset;      // file offset that has not yet been dropped from the cache
+    size_t writeback_offset; // file offset that writeback has been started up to
+
+#if FTP_IO_THREADS
+    struct FtpIoSlot* io; // set if disk io is done by the io threads.
+#endif
+#if FTP_WRITE_BUFFER_COUNT
+    struct FtpWriteBuffer* wb; // set if writes are being buffered.
+#endif
+#if FTP_ZLIB_STREAMS
+    struct FtpZlibStream* zlib; // set if using MODE Z.
+#endif
+    struct FtpBlock block; // used if using MODE B, and for MODE E listings.
+#if FTP_STRIPE_COUNT
+    unsigned stripes;     // data connections reserved, 0 if not striped
+    unsigned stripe_eods; // EOD blocks received (STOR)
+    unsigned stripe_eodc; // number of EOD blocks to expect, 0 until EOF is received (STOR)
+    int stripe_eof;       // set once EOF has been queued (RETR)
+    int stripe_ready;     // set by the loop if a data connection is ready
+    unsigned long long stripe_deadline_ms; // PASV connections not opened by then are given up on
+#endif
+
+    struct FtpHash hash; // used by HASH / XCRC / XMD5, and by STOR if hash_inline is set
+    size_t hash_start;   // file offset the digest starts at
+    int hash_reply;      // reply code, 213 for HASH, 250 for XCRC / XMD5
+    int hash_inline;     // set if STOR is hashing the data as it's written, 2 once it completes
+    struct FtpDelta delta;
+    struct FtpVfsFile copy_vfs; // destination of SITE CPTO
+    int copy_fast;              // set whilst ftp_vfs_copy() works for SITE CPTO
+#if FTP_TAR_DEPTH
+    struct FtpTar tar;
+#endif
+    struct FtpUntar untar;
+
+    struct Pathname temp_path; // rename from buffer / LIST / HASH / STOR fullpath
     char list_buf[1024];
 };
 
@@ -122,20 +618,45 @@ struct FtpSession {
     enum FTP_STRUCTURE structure;
     enum FTP_DATA_CONNECTION data_connection;
 
-    struct FtpTransfer transfer;
+    struct FtpTransfer* transfer; // NULL whilst idle, see ftp_transfer_acquire()
+    enum FTP_PATH_PENDING path_pending; // set by RNFR and SITE CPFR, the transfer context holds the path for RNTO / CPTO
 
     int control_sock; // socket for commands
     int data_sock;    // socket for data (PORT/PASV)
     int pasv_sock;    // socket for PASV listen fd
+    unsigned pasv_port; // port pasv_sock is bound to, reserved until it's closed
+    int data_early;      // data_sock was accepted / connected after PASV / PORT, before the transfer command
+    int data_connecting; // data_sock is still connecting to the PORT address
 
     struct sockaddr_in control_sockaddr;
+    struct sockaddr_in peer_sockaddr; // the client's address, PASV connections from anywhere else are refused
     struct sockaddr_in data_sockaddr;
     struct sockaddr_in pasv_sockaddr;
 
-    int server_marker; // file offset when using REST
+    long long server_marker; // file offset when using REST, -1 for APPE
+    size_t range_end; // one past the last byte when using RANG, 0 if unset
+
+    struct FtpRateLimit rate_limit;
+    struct FtpRateLimitIp* ip_rate_limit; // shared with sessions from the same address
+    size_t alloc_size; // file size given by ALLO, used by the next STOR
+    unsigned parallelism; // number of data connections for MODE E, set by OPTS
+    enum FtpHashType hash_type; // used by HASH, set by OPTS HASH
+    int delta_next; // set by SITE DELTA, the next STOR is a delta upload
+    int untar_next; // set by SITE UNTAR, the next STOR is an archive to extract
+#if FTP_TLS
+    struct FtpTls control_tls; // set up by AUTH TLS
+    struct FtpTls data_tls;    // set up for each data connection with PROT P
+    unsigned long long control_wait_ms; // when the control connection started waiting on the handshake or socket, 0 if it isn't
+    int control_dropped; // set if a reply didn't fit in the queue, the loop closes the session
+    int tls_pbsz;    // set once PBSZ has been sent
+    int tls_private; // set by PROT P, data connections use TLS
+#endif
+#if FTP_CMD_QUEUE_SIZE
+    char cmd_queue[FTP_CMD_QUEUE_SIZE]; // lines received during a transfer, always null terminated
+    size_t cmd_queue_len;
+#endif
 
     struct Pathname pwd;   // current directory
-    struct Pathname temp_path; // rename from buffer / LIST fullpath
 };
 
 struct FtpCommand {
@@ -143,17 +664,78 @@ struct FtpCommand {
     void (*cmd_func)(struct FtpSession* session, const char* data);
     int auth_required;
     int args_required;
+    int transfer_required; // the command uses session->transfer, see ftp_transfer_acquire()
 };
 
 struct Ftp {
     int initialised;
     int server_sock;
 
+    // sized by the config, from the arena or memory allocated by ftpsrv_init().
+    void* memory; // set if allocated, freed by ftpsrv_exit()
     unsigned session_count;
-    struct FtpSession sessions[FTP_MAX_SESSIONS];
+    struct FtpSession* sessions; // cfg.max_sessions
+    struct FtpTransfer* transfers;      // cfg.max_transfers
+    struct FtpTransfer** transfer_free; // transfers not held by a session
+    unsigned transfer_free_count;
+    unsigned char* data_buf;     // cfg.file_buffer_size
+#if defined(HAVE_POLL) && HAVE_POLL
+    struct pollfd* fds; // see ftpsrv_loop()
+#endif
 
-    unsigned char data_buf[FTP_FILE_BUFFER_SIZE];
+#if FTP_ASCII_BUFFER_SIZE
+    char ascii_buf[FTP_ASCII_BUFFER_SIZE];
+#endif
     struct FtpSrvConfig cfg;
+
+    struct FtpRateLimit rate_limit;
+    struct FtpRateLimitIp* ip_rate_limits; // cfg.max_sessions
+
+    size_t sched_start[2]; // session that is serviced first, for listings and bulk transfers
+
+    uint32_t pasv_ports[65536 / 32]; // bitmap of the ports held by PASV listeners
+    unsigned pasv_port_next;         // where the search for a free port starts
+#if FTP_PASV_POOL_SIZE
+    struct FtpPasvListener pasv_pool[FTP_PASV_POOL_SIZE]; // listeners that aren't in use
+    unsigned pasv_pool_count;
+#endif
+
+#if FTP_TLS
+    SSL_CTX* tls_ctx; // NULL if no certificate is set, in which case AUTH TLS is refused
+#endif
+
+#if FTP_WRITE_BUFFER_COUNT
+    struct FtpWriteBuffer write_buffers[FTP_WRITE_BUFFER_COUNT];
+#endif
+
+#if FTP_ZLIB_STREAMS
+    struct FtpZlibStream zlib_streams[FTP_ZLIB_STREAMS];
+#endif
+
+#if FTP_STRIPE_COUNT
+    struct FtpStripe stripes[FTP_STRIPE_COUNT];
+#endif
+
+#if FTP_HASH_CACHE_ENTRIES
+    struct FtpHashCacheEntry hash_cache[FTP_HASH_CACHE_ENTRIES];
+    unsigned long long hash_cache_used;
+#endif
+
+#if FTP_IO_THREADS
+    struct {
+        int started;
+        int quit;
+        int pipe_fds[2]; // written by workers on completion, polled by the loop.
+        pthread_t threads[FTP_IO_THREADS];
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;      // signalled when work is queued
+        pthread_cond_t done_cond; // signalled when work is completed
+        struct FtpIoSlot* queue[FTP_IO_SLOTS];
+        unsigned queue_head;
+        unsigned queue_count;
+        struct FtpIoSlot slots[FTP_IO_SLOTS];
+    } io;
+#endif
 };
 
 static struct Ftp g_ftp = {0};
@@ -231,11 +813,18 @@ static int ftp_set_socket_nonblocking_enable(int sock) {
     return rc;
 }
 
-static inline unsigned socket_bind_port(void) {
-    static unsigned port = 49152;
-    const unsigned ret = port;
-    port = (port == 65535) ? 49152 : port + 1;
-    return ret;
+// waits for a non-blocking socket to be readable / writable, returns 0 on timeout.
+static int ftp_socket_wait(int sock, bool write, int timeout_ms) {
+#if defined(HAVE_POLL) && HAVE_POLL
+    struct pollfd fd = { .fd = sock, .events = write ? POLLOUT : POLLIN };
+    return socket_poll(&fd, 1, timeout_ms);
+#else
+    fd_set set;
+    FD_ZERO(&set);
+    FD_SET(sock, &set);
+    struct timeval tv = { timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
+    return socket_select(sock + 1, write ? NULL : &set, write ? &set : NULL, NULL, &tv);
+#endif
 }
 
 // removes dangling '/' and duplicate '/' and converts '\\' to '/'
@@ -305,6 +894,16 @@ static int build_fullpath(const struct FtpSession* session, struct Pathname* out
     return rc;
 }
 
+// returns true if the path has a "." or ".." name in it, build_fullpath() only resolves a lone "..".
+static bool ftp_path_has_dots(const char* path) {
+    for (const char* p = path; (p = strstr(p, "/.")); p++) {
+        if (p[2] == '\0' || p[2] == '/' || (p[2] == '.' && (p[3] == '\0' || p[3] == '/'))) {
+            return true;
+        }
+    }
+    return false;
+}
+
 // converts the path to be used for fs functions, such as open and opendir
 // this cannot fail, unless the path is invalid, in which case it should've
 // been handled in build_path error code.
@@ -325,7 +924,7 @@ static inline struct Pathname fix_path_for_device(const struct Pathname* path) {
 // SOURCE: https://cr.yp.to/ftp/list/binls.html
 static int ftp_build_list_entry(struct FtpSession* session, const time_t cur_time, const struct Pathname* fullpath, const char* name, const struct stat* st, int nlist) {
     int rc;
-    struct FtpTransfer* transfer = &session->transfer;
+    struct FtpTransfer* transfer = session->transfer;
 
     if (nlist) {
         rc = snprintf(transfer->list_buf, sizeof(transfer->list_buf), "%s" TELNET_EOL, name);
@@ -404,187 +1003,4004 @@ static int ftp_build_list_entry(struct FtpSession* session, const time_t cur_tim
     return rc;
 }
 
-static void ftp_client_msg(const struct FtpSession* session, const char* fmt, ...) {
-    char buf[1024 * 4] = {0};
-    va_list va;
-    va_start(va, fmt);
-    vsnprintf(buf, sizeof(buf) - 2, fmt, va);
-    va_end(va);
+#if FTP_TLS
+// largest record openssl writes, a whole one has to fit in the bio before writing.
+#define FTP_TLS_RECORD_MAX (SSL3_RT_HEADER_LENGTH + SSL3_RT_MAX_PLAIN_LENGTH + SSL3_RT_MAX_ENCRYPTED_OVERHEAD)
 
-    const int code = atoi(buf);
-    if (code < 400) {
-        ftp_log_callback(FTP_API_LOG_TYPE_RESPONSE, buf);
-    } else {
-        ftp_log_callback(FTP_API_LOG_TYPE_ERROR, buf);
+// loads the certificate and key, TLS is left off if they aren't set or fail to load.
+static void ftp_tls_init(void) {
+    const struct FtpSrvConfig* cfg = &g_ftp.cfg;
+    if (!cfg->tls_cert || !cfg->tls_cert[0]) {
+        return;
     }
 
-    strcat(buf, TELNET_EOL);
-    socket_send(session->control_sock, buf, strlen(buf), 0);
-}
+    // the key may be in the same file as the certificate.
+    const char* key = cfg->tls_key && cfg->tls_key[0] ? cfg->tls_key : cfg->tls_cert;
+    SSL_CTX* ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx) {
+        ftp_log_callback(FTP_API_LOG_TYPE_ERROR, "tls: failed to create context");
+        return;
+    }
 
-// https://blog.netherlabs.nl/articles/2009/01/18/the-ultimate-so_linger-page-or-why-is-my-tcp-not-reliable
-static void ftp_close_socket(int* sock) {
-    // tldr: when send() returns, this does not mean that all data
-    // has been sent to the server. All this means is that the data
-    // has been sent to the kernel!
-    // when calling close, the kernel *may* remove that data, and
-    // thus the client will *not* receive it!
-    if (*sock > 0) {
-        socket_shutdown(*sock, SHUT_RDWR);
-        socket_close(*sock);
-        *sock = -1;
+    uint64_t options = 0;
+#ifdef SSL_OP_NO_RENEGOTIATION
+    options |= SSL_OP_NO_RENEGOTIATION;
+#endif
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    // most clients close the data connection after an upload without sending close_notify.
+    options |= SSL_OP_IGNORE_UNEXPECTED_EOF;
+#endif
+#ifdef SSL_OP_ENABLE_KTLS
+    options |= SSL_OP_ENABLE_KTLS;
+#endif
+    SSL_CTX_set_options(ctx, options);
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    // data connections resume the session of the control connection rather than doing a full handshake.
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_session_id_context(ctx, (const unsigned char*)"ftpsrv", 6);
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, cfg->tls_cert) != 1 || SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) != 1 || SSL_CTX_check_private_key(ctx) != 1) {
+        ftp_log_callback(FTP_API_LOG_TYPE_ERROR, "tls: failed to load the certificate or key");
+        SSL_CTX_free(ctx);
+        return;
     }
+
+    g_ftp.tls_ctx = ctx;
 }
 
-static int ftp_data_open(struct FtpSession* session) {
-    int rc = 0;
-    ftp_client_msg(session, "150 File status okay; about to open data connection.");
+static void ftp_tls_exit(void) {
+    SSL_CTX_free(g_ftp.tls_ctx);
+    g_ftp.tls_ctx = NULL;
+}
 
-    switch (session->data_connection) {
-        case FTP_DATA_CONNECTION_NONE:
-            rc = -1;
+// sets errno from the result of a failed openssl call, EAGAIN if it's waiting for the socket.
+static int ftp_tls_error(SSL* ssl, int rc) {
+    switch (SSL_get_error(ssl, rc)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
             break;
-        case FTP_DATA_CONNECTION_ACTIVE:
-            rc = session->data_sock = socket_open(PF_INET, SOCK_STREAM, 0);
-            if (rc > 0) {
-                rc = socket_connect(session->data_sock, (struct sockaddr*)&session->data_sockaddr, sizeof(session->data_sockaddr));
+        case SSL_ERROR_SYSCALL:
+            if (!errno) {
+                errno = ECONNRESET;
             }
             break;
-        case FTP_DATA_CONNECTION_PASSIVE: {
-            socklen_t socklen = sizeof(session->pasv_sockaddr);
-            rc = session->data_sock = socket_accept(session->pasv_sock, (struct sockaddr*)&session->pasv_sockaddr, &socklen);
+        default: {
+            const char* reason = ERR_reason_error_string(ERR_peek_last_error());
+            ftp_log_callback(FTP_API_LOG_TYPE_ERROR, reason ? reason : "tls: error");
+            errno = EPROTO;
         }
         break;
     }
+    return -1;
+}
 
-    if (rc > 0) {
-        ftp_set_socket_nonblocking_enable(session->data_sock);
-        ftp_set_socket_keepalive_enable(session->data_sock);
-        ftp_set_socket_throughput_enable(session->data_sock);
+// starts the server side of the handshake on the socket.
+static int ftp_tls_begin(struct FtpTls* tls, int sock) {
+    memset(tls, 0, sizeof(*tls));
+    tls->ssl = SSL_new(g_ftp.tls_ctx);
+    if (!tls->ssl || !SSL_set_fd(tls->ssl, sock)) {
+        SSL_free(tls->ssl);
+        tls->ssl = NULL;
+        errno = ENOMEM;
+        return -1;
     }
 
-    return rc;
+    SSL_set_accept_state(tls->ssl);
+    return 0;
 }
 
-static void ftp_data_transfer_end(struct FtpSession* session) {
-    switch (session->data_connection) {
-        case FTP_DATA_CONNECTION_NONE:
-            break;
-        case FTP_DATA_CONNECTION_ACTIVE:
-            ftp_close_socket(&session->data_sock);
-            break;
-        case FTP_DATA_CONNECTION_PASSIVE:
-            ftp_close_socket(&session->data_sock);
-            ftp_close_socket(&session->pasv_sock);
-            break;
+// carries on with the handshake, returns 1 once it's done, 0 if it's waiting for the socket and -1 on error.
+static int ftp_tls_handshake(struct FtpTls* tls) {
+    ERR_clear_error();
+    errno = 0;
+    const int rc = SSL_do_handshake(tls->ssl);
+    if (rc <= 0) {
+        tls->want_write = SSL_get_error(tls->ssl, rc) == SSL_ERROR_WANT_WRITE;
+        return ftp_tls_error(tls->ssl, rc) < 0 && errno == EAGAIN ? 0 : -1;
     }
 
-    ftp_vfs_close(&session->transfer.file_vfs);
-    ftp_vfs_closedir(&session->transfer.dir_vfs);
+    tls->ready = 1;
+    tls->want_write = 0;
+#ifndef OPENSSL_NO_KTLS
+    tls->ktls_send = BIO_get_ktls_send(SSL_get_wbio(tls->ssl));
+#endif
 
-    session->temp_path.s[0] = '\0';
-    session->transfer.offset = 0;
-    session->transfer.size = 0;
-    session->transfer.mode = FTP_TRANSFER_MODE_NONE;
-    session->data_connection = FTP_DATA_CONNECTION_NONE;
+    // records are written to a buffer from now on, so that a write the socket
+    // only takes part of doesn't have to be retried with the same data.
+    if (!tls->ktls_send) {
+        BIO* internal;
+        if (!BIO_new_bio_pair(&internal, FTP_TLS_BUFFER_SIZE, &tls->bio, 0)) {
+            errno = ENOMEM;
+            return -1;
+        }
+        SSL_set0_wbio(tls->ssl, internal);
+    }
+    return 1;
 }
 
-static void ftp_dir_data_transfer_progress(struct FtpSession* session) {
-    const time_t cur_time = time(NULL);
-    const bool nlist = session->transfer.mode == FTP_TRANSFER_MODE_NLST;
-    const bool device_list = g_ftp.cfg.devices && g_ftp.cfg.devices_count && !strcmp("/", session->temp_path.s);
-    const bool is_root = !strcmp("/", session->temp_path.s);
-    struct FtpTransfer* transfer = &session->transfer;
+// sends the records waiting in the bio, returns -1 and sets errno to EAGAIN
+// if the socket would block before all of them are sent.
+static int ftp_tls_flush(const struct FtpTls* tls, int sock) {
+    char* data;
+    int size;
+    while (tls->bio && (size = BIO_nread0(tls->bio, &data)) > 0) {
+        const int n = socket_send(sock, data, size, 0);
+        if (n < 0) {
+            return -1;
+        }
+        BIO_nread(tls->bio, &data, n);
+    }
+    return 0;
+}
+
+// sends the last of the records, returns 1 once everything has been sent,
+// 0 if the socket would block and -1 on error.
+static int ftp_tls_finish(const struct FtpTls* tls, int sock) {
+    if (ftp_tls_flush(tls, sock) < 0) {
+        return errno == EWOULDBLOCK || errno == EAGAIN ? 0 : -1;
+    }
+    return 1;
+}
+
+// encrypts and sends as much of buf as the socket takes, plus up to a buffer's worth more which is
+// sent first next time. returns the bytes used, the kernel does the work if it can (kTLS).
+static int ftp_tls_send(const struct FtpTls* tls, int sock, const void* buf, size_t size) {
+    if (tls->ktls_send) {
+        return socket_send(sock, buf, size, 0);
+    }
 
-    // send as much data as possible.
+    const unsigned char* data = buf;
+    size_t sent = 0;
     while (1) {
-        if (transfer->size) {
-            errno = 0;
-            const int n = socket_send(session->data_sock, transfer->list_buf + transfer->offset, transfer->size, 0);
-            if (n < 0) {
-                // check if it failed due to anything but blocking.
-                if (errno != EWOULDBLOCK && errno != EAGAIN) {
-                    ftp_client_msg(session, "426 bad Connection closed; transfer aborted, %s.", strerror(errno));
-                    ftp_data_transfer_end(session);
-                }
-                break;
-            } else if (n != transfer->size) {
-                // partial transfer.
-                transfer->offset += n;
-                transfer->size -= n;
-                break;
-            } else {
-                transfer->list_buf[0] = '\0';
-                transfer->offset = 0;
-                transfer->size = 0;
+        if (ftp_tls_flush(tls, sock) < 0 && errno != EWOULDBLOCK && errno != EAGAIN) {
+            return -1;
+        } else if (sent == size || BIO_ctrl_get_write_guarantee(SSL_get_wbio(tls->ssl)) < FTP_TLS_RECORD_MAX) {
+            break;
+        }
 
-                // check if we are finished with this transfer.
-                if (!ftp_vfs_isdir_open(&transfer->dir_vfs)) {
-                    if (!device_list || transfer->index == g_ftp.cfg.devices_count) {
-                        ftp_client_msg(session, "226 Closing data connection.");
-                        ftp_data_transfer_end(session);
-                        break;
+        const size_t n = size - sent < SSL3_RT_MAX_PLAIN_LENGTH ? size - sent : SSL3_RT_MAX_PLAIN_LENGTH;
+        ERR_clear_error();
+        errno = 0;
+        const int rc = SSL_write(tls->ssl, data + sent, n);
+        if (rc <= 0) {
+            return ftp_tls_error(tls->ssl, rc);
+        }
+        sent += rc;
+    }
+
+    if (!sent && size) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return sent;
+}
+
+// returns the bytes received, 0 once the client has closed the connection.
+static int ftp_tls_recv(const struct FtpTls* tls, int sock, void* buf, size_t size) {
+    ERR_clear_error();
+    errno = 0;
+    const int rc = SSL_read(tls->ssl, buf, size < INT_MAX ? size : INT_MAX);
+    if (rc > 0) {
+        return rc;
+    }
+
+    const int err = SSL_get_error(tls->ssl, rc);
+    if (err == SSL_ERROR_ZERO_RETURN || (err == SSL_ERROR_SYSCALL && !errno && !ERR_peek_error())) {
+        return 0;
+    }
+    ftp_tls_error(tls->ssl, rc);
+    // reading may have queued a record of its own, such as a key update.
+    if (errno == EAGAIN) {
+        ftp_tls_flush(tls, sock);
+        errno = EAGAIN;
+    }
+    return -1;
+}
+
+// sends close_notify if the socket takes it and frees the connection, the socket is closed by the caller.
+static void ftp_tls_close(struct FtpTls* tls, int sock) {
+    if (tls->ssl) {
+        if (tls->ready) {
+            ERR_clear_error();
+            SSL_shutdown(tls->ssl);
+            ftp_tls_flush(tls, sock);
+        }
+        SSL_free(tls->ssl);
+        BIO_free(tls->bio);
+    }
+    memset(tls, 0, sizeof(*tls));
+}
+
+// queues a reply on the control connection, the records the socket doesn't take are sent by the loop
+// once it's writable. returns -1 if the reply is dropped, which happens if the client isn't reading
+// its replies or the handshake isn't done, as it would go out in the clear.
+static int ftp_tls_send_reply(const struct FtpTls* tls, int sock, const char* buf, size_t size) {
+    if (!tls->ready) {
+        return -1;
+    }
+
+    while (size) {
+        const int n = ftp_tls_send(tls, sock, buf, size);
+        if (n < 0) {
+            return -1;
+        }
+        buf += n;
+        size -= n;
+    }
+    return 0;
+}
+#endif // FTP_TLS
+
+static void ftp_rate_limit_take(struct FtpSession* session, size_t size);
+
+// sends on the data connection, encrypted with PROT P.
+static int ftp_data_sock_send(struct FtpSession* session, const void* buf, size_t size) {
+#if FTP_TLS
+    const int n = session->data_tls.ssl ? ftp_tls_send(&session->data_tls, session->data_sock, buf, size) : socket_send(session->data_sock, buf, size, 0);
+#else
+    const int n = socket_send(session->data_sock, buf, size, 0);
+#endif
+    if (n > 0) {
+        ftp_rate_limit_take(session, n);
+    }
+    return n;
+}
+
+// receives on the data connection, decrypted with PROT P.
+static int ftp_data_sock_recv(struct FtpSession* session, void* buf, size_t size) {
+#if FTP_TLS
+    const int n = session->data_tls.ssl ? ftp_tls_recv(&session->data_tls, session->data_sock, buf, size) : socket_recv(session->data_sock, buf, size, 0);
+#else
+    const int n = socket_recv(session->data_sock, buf, size, 0);
+#endif
+    if (n > 0) {
+        ftp_rate_limit_take(session, n);
+    }
+    return n;
+}
+
+// returns true whilst the data connection is waiting on the TLS handshake.
+static inline bool ftp_data_tls_pending(const struct FtpSession* session) {
+#if FTP_TLS
+    return session->data_tls.ssl && !session->data_tls.ready;
+#else
+    return false;
+#endif
+}
+
+static void ftp_client_msg(struct FtpSession* session, const char* fmt, ...) {
+    char buf[1024 * 4] = {0};
+    va_list va;
+    va_start(va, fmt);
+    vsnprintf(buf, sizeof(buf) - 2, fmt, va);
+    va_end(va);
+
+    const int code = atoi(buf);
+    if (code < 400) {
+        ftp_log_callback(FTP_API_LOG_TYPE_RESPONSE, buf);
+    } else {
+        ftp_log_callback(FTP_API_LOG_TYPE_ERROR, buf);
+    }
+
+    strcat(buf, TELNET_EOL);
+#if FTP_TLS
+    if (session->control_tls.ssl) {
+        if (!session->control_dropped && ftp_tls_send_reply(&session->control_tls, session->control_sock, buf, strlen(buf)) < 0) {
+            ftp_log_callback(FTP_API_LOG_TYPE_ERROR, "tls: reply dropped, closing the session");
+            session->control_dropped = 1;
+        }
+        return;
+    }
+#endif
+    socket_send(session->control_sock, buf, strlen(buf), 0);
+}
+
+// https://blog.netherlabs.nl/articles/2009/01/18/the-ultimate-so_linger-page-or-why-is-my-tcp-not-reliable
+static void ftp_close_socket(int* sock) {
+    // tldr: when send() returns, this does not mean that all data
+    // has been sent to the server. All this means is that the data
+    // has been sent to the kernel!
+    // when calling close, the kernel *may* remove that data, and
+    // thus the client will *not* receive it!
+    if (*sock > 0) {
+        socket_shutdown(*sock, SHUT_RDWR);
+        socket_close(*sock);
+        *sock = -1;
+    }
+}
+
+// returns the range of ports PASV listens on, both ends are inclusive.
+static void ftp_pasv_range(unsigned* min, unsigned* max) {
+    *min = g_ftp.cfg.pasv_port_min ? g_ftp.cfg.pasv_port_min : FTP_PASV_PORT_MIN;
+    *max = g_ftp.cfg.pasv_port_max ? g_ftp.cfg.pasv_port_max : FTP_PASV_PORT_MAX;
+    if (*max > 65535) {
+        *max = 65535;
+    }
+    if (*min < 1 || *min > *max) {
+        *min = *max;
+    }
+}
+
+// reserves the next port in the range that isn't held by a listener, 0 if they all are.
+// the bitmap is checked a word at a time, so full stretches of the range are skipped quickly.
+static unsigned ftp_pasv_port_alloc(void) {
+    unsigned min, max;
+    ftp_pasv_range(&min, &max);
+
+    unsigned port = g_ftp.pasv_port_next >= min && g_ftp.pasv_port_next <= max ? g_ftp.pasv_port_next : min;
+    unsigned left = max - min + 1;
+    while (left) {
+        const uint32_t free = ~g_ftp.pasv_ports[port / 32] & (UINT32_MAX << (port % 32));
+        const unsigned end = (port | 31) < max ? (port | 31) : max;
+        for (unsigned i = port; free && i <= end && i - port < left; i++) {
+            if (free & (1u << (i % 32))) {
+                g_ftp.pasv_ports[i / 32] |= 1u << (i % 32);
+                g_ftp.pasv_port_next = i + 1;
+                return i;
+            }
+        }
+
+        if (end - port + 1 >= left) {
+            break;
+        }
+        left -= end - port + 1;
+        port = end < max ? end + 1 : min;
+    }
+    return 0;
+}
+
+static void ftp_pasv_port_free(unsigned port) {
+    g_ftp.pasv_ports[port / 32] &= ~(1u << (port % 32));
+}
+
+// opens a listener on a free port in the range. a port taken by something outside
+// of the server is skipped, each free port in the range is tried at most once.
+static int ftp_pasv_open(struct FtpPasvListener* listener) {
+    unsigned min, max;
+    ftp_pasv_range(&min, &max);
+
+    // the search carries on from the port after the last one tried, so a port
+    // that failed isn't tried again until the rest of the range has been.
+    errno = EADDRINUSE;
+    for (unsigned i = 0; i <= max - min; i++) {
+        const unsigned port = ftp_pasv_port_alloc();
+        if (!port) {
+            errno = EADDRINUSE;
+            return -1;
+        }
+
+        int sock = socket_open(PF_INET, SOCK_STREAM, 0);
+        if (sock < 0) {
+            ftp_pasv_port_free(port);
+            return -1;
+        }
+
+        struct sockaddr_in sa = {
+            .sin_family = PF_INET,
+            .sin_port = htons(port),
+            .sin_addr.s_addr = INADDR_ANY,
+        };
+
+        // the port may still have connections in TIME_WAIT from its last use.
+        ftp_set_socket_reuseaddr_enable(sock);
+        // the connection is accepted by the loop as soon as it arrives, so accept() must not block.
+        ftp_set_socket_nonblocking_enable(sock);
+        // striped transfers have the client open several data connections at once.
+        if (!socket_bind(sock, (struct sockaddr*)&sa, sizeof(sa)) && !socket_listen(sock, FTP_STRIPE_COUNT ? FTP_STRIPE_MAX : 1)) {
+            listener->sock = sock;
+            listener->port = port;
+            return 0;
+        }
+
+        // closing the socket can change errno, keep the reason bind / listen failed.
+        const int err = errno;
+        ftp_close_socket(&sock);
+        ftp_pasv_port_free(port);
+        errno = err;
+    }
+    return -1;
+}
+
+#if FTP_PASV_POOL_SIZE
+// drops the connections waiting on a pooled listener, so that they aren't accepted
+// by the session that gets the listener next.
+static void ftp_pasv_drain(int pasv_sock) {
+    int sock;
+    while ((sock = socket_accept(pasv_sock, NULL, NULL)) > 0) {
+        ftp_close_socket(&sock);
+    }
+}
+#endif
+
+// hands out a listener to the session, from the pool if there's one spare.
+static int ftp_pasv_acquire(struct FtpSession* session) {
+    struct FtpPasvListener listener;
+#if FTP_PASV_POOL_SIZE
+    if (g_ftp.pasv_pool_count) {
+        listener = g_ftp.pasv_pool[--g_ftp.pasv_pool_count];
+        // the port is still listening whilst in the pool, so anyone could have connected since.
+        ftp_pasv_drain(listener.sock);
+    } else
+#endif
+    if (ftp_pasv_open(&listener) < 0) {
+        return -1;
+    }
+
+    session->pasv_sock = listener.sock;
+    session->pasv_port = listener.port;
+    return 0;
+}
+
+// returns the listener to the pool, or closes it if the pool is full.
+static void ftp_pasv_release(struct FtpSession* session) {
+    if (session->pasv_sock <= 0) {
+        return;
+    }
+
+#if FTP_PASV_POOL_SIZE
+    if (g_ftp.pasv_pool_count < FTP_ARR_SZ(g_ftp.pasv_pool)) {
+        // connections the client made but didn't use are dropped.
+        ftp_pasv_drain(session->pasv_sock);
+
+        struct FtpPasvListener* listener = &g_ftp.pasv_pool[g_ftp.pasv_pool_count++];
+        listener->sock = session->pasv_sock;
+        listener->port = session->pasv_port;
+        session->pasv_sock = -1;
+        session->pasv_port = 0;
+        return;
+    }
+#endif
+
+    ftp_close_socket(&session->pasv_sock);
+    ftp_pasv_port_free(session->pasv_port);
+    session->pasv_port = 0;
+}
+
+// fills the pool so that the first PASVs don't have to make a listener. a slot
+// that can't be filled is skipped, PASV opens a listener itself when it's empty.
+static void ftp_pasv_init(void) {
+#if FTP_PASV_POOL_SIZE
+    for (size_t i = 0; i < FTP_ARR_SZ(g_ftp.pasv_pool); i++) {
+        if (!ftp_pasv_open(&g_ftp.pasv_pool[g_ftp.pasv_pool_count])) {
+            g_ftp.pasv_pool_count++;
+        }
+    }
+#endif
+}
+
+static void ftp_pasv_exit(void) {
+#if FTP_PASV_POOL_SIZE
+    while (g_ftp.pasv_pool_count) {
+        ftp_close_socket(&g_ftp.pasv_pool[--g_ftp.pasv_pool_count].sock);
+    }
+#endif
+    memset(g_ftp.pasv_ports, 0, sizeof(g_ftp.pasv_ports));
+}
+
+// applies the configured cache policy once the file is large enough,
+// falling back to a weaker policy if the vfs doesn't support it.
+static void ftp_file_set_cache(struct FtpTransfer* transfer, size_t size, size_t off) {
+    if (transfer->cache_checked || size < g_ftp.cfg.cache_threshold) {
+        return;
+    }
+
+    enum FtpVfsCache cache = FtpVfsCache_DEFAULT;
+    switch (g_ftp.cfg.cache_policy) {
+        case FTP_API_CACHE_POLICY_DEFAULT: cache = FtpVfsCache_DEFAULT; break;
+        case FTP_API_CACHE_POLICY_SEQUENTIAL: cache = FtpVfsCache_SEQUENTIAL; break;
+        case FTP_API_CACHE_POLICY_DROP_BEHIND: cache = FtpVfsCache_DROP_BEHIND; break;
+        case FTP_API_CACHE_POLICY_DIRECT: cache = FtpVfsCache_DIRECT; break;
+    }
+
+    while (cache != FtpVfsCache_DEFAULT && ftp_vfs_set_cache(&transfer->file_vfs, cache) < 0) {
+        cache = cache == FtpVfsCache_DIRECT ? FtpVfsCache_DROP_BEHIND : FtpVfsCache_DEFAULT;
+    }
+
+    transfer->cache = cache;
+    transfer->cache_checked = 1;
+    transfer->drop_offset = off;
+    transfer->writeback_offset = off;
+}
+
+// drops what has been transferred from the page cache, FTP_DROP_BEHIND_SIZE
+// at a time. the most recent chunk is left alone as sendfile may still have it
+// queued on the socket. ftp_vfs_drop_cache() doesn't wait for dirty pages to
+// be written out, so each chunk is passed again on the next call, by which
+// time the writeback started for it the first time has had time to finish.
+static void ftp_file_drop_behind(struct FtpTransfer* transfer, size_t off, int force) {
+    if (transfer->cache != FtpVfsCache_DROP_BEHIND) {
+        return;
+    }
+
+    if (!force) {
+        if (off - transfer->writeback_offset < FTP_DROP_BEHIND_SIZE * 2) {
+            return;
+        }
+        off -= FTP_DROP_BEHIND_SIZE;
+    }
+
+    if (off > transfer->writeback_offset) {
+        ftp_vfs_drop_cache(&transfer->file_vfs, transfer->drop_offset, off - transfer->drop_offset);
+        transfer->drop_offset = transfer->writeback_offset;
+        transfer->writeback_offset = off;
+    }
+}
+
+// returns true if the data goes on the wire and to the file as is (MODE S, TYPE I), otherwise it is
+// compressed, framed, converted or parsed on the loop, so sendfile and the io threads can't be used.
+static inline bool ftp_data_transfer_is_raw(const struct FtpSession* session) {
+    return session->mode == FTP_MODE_STREAM && !session->transfer->delta.active && !session->transfer->untar.active && !session->transfer->ascii;
+}
+
+// returns true if the transfer doesn't use the data connection.
+static inline bool ftp_data_transfer_is_local(const struct FtpSession* session) {
+    switch (session->transfer->mode) {
+        case FTP_TRANSFER_MODE_HASH:
+        case FTP_TRANSFER_MODE_COPY:
+        case FTP_TRANSFER_MODE_RMTREE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// returns true if TYPE A is used with MODE E, which isn't supported as each block is
+// at a file offset, and converting the line endings changes the offsets.
+static inline bool ftp_ascii_is_striped(const struct FtpSession* session) {
+    return FTP_ASCII_BUFFER_SIZE && session->type == FTP_TYPE_ASCII && session->mode == FTP_MODE_EXTENDED;
+}
+
+// sendfile goes through the page cache, so it's skipped for O_DIRECT.
+// with PROT P it's only used if the kernel does the encryption.
+static inline bool ftp_file_use_sendfile(const struct FtpSession* session) {
+#if defined(FTP_VFS_FD) && defined(HAVE_SENDFILE) && HAVE_SENDFILE
+#if FTP_TLS
+    if (session->data_tls.ssl && !session->data_tls.ktls_send) {
+        return false;
+    }
+#endif
+    return session->transfer->cache != FtpVfsCache_DIRECT && ftp_data_transfer_is_raw(session);
+#else
+    return false;
+#endif
+}
+
+// grows the file ahead of the write so that the fs doesn't have to extend
+// it on every write, the file is trimmed back in ftp_data_transfer_end().
+static void ftp_file_preallocate(struct FtpTransfer* transfer, size_t end) {
+    if (!FTP_PREALLOCATE_MIN || transfer->alloc_failed || end <= transfer->alloc_size) {
+        return;
+    }
+
+    size_t step = transfer->alloc_size;
+    if (step < FTP_PREALLOCATE_MIN) {
+        step = FTP_PREALLOCATE_MIN;
+    } else if (step > FTP_PREALLOCATE_MAX) {
+        step = FTP_PREALLOCATE_MAX;
+    }
+
+    size_t size = transfer->alloc_size + step;
+    if (size < end) {
+        size = end;
+    }
+
+    // a failure here isn't fatal, the write will report if it's out of space.
+    if (size < transfer->alloc_size || ftp_vfs_allocate(&transfer->file_vfs, size) < 0) {
+        transfer->alloc_failed = 1;
+    } else {
+        transfer->alloc_size = size;
+    }
+}
+
+#if FTP_SPARSE_BLOCK_SIZE
+// returns true if the block is all zeros, size is a multiple of 64. the words are or'd
+// together a line at a time without branching so that the compiler can vectorise it.
+static bool ftp_is_zero(const void* buf, size_t size) {
+    const unsigned char* p = buf;
+    for (size_t i = 0; i < size; i += 64) {
+        uint64_t w[8];
+        memcpy(w, p + i, sizeof(w));
+        if (w[0] | w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// writes the data, runs of whole blocks of zeros are skipped over instead, which leaves a hole
+// once the next data is written. holes where the file may already have data are punched out,
+// if the fs can't do that then the zeros are written from then on.
+static int ftp_file_sparse_write(struct FtpTransfer* transfer, const void* buf, size_t size) {
+    const unsigned char* data = buf;
+    size_t done = 0;
+
+    while (done < size) {
+        const size_t off = transfer->write_offset + done;
+        const size_t left = size - done;
+        size_t len = FTP_SPARSE_BLOCK_SIZE - off % FTP_SPARSE_BLOCK_SIZE;
+        const bool zero = transfer->sparse && len == FTP_SPARSE_BLOCK_SIZE && left >= len && ftp_is_zero(data + done, len);
+
+        // the run carries on until a block of the other kind, a partial block at the end is written.
+        len = len < left ? len : left;
+        while (left - len >= FTP_SPARSE_BLOCK_SIZE && ftp_is_zero(data + done + len, FTP_SPARSE_BLOCK_SIZE) == zero) {
+            len += FTP_SPARSE_BLOCK_SIZE;
+        }
+        if (!zero && left - len < FTP_SPARSE_BLOCK_SIZE) {
+            len = left;
+        }
+
+        if (zero) {
+            int rc = 0;
+            if (off < transfer->sparse_end) {
+                rc = ftp_vfs_punch(&transfer->file_vfs, off, len);
+            } else if (off < transfer->alloc_size) {
+                // space is reserved from the start of the file, so reserving more would fill the
+                // holes back in, and what's reserved past the end can't be punched out.
+                rc = ftp_vfs_truncate(&transfer->file_vfs, off);
+                transfer->alloc_size = rc < 0 ? transfer->alloc_size : 0;
+            }
+
+            if (!rc) {
+                transfer->alloc_failed = 1;
+                transfer->sparse_seek = 1;
+                done += len;
+                continue;
+            } else if (errno != ENOSYS) {
+                return done ? (int)done : -1;
+            }
+            transfer->sparse = 0;
+        }
+
+        if (transfer->sparse_seek) {
+            if (ftp_vfs_seek(&transfer->file_vfs, off) < 0) {
+                return done ? (int)done : -1;
+            }
+            transfer->sparse_seek = 0;
+        }
+
+        const int rc = ftp_vfs_write(&transfer->file_vfs, data + done, len);
+        if (rc <= 0) {
+            return done ? (int)done : rc;
+        }
+        done += rc;
+        if ((size_t)rc != len) {
+            break;
+        }
+    }
+
+    return done;
+}
+
+// sets the size of a file that ends in a hole, as the file offset was left behind. a new file can be
+// grown, otherwise other sessions may be writing past this one (WRITE_AT) so the last block is written.
+static int ftp_file_sparse_finish(struct FtpTransfer* transfer) {
+    static const unsigned char zeros[FTP_SPARSE_BLOCK_SIZE] FTP_FILE_BUFFER_ALIGN;
+
+    if (!transfer->sparse_seek) {
+        return 0;
+    }
+
+    transfer->sparse_seek = 0;
+    if (!transfer->sparse_end) {
+        if (ftp_vfs_truncate(&transfer->file_vfs, transfer->write_offset) < 0) {
+            return -1;
+        }
+        return ftp_vfs_seek(&transfer->file_vfs, transfer->write_offset);
+    }
+
+    // holes end on a block boundary, so this is aligned.
+    const size_t off = transfer->write_offset - sizeof(zeros);
+    if (ftp_vfs_seek(&transfer->file_vfs, off) < 0 || ftp_vfs_write(&transfer->file_vfs, zeros, sizeof(zeros)) != (int)sizeof(zeros)) {
+        return -1;
+    }
+    return 0;
+}
+#endif
+
+// all writes to the vfs during a transfer end up here.
+static int ftp_file_vfs_write(struct FtpTransfer* transfer, const void* buf, size_t size) {
+    // the size isn't known up front, so the policy kicks in once it's large enough.
+    ftp_file_set_cache(transfer, transfer->write_offset + size, transfer->write_offset);
+    ftp_file_preallocate(transfer, transfer->write_offset + size);
+#if FTP_SPARSE_BLOCK_SIZE
+    const int rc = transfer->sparse ? ftp_file_sparse_write(transfer, buf, size) : ftp_vfs_write(&transfer->file_vfs, buf, size);
+#else
+    const int rc = ftp_vfs_write(&transfer->file_vfs, buf, size);
+#endif
+    if (rc > 0) {
+        if (transfer->hash_inline) {
+            ftp_hash_update(&transfer->hash, buf, rc);
+        }
+        transfer->write_offset += rc;
+        ftp_file_drop_behind(transfer, transfer->write_offset, 0);
+    }
+    return rc;
+}
+
+static unsigned long long ftp_get_time_ms(void) {
+#if defined(HAVE_CLOCK_GETTIME) && HAVE_CLOCK_GETTIME
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#else
+    return (unsigned long long)time(NULL) * 1000;
+#endif
+}
+
+static unsigned long long ftp_rate_limit_burst(unsigned long long rate) {
+    const unsigned long long burst = rate / FTP_RATE_LIMIT_HZ;
+    return burst ? burst : 1;
+}
+
+static void ftp_rate_limit_refill(struct FtpRateLimit* rl, unsigned long long rate, unsigned long long now) {
+    const unsigned long long burst = ftp_rate_limit_burst(rate);
+    const unsigned long long elapsed = now - rl->last_ms;
+
+    // a new (zeroed) bucket starts off full.
+    if (!rl->last_ms || elapsed >= 1000 || rl->tokens + (long long)(rate * elapsed / 1000) >= (long long)burst) {
+        rl->tokens = burst;
+        rl->last_ms = now;
+    } else if (rate * elapsed / 1000) {
+        // only move time on by the amount that was turned into tokens.
+        rl->tokens += rate * elapsed / 1000;
+        rl->last_ms += rate * elapsed / 1000 * 1000 / rate;
+    }
+}
+
+// returns the ms until the bucket has enough tokens to continue, 0 if it can already.
+static int ftp_rate_limit_bucket_wait(struct FtpRateLimit* rl, unsigned long long rate, unsigned long long now) {
+    if (!rate) {
+        return 0;
+    }
+
+    ftp_rate_limit_refill(rl, rate, now);
+    const unsigned long long burst = ftp_rate_limit_burst(rate);
+    const unsigned long long need = burst < FTP_RATE_LIMIT_MIN ? burst : FTP_RATE_LIMIT_MIN;
+    if (rl->tokens >= (long long)need) {
+        return 0;
+    }
+
+    // round up so that the loop doesn't wake up too early and spin.
+    return ((unsigned long long)((long long)need - rl->tokens) * 1000 + rate - 1) / rate + 1;
+}
+
+// returns the ms until the session can transfer again, 0 if it isn't throttled.
+static int ftp_rate_limit_wait(struct FtpSession* session) {
+    const struct FtpSrvConfig* cfg = &g_ftp.cfg;
+    if (!cfg->rate_limit && !cfg->session_rate_limit && !cfg->ip_rate_limit) {
+        return 0;
+    }
+
+    const unsigned long long now = ftp_get_time_ms();
+    int wait = ftp_rate_limit_bucket_wait(&g_ftp.rate_limit, cfg->rate_limit, now);
+    int w = ftp_rate_limit_bucket_wait(&session->rate_limit, cfg->session_rate_limit, now);
+    wait = w > wait ? w : wait;
+    if (session->ip_rate_limit) {
+        w = ftp_rate_limit_bucket_wait(&session->ip_rate_limit->bucket, cfg->ip_rate_limit, now);
+        wait = w > wait ? w : wait;
+    }
+    return wait;
+}
+
+static size_t ftp_rate_limit_cap(const struct FtpRateLimit* rl, size_t size) {
+    if (rl->tokens <= 0) {
+        return 0;
+    }
+    return (unsigned long long)rl->tokens < size ? (size_t)rl->tokens : size;
+}
+
+// returns how much of size the session is allowed to transfer right now.
+static size_t ftp_rate_limit_get(struct FtpSession* session, size_t size) {
+    const struct FtpSrvConfig* cfg = &g_ftp.cfg;
+    if (!cfg->rate_limit && !cfg->session_rate_limit && !cfg->ip_rate_limit) {
+        return size;
+    }
+
+    const unsigned long long now = ftp_get_time_ms();
+    if (cfg->rate_limit) {
+        ftp_rate_limit_refill(&g_ftp.rate_limit, cfg->rate_limit, now);
+        size = ftp_rate_limit_cap(&g_ftp.rate_limit, size);
+    }
+    if (cfg->session_rate_limit) {
+        ftp_rate_limit_refill(&session->rate_limit, cfg->session_rate_limit, now);
+        size = ftp_rate_limit_cap(&session->rate_limit, size);
+    }
+    if (cfg->ip_rate_limit && session->ip_rate_limit) {
+        struct FtpRateLimit* rl = &session->ip_rate_limit->bucket;
+        ftp_rate_limit_refill(rl, cfg->ip_rate_limit, now);
+        size = ftp_rate_limit_cap(rl, size);
+    }
+    return size;
+}
+
+// takes the bytes sent or received on the data connection from each bucket, this can be more
+// than ftp_rate_limit_get() allowed for as framing and compressed output aren't known up front.
+static void ftp_rate_limit_take(struct FtpSession* session, size_t size) {
+    const struct FtpSrvConfig* cfg = &g_ftp.cfg;
+    if (cfg->rate_limit) {
+        g_ftp.rate_limit.tokens -= size;
+    }
+    if (cfg->session_rate_limit) {
+        session->rate_limit.tokens -= size;
+    }
+    if (cfg->ip_rate_limit && session->ip_rate_limit) {
+        session->ip_rate_limit->bucket.tokens -= size;
+    }
+}
+
+// sessions from the same address share a bucket.
+static void ftp_rate_limit_ip_acquire(struct FtpSession* session, struct in_addr addr) {
+    struct FtpRateLimitIp* free_entry = NULL;
+    for (size_t i = 0; i < g_ftp.cfg.max_sessions; i++) {
+        struct FtpRateLimitIp* entry = &g_ftp.ip_rate_limits[i];
+        if (entry->refs && entry->addr.s_addr == addr.s_addr) {
+            entry->refs++;
+            session->ip_rate_limit = entry;
+            return;
+        } else if (!entry->refs && !free_entry) {
+            free_entry = entry;
+        }
+    }
+
+    // there's always a free entry as there's one per session.
+    free_entry->refs = 1;
+    free_entry->addr = addr;
+    memset(&free_entry->bucket, 0, sizeof(free_entry->bucket));
+    session->ip_rate_limit = free_entry;
+}
+
+static void ftp_rate_limit_ip_release(struct FtpSession* session) {
+    if (session->ip_rate_limit) {
+        session->ip_rate_limit->refs--;
+        session->ip_rate_limit = NULL;
+    }
+}
+
+// returns how much of size the transfer can move right now, limited by
+// both its scheduler deficit and the rate limits.
+static size_t ftp_data_transfer_budget(struct FtpSession* session, size_t size) {
+    size = session->transfer->deficit < size ? session->transfer->deficit : size;
+    return ftp_rate_limit_get(session, size);
+}
+
+// the rate limits are charged by the socket calls, as MODE Z / MODE E don't send what they read.
+static void ftp_data_transfer_consume(struct FtpSession* session, size_t size) {
+    session->transfer->deficit -= size;
+}
+
+#if FTP_WRITE_BUFFER_COUNT
+// hands out a write buffer to the transfer, if none are free then
+// writes go straight to the vfs.
+// off is the file offset that the first write will be at, the first flush
+// is shortened so that all following flushes are aligned to the buffer size.
+static void ftp_write_buffer_acquire(struct FtpTransfer* transfer, size_t off) {
+    for (size_t i = 0; i < FTP_ARR_SZ(g_ftp.write_buffers); i++) {
+        struct FtpWriteBuffer* wb = &g_ftp.write_buffers[i];
+        if (!wb->in_use) {
+            wb->in_use = 1;
+            wb->offset = 0;
+            wb->size = sizeof(wb->data) - (off % sizeof(wb->data));
+            transfer->wb = wb;
+            break;
+        }
+    }
+}
+
+// writes out everything that is buffered.
+static int ftp_write_buffer_flush(struct FtpTransfer* transfer) {
+    struct FtpWriteBuffer* wb = transfer->wb;
+    int rc = 0;
+
+    if (wb && wb->offset) {
+        for (size_t written = 0; written < wb->offset; written += rc) {
+            rc = ftp_file_vfs_write(transfer, wb->data + written, wb->offset - written);
+            if (rc < 0) {
+                break;
+            } else if (rc == 0) {
+                errno = ENOSPC;
+                rc = -1;
+                break;
+            }
+        }
+
+        wb->offset = 0;
+        wb->size = sizeof(wb->data);
+    }
+
+    return rc < 0 ? -1 : 0;
+}
+
+// flushes and returns the buffer back to the pool.
+static int ftp_write_buffer_release(struct FtpTransfer* transfer) {
+    int rc = 0;
+    if (transfer->wb) {
+        rc = ftp_write_buffer_flush(transfer);
+        transfer->wb->in_use = 0;
+        transfer->wb = NULL;
+    }
+    return rc;
+}
+#endif // FTP_WRITE_BUFFER_COUNT
+
+// all writes during a transfer go through here so that they can be buffered.
+static int ftp_file_write(struct FtpTransfer* transfer, const void* buf, size_t size) {
+#if FTP_WRITE_BUFFER_COUNT
+    struct FtpWriteBuffer* wb = transfer->wb;
+    if (wb) {
+        const unsigned char* data = buf;
+        const size_t ret = size;
+
+        while (size) {
+            const size_t n = size < wb->size - wb->offset ? size : wb->size - wb->offset;
+            memcpy(wb->data + wb->offset, data, n);
+            wb->offset += n;
+            data += n;
+            size -= n;
+
+            if (wb->offset == wb->size && ftp_write_buffer_flush(transfer) < 0) {
+                return -1;
+            }
+        }
+
+        return ret;
+    }
+#endif
+    return ftp_file_vfs_write(transfer, buf, size);
+}
+
+// writes out anything buffered by ftp_file_write(), and sets the size if the file ends in a hole.
+static int ftp_file_flush(struct FtpTransfer* transfer) {
+#if FTP_WRITE_BUFFER_COUNT
+    if (ftp_write_buffer_flush(transfer) < 0) {
+        return -1;
+    }
+#endif
+#if FTP_SPARSE_BLOCK_SIZE
+    return ftp_file_sparse_finish(transfer);
+#else
+    return 0;
+#endif
+}
+
+#if FTP_ASCII_BUFFER_SIZE
+// converts bare LFs to CRLF (TYPE A RETR), CRLFs already in the file are left alone. stops once
+// out_size bytes are written, which may be between an added CR and its LF, and returns the bytes
+// of in used. lines are found with memchr(), which libc vectorises, and copied whole.
+static size_t ftp_ascii_encode(int* cr, const char* in, size_t size, char* out, size_t out_size, size_t* out_len) {
+    size_t i = 0, o = 0;
+
+    while (i < size && o < out_size) {
+        const char* lf = memchr(in + i, '\n', size - i);
+        size_t run = lf ? (size_t)(lf - in) - i : size - i;
+        if (run > out_size - o) {
+            run = out_size - o;
+        }
+
+        memcpy(out + o, in + i, run);
+        i += run;
+        o += run;
+        if (!lf || o == out_size) {
+            break;
+        }
+
+        if (!(o ? out[o - 1] == '\r' : *cr)) {
+            out[o++] = '\r';
+            if (o == out_size) {
+                break;
+            }
+        }
+        out[o++] = '\n';
+        i++;
+    }
+
+    if (o) {
+        *cr = out[o - 1] == '\r';
+    }
+    *out_len = o;
+    return i;
+}
+
+// converts CRLF to LF (TYPE A STOR) and writes it out, lone CRs are kept. a CR at the end of
+// buf is held back until it's known whether a LF follows.
+static int ftp_ascii_write(struct FtpTransfer* transfer, const void* buf, size_t size) {
+    const char* in = buf;
+    const char* end = in + size;
+
+    while (in < end) {
+        char* out = g_ftp.ascii_buf;
+        char* out_end = out + sizeof(g_ftp.ascii_buf);
+        if (transfer->ascii_cr) {
+            if (*in != '\n') {
+                *out++ = '\r';
+            }
+            transfer->ascii_cr = 0;
+        }
+
+        while (in < end && out < out_end) {
+            const size_t n = (size_t)(end - in) < (size_t)(out_end - out) ? (size_t)(end - in) : (size_t)(out_end - out);
+            const char* cr = memchr(in, '\r', n);
+            if (!cr) {
+                memcpy(out, in, n);
+                out += n;
+                in += n;
+                continue;
+            }
+
+            memcpy(out, in, cr - in);
+            out += cr - in;
+            in = cr + 1;
+            if (in == end) {
+                transfer->ascii_cr = 1;
+            } else if (*in != '\n') {
+                *out++ = '\r';
+            }
+        }
+
+        if (out != g_ftp.ascii_buf && ftp_file_write(transfer, g_ftp.ascii_buf, out - g_ftp.ascii_buf) < 0) {
+            return -1;
+        }
+    }
+
+    return size;
+}
+#endif // FTP_ASCII_BUFFER_SIZE
+
+static int ftp_untar_write(struct FtpSession* session, const void* buf, size_t size);
+
+// where the data received during STOR ends up once MODE Z / MODE B are taken off.
+static int ftp_data_store(struct FtpSession* session, const void* buf, size_t size) {
+    if (session->transfer->untar.active) {
+        return ftp_untar_write(session, buf, size);
+    }
+#if FTP_ASCII_BUFFER_SIZE
+    if (session->transfer->ascii) {
+        return ftp_ascii_write(session->transfer, buf, size);
+    }
+#endif
+    return ftp_file_write(session->transfer, buf, size);
+}
+
+// writes out anything stored, an archive being extracted has to end on an entry.
+static int ftp_data_store_flush(struct FtpSession* session) {
+    const struct FtpUntar* u = &session->transfer->untar;
+    if (u->active && !u->eof && (u->header_size || u->count || u->pad)) {
+        errno = EBADMSG;
+        return -1;
+    }
+    // a CR at the very end of the upload is kept.
+    if (session->transfer->ascii_cr) {
+        session->transfer->ascii_cr = 0;
+        if (ftp_file_write(session->transfer, "\r", 1) < 0) {
+            return -1;
+        }
+    }
+    return ftp_file_flush(session->transfer);
+}
+
+#if FTP_ZLIB_STREAMS
+// already compressed files are sent using stored blocks, as compressing
+// them again only burns cpu.
+static const char* FTP_ZLIB_SKIP_EXT[] = {
+    "7z", "avi", "bz2", "flac", "gif", "gz", "jpeg", "jpg", "lz4", "mkv", "mov", "mp3",
+    "mp4", "nsz", "ogg", "png", "rar", "tgz", "webm", "webp", "xcz", "xz", "zip", "zst",
+};
+
+// hands out a stream to the transfer, fails if none are free.
+static int ftp_zlib_acquire(struct FtpTransfer* transfer) {
+    for (size_t i = 0; i < FTP_ARR_SZ(g_ftp.zlib_streams); i++) {
+        struct FtpZlibStream* z = &g_ftp.zlib_streams[i];
+        if (!z->in_use) {
+            z->in_use = 1;
+            z->init = z->finished = 0;
+            z->level = g_ftp.cfg.compression_level >= 1 && g_ftp.cfg.compression_level <= 9 ? g_ftp.cfg.compression_level : Z_DEFAULT_COMPRESSION;
+            z->offset = z->size = 0;
+            transfer->zlib = z;
+            return 0;
+        }
+    }
+
+    errno = EBUSY;
+    return -1;
+}
+
+static void ftp_zlib_release(struct FtpTransfer* transfer) {
+    struct FtpZlibStream* z = transfer->zlib;
+    if (z) {
+        if (z->init) {
+            if (z->inflate) {
+                inflateEnd(&z->strm);
+            } else {
+                deflateEnd(&z->strm);
+            }
+        }
+        z->in_use = 0;
+        transfer->zlib = NULL;
+    }
+}
+
+// the stream is set up on first use, once it's known which way the data is going.
+static int ftp_zlib_init(struct FtpTransfer* transfer) {
+    struct FtpZlibStream* z = transfer->zlib;
+    if (!z->init) {
+        int rc;
+        memset(&z->strm, 0, sizeof(z->strm));
+        z->inflate = transfer->mode == FTP_TRANSFER_MODE_STOR;
+        if (z->inflate) {
+            rc = inflateInit(&z->strm);
+        } else {
+            rc = deflateInit(&z->strm, z->level);
+        }
+
+        if (rc != Z_OK) {
+            errno = rc == Z_MEM_ERROR ? ENOMEM : EINVAL;
+            return -1;
+        }
+        z->init = 1;
+    }
+    return 0;
+}
+
+// sends the compressed data that is buffered, returns -1 and sets errno
+// to EAGAIN if the socket would block before all of it is sent.
+static int ftp_zlib_send_pending(struct FtpSession* session) {
+    struct FtpZlibStream* z = session->transfer->zlib;
+    while (z->offset < z->size) {
+        const int n = ftp_data_sock_send(session, z->data + z->offset, z->size - z->offset);
+        if (n < 0) {
+            return -1;
+        }
+        z->offset += n;
+    }
+
+    z->offset = z->size = 0;
+    return 0;
+}
+
+// compresses and sends the data, returns the number of bytes consumed.
+static int ftp_zlib_send(struct FtpSession* session, const void* buf, size_t size) {
+    struct FtpZlibStream* z = session->transfer->zlib;
+    if (ftp_zlib_init(session->transfer) < 0) {
+        return -1;
+    }
+
+    z->strm.next_in = (Bytef*)buf;
+    z->strm.avail_in = size;
+    // zlib may have output of its own to get rid of before it takes any input.
+    do {
+        if (ftp_zlib_send_pending(session) < 0) {
+            return -1;
+        }
+
+        z->strm.next_out = z->data;
+        z->strm.avail_out = sizeof(z->data);
+        deflate(&z->strm, Z_NO_FLUSH);
+        z->size = sizeof(z->data) - z->strm.avail_out;
+    } while (size && z->strm.avail_in == size);
+
+    // whatever doesn't fit in the socket is sent on the next poll.
+    if (ftp_zlib_send_pending(session) < 0 && errno != EWOULDBLOCK && errno != EAGAIN) {
+        return -1;
+    }
+
+    return size - z->strm.avail_in;
+}
+
+// sends the end of the stream, returns 1 once everything has been sent,
+// 0 if the socket would block and -1 on error.
+static int ftp_zlib_finish(struct FtpSession* session) {
+    struct FtpZlibStream* z = session->transfer->zlib;
+    if (ftp_zlib_init(session->transfer) < 0) {
+        return -1;
+    }
+
+    while (1) {
+        if (ftp_zlib_send_pending(session) < 0) {
+            return errno == EWOULDBLOCK || errno == EAGAIN ? 0 : -1;
+        } else if (z->finished) {
+            return 1;
+        }
+
+        z->strm.next_in = NULL;
+        z->strm.avail_in = 0;
+        z->strm.next_out = z->data;
+        z->strm.avail_out = sizeof(z->data);
+        const int rc = deflate(&z->strm, Z_FINISH);
+        z->size = sizeof(z->data) - z->strm.avail_out;
+
+        if (rc == Z_STREAM_END) {
+            z->finished = 1;
+        } else if (rc != Z_OK && rc != Z_BUF_ERROR) {
+            errno = EIO;
+            return -1;
+        }
+    }
+}
+
+// inflates the data received during STOR and writes it out, anything
+// after the end of the stream is ignored.
+static int ftp_zlib_write(struct FtpSession* session, const void* buf, size_t size) {
+    struct FtpTransfer* transfer = session->transfer;
+    struct FtpZlibStream* z = transfer->zlib;
+    if (ftp_zlib_init(transfer) < 0) {
+        return -1;
+    }
+
+    z->strm.next_in = (Bytef*)buf;
+    z->strm.avail_in = size;
+    while (z->strm.avail_in && !z->finished) {
+        z->strm.next_out = z->data;
+        z->strm.avail_out = sizeof(z->data);
+        const int rc = inflate(&z->strm, Z_NO_FLUSH);
+
+        if (rc == Z_STREAM_END) {
+            z->finished = 1;
+        } else if (rc != Z_OK) {
+            errno = rc == Z_MEM_ERROR ? ENOMEM : EBADMSG;
+            return -1;
+        }
+
+        const size_t n = sizeof(z->data) - z->strm.avail_out;
+        if (n && ftp_data_store(session, z->data, n) < 0) {
+            return -1;
+        }
+    }
+
+    return size;
+}
+#endif // FTP_ZLIB_STREAMS
+
+// writes out a 64-bit big endian value, used by MODE E headers.
+static void ftp_block_put64(unsigned char* p, unsigned long long v) {
+    for (int i = 7; i >= 0; i--) {
+        p[i] = v & 0xFF;
+        v >>= 8;
+    }
+}
+
+static unsigned long long ftp_block_get64(const unsigned char* p) {
+    unsigned long long v = 0;
+    for (int i = 0; i < 8; i++) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+// adds a block header to the headers waiting to be sent.
+static void ftp_block_queue(struct FtpSession* session, int flags, size_t count) {
+    struct FtpBlock* b = &session->transfer->block;
+    b->buf[b->size++] = flags;
+
+    if (session->mode == FTP_MODE_EXTENDED) {
+        // the offset of the EOF block is the number of EOD blocks, listings only use one connection.
+        ftp_block_put64(b->buf + b->size, count);
+        ftp_block_put64(b->buf + b->size + 8, flags & FTP_BLOCK_DESCRIPTOR_EOF ? 1 : b->data_offset);
+        b->size += 16;
+        b->data_offset += count;
+    } else {
+        b->buf[b->size++] = count >> 8;
+        b->buf[b->size++] = count & 0xFF;
+    }
+}
+
+// sends the queued headers, returns -1 and sets errno to EAGAIN if the
+// socket would block before all of them are sent.
+static int ftp_block_send_pending(struct FtpSession* session) {
+    struct FtpBlock* b = &session->transfer->block;
+    while (b->offset < b->size) {
+        const int n = ftp_data_sock_send(session, b->buf + b->offset, b->size - b->offset);
+        if (n < 0) {
+            return -1;
+        }
+        b->offset += n;
+    }
+
+    b->offset = b->size = 0;
+    return 0;
+}
+
+// frames the data into blocks, the caller has to send the rest of the block
+// next time if only part of it is sent.
+static int ftp_block_send(struct FtpSession* session, const void* buf, size_t size) {
+    struct FtpTransfer* transfer = session->transfer;
+    struct FtpBlock* b = &transfer->block;
+
+    if (!b->count) {
+        // the marker is the file offset, so it can be given straight to REST.
+        if (FTP_BLOCK_MARKER_SIZE && session->mode == FTP_MODE_BLOCK && transfer->mode == FTP_TRANSFER_MODE_RETR && transfer->offset >= b->marker) {
+            char marker[21];
+            const int len = snprintf(marker, sizeof(marker), "%zu", transfer->offset);
+            ftp_block_queue(session, FTP_BLOCK_DESCRIPTOR_MARKER, len);
+            memcpy(b->buf + b->size, marker, len);
+            b->size += len;
+            b->marker = transfer->offset + FTP_BLOCK_MARKER_SIZE;
+        }
+
+        b->count = size < FTP_BLOCK_MAX_COUNT ? size : FTP_BLOCK_MAX_COUNT;
+        ftp_block_queue(session, 0, b->count);
+    }
+
+    if (ftp_block_send_pending(session) < 0) {
+        return -1;
+    }
+
+    const int n = ftp_data_sock_send(session, buf, size < b->count ? size : b->count);
+    if (n > 0) {
+        b->count -= n;
+    }
+    return n;
+}
+
+// sends the EOF block, returns 1 once it has been sent, 0 if the socket
+// would block and -1 on error.
+static int ftp_block_finish(struct FtpSession* session) {
+    struct FtpBlock* b = &session->transfer->block;
+    if (!b->eof) {
+        ftp_block_queue(session, session->mode == FTP_MODE_EXTENDED ? FTP_BLOCK_DESCRIPTOR_EOF | FTP_BLOCK_DESCRIPTOR_EOD : FTP_BLOCK_DESCRIPTOR_EOF, 0);
+        b->eof = 1;
+    }
+
+    if (ftp_block_send_pending(session) < 0) {
+        return errno == EWOULDBLOCK || errno == EAGAIN ? 0 : -1;
+    }
+    return 1;
+}
+
+// called once all the data of a block has been received.
+static int ftp_block_end(struct FtpSession* session) {
+    struct FtpTransfer* transfer = session->transfer;
+    struct FtpBlock* b = &transfer->block;
+
+    if (b->flags & FTP_BLOCK_DESCRIPTOR_MARKER) {
+        // everything up to the marker has to be on disk before the client can rely on it.
+        if (ftp_file_flush(transfer) < 0) {
+            return -1;
+        }
+        ftp_client_msg(session, "110 MARK %.*s = %zu", (int)(b->size - FTP_BLOCK_HEADER_SIZE), b->buf + FTP_BLOCK_HEADER_SIZE, transfer->write_offset);
+    }
+
+    if (b->flags & FTP_BLOCK_DESCRIPTOR_EOF) {
+        b->eof = 1;
+    }
+
+    b->size = 0;
+    return 0;
+}
+
+// parses the blocks received during STOR and writes out the data, anything
+// after the EOF block is ignored.
+static int ftp_block_write(struct FtpSession* session, const void* buf, size_t size) {
+    struct FtpTransfer* transfer = session->transfer;
+    struct FtpBlock* b = &transfer->block;
+    const unsigned char* data = buf;
+    const size_t ret = size;
+
+    while (size && !b->eof) {
+        if (b->size < FTP_BLOCK_HEADER_SIZE) {
+            b->buf[b->size++] = *data++;
+            size--;
+            if (b->size == FTP_BLOCK_HEADER_SIZE) {
+                b->flags = b->buf[0];
+                b->count = (b->buf[1] << 8) | b->buf[2];
+                if (!b->count && ftp_block_end(session) < 0) {
+                    return -1;
+                }
+            }
+            continue;
+        }
+
+        const size_t n = size < b->count ? size : b->count;
+        if (b->flags & FTP_BLOCK_DESCRIPTOR_MARKER) {
+            // markers are short, anything that doesn't fit is dropped.
+            const size_t len = n < sizeof(b->buf) - b->size ? n : sizeof(b->buf) - b->size;
+            memcpy(b->buf + b->size, data, len);
+            b->size += len;
+        } else if (ftp_data_store(session, data, n) < 0) {
+            return -1;
+        }
+
+        data += n;
+        size -= n;
+        b->count -= n;
+        if (!b->count && ftp_block_end(session) < 0) {
+            return -1;
+        }
+    }
+
+    return ret;
+}
+
+// used instead of socket_send() for data sent during a transfer, returns the
+// number of bytes consumed, which with MODE Z / MODE B is not the number of bytes sent.
+static int ftp_data_send(struct FtpSession* session, const void* buf, size_t size) {
+#if FTP_ZLIB_STREAMS
+    if (session->transfer->zlib) {
+        return ftp_zlib_send(session, buf, size);
+    }
+#endif
+    if (session->mode == FTP_MODE_BLOCK || session->mode == FTP_MODE_EXTENDED) {
+        return ftp_block_send(session, buf, size);
+    }
+    return ftp_data_sock_send(session, buf, size);
+}
+
+// used instead of ftp_file_write() for data received during STOR.
+static int ftp_data_write(struct FtpSession* session, const void* buf, size_t size) {
+#if FTP_ZLIB_STREAMS
+    if (session->transfer->zlib) {
+        return ftp_zlib_write(session, buf, size);
+    }
+#endif
+    if (session->mode == FTP_MODE_BLOCK) {
+        return ftp_block_write(session, buf, size);
+    }
+    return ftp_data_store(session, buf, size);
+}
+
+#if FTP_ASCII_BUFFER_SIZE
+// sends the data with bare LFs as CRLF, returns the bytes of buf consumed. if only part of the
+// converted data is sent, buf is converted again up to that point to find out how much of it went.
+static int ftp_ascii_send(struct FtpSession* session, const void* buf, size_t size) {
+    struct FtpTransfer* transfer = session->transfer;
+    const int cr = transfer->ascii_cr;
+    size_t len;
+    size_t used = ftp_ascii_encode(&transfer->ascii_cr, buf, size, g_ftp.ascii_buf, sizeof(g_ftp.ascii_buf), &len);
+
+    const int n = ftp_data_send(session, g_ftp.ascii_buf, len);
+    if (n < 0) {
+        transfer->ascii_cr = cr;
+        return -1;
+    } else if ((size_t)n < len) {
+        transfer->ascii_cr = cr;
+        used = ftp_ascii_encode(&transfer->ascii_cr, buf, size, g_ftp.ascii_buf, n, &len);
+        // only the CR before a LF went, the LF is sent on the next poll.
+        if (n && !used) {
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+
+    return used;
+}
+#endif
+
+// used instead of ftp_data_send() for the file data sent by RETR.
+static int ftp_file_send(struct FtpSession* session, const void* buf, size_t size) {
+#if FTP_ASCII_BUFFER_SIZE
+    if (session->transfer->ascii) {
+        return ftp_ascii_send(session, buf, size);
+    }
+#endif
+    return ftp_data_send(session, buf, size);
+}
+
+// sends the file using stored blocks if it's already compressed.
+static void ftp_zlib_set_path(struct FtpTransfer* transfer, const char* path) {
+#if FTP_ZLIB_STREAMS
+    const char* ext = strrchr(path, '.');
+    if (transfer->zlib && ext && !strchr(ext, '/')) {
+        for (size_t i = 0; i < FTP_ARR_SZ(FTP_ZLIB_SKIP_EXT); i++) {
+            if (!strcasecmp(ext + 1, FTP_ZLIB_SKIP_EXT[i])) {
+                transfer->zlib->level = Z_NO_COMPRESSION;
+                break;
+            }
+        }
+    }
+#endif
+}
+
+#if FTP_IO_THREADS
+// the io threads only ever touch the file and the buffer that is PENDING.
+// everything else is owned by the loop, so the mutex only guards the queue
+// and the buffer state transition from PENDING to DONE.
+static void* ftp_io_thread_func(void* arg) {
+    pthread_mutex_lock(&g_ftp.io.mutex);
+    while (1) {
+        while (!g_ftp.io.quit && !g_ftp.io.queue_count) {
+            pthread_cond_wait(&g_ftp.io.cond, &g_ftp.io.mutex);
+        }
+
+        if (!g_ftp.io.queue_count) {
+            break;
+        }
+
+        struct FtpIoSlot* io = g_ftp.io.queue[g_ftp.io.queue_head];
+        struct FtpTransfer* transfer = io->session->transfer;
+        struct FtpIoBuffer* buf = &io->bufs[io->pending];
+        const int flush = io->flush;
+        g_ftp.io.queue_head = (g_ftp.io.queue_head + 1) % FTP_ARR_SZ(g_ftp.io.queue);
+        g_ftp.io.queue_count--;
+        pthread_mutex_unlock(&g_ftp.io.mutex);
+
+        int rc;
+        errno = 0;
+
+        if (transfer->mode == FTP_TRANSFER_MODE_RETR) {
+            rc = ftp_vfs_read(&transfer->file_vfs, buf->data, sizeof(buf->data));
+        } else {
+            rc = ftp_file_write(transfer, buf->data, buf->size);
+            // flush out the write buffer if this was the last block.
+            if (rc >= 0 && flush && ftp_file_flush(transfer) < 0) {
+                rc = -1;
+            }
+        }
+
+        pthread_mutex_lock(&g_ftp.io.mutex);
+        buf->result = rc;
+        buf->error = errno;
+        buf->state = FTP_IO_STATE_DONE;
+        pthread_cond_broadcast(&g_ftp.io.done_cond);
+
+        const char c = 0;
+        write(g_ftp.io.pipe_fds[1], &c, sizeof(c));
+    }
+    pthread_mutex_unlock(&g_ftp.io.mutex);
+
+    return NULL;
+}
+
+static void ftp_io_init(void) {
+    if (pipe(g_ftp.io.pipe_fds) < 0) {
+        return;
+    }
+
+    fcntl(g_ftp.io.pipe_fds[0], F_SETFL, fcntl(g_ftp.io.pipe_fds[0], F_GETFL, 0) | O_NONBLOCK);
+    fcntl(g_ftp.io.pipe_fds[1], F_SETFL, fcntl(g_ftp.io.pipe_fds[1], F_GETFL, 0) | O_NONBLOCK);
+    pthread_mutex_init(&g_ftp.io.mutex, NULL);
+    pthread_cond_init(&g_ftp.io.cond, NULL);
+    pthread_cond_init(&g_ftp.io.done_cond, NULL);
+
+    for (size_t i = 0; i < FTP_ARR_SZ(g_ftp.io.threads); i++) {
+        if (pthread_create(&g_ftp.io.threads[i], NULL, ftp_io_thread_func, NULL)) {
+            g_ftp.io.quit = 1;
+            pthread_cond_broadcast(&g_ftp.io.cond);
+            for (size_t j = 0; j < i; j++) {
+                pthread_join(g_ftp.io.threads[j], NULL);
+            }
+            break;
+        }
+    }
+
+    if (g_ftp.io.quit) {
+        pthread_cond_destroy(&g_ftp.io.done_cond);
+        pthread_cond_destroy(&g_ftp.io.cond);
+        pthread_mutex_destroy(&g_ftp.io.mutex);
+        close(g_ftp.io.pipe_fds[0]);
+        close(g_ftp.io.pipe_fds[1]);
+    } else {
+        g_ftp.io.started = 1;
+    }
+}
+
+static void ftp_io_exit(void) {
+    if (!g_ftp.io.started) {
+        return;
+    }
+
+    pthread_mutex_lock(&g_ftp.io.mutex);
+    g_ftp.io.quit = 1;
+    pthread_cond_broadcast(&g_ftp.io.cond);
+    pthread_mutex_unlock(&g_ftp.io.mutex);
+
+    for (size_t i = 0; i < FTP_ARR_SZ(g_ftp.io.threads); i++) {
+        pthread_join(g_ftp.io.threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&g_ftp.io.done_cond);
+    pthread_cond_destroy(&g_ftp.io.cond);
+    pthread_mutex_destroy(&g_ftp.io.mutex);
+    close(g_ftp.io.pipe_fds[0]);
+    close(g_ftp.io.pipe_fds[1]);
+    g_ftp.io.started = 0;
+}
+
+// queues the head buffer to be read into / written out by a worker.
+static void ftp_io_submit(struct FtpIoSlot* io) {
+    pthread_mutex_lock(&g_ftp.io.mutex);
+    io->bufs[io->head].state = FTP_IO_STATE_PENDING;
+    io->pending = io->head;
+    io->flush = io->eof;
+    io->head ^= 1;
+    g_ftp.io.queue[(g_ftp.io.queue_head + g_ftp.io.queue_count) % FTP_ARR_SZ(g_ftp.io.queue)] = io;
+    g_ftp.io.queue_count++;
+    pthread_cond_signal(&g_ftp.io.cond);
+    pthread_mutex_unlock(&g_ftp.io.mutex);
+}
+
+// returns true if a buffer is queued or being serviced.
+static bool ftp_io_is_pending(struct FtpIoSlot* io) {
+    return io->bufs[0].state == FTP_IO_STATE_PENDING || io->bufs[1].state == FTP_IO_STATE_PENDING;
+}
+
+// collects finished work from the workers, must be called before
+// the loop looks at the buffers.
+static void ftp_io_reap(struct FtpIoSlot* io) {
+    const bool retr = io->session->transfer->mode == FTP_TRANSFER_MODE_RETR;
+
+    pthread_mutex_lock(&g_ftp.io.mutex);
+    for (size_t i = 0; i < FTP_ARR_SZ(io->bufs); i++) {
+        struct FtpIoBuffer* buf = &io->bufs[i];
+        if (buf->state != FTP_IO_STATE_DONE) {
+            continue;
+        }
+
+        if (retr) {
+            buf->state = FTP_IO_STATE_READY;
+            buf->offset = 0;
+            buf->size = buf->result > 0 ? buf->result : 0;
+            if (buf->result > 0) {
+                // the read ahead may go past the end of a RANG range.
+                const size_t size = io->session->transfer->size;
+                const size_t left = io->read_offset < size ? size - io->read_offset : 0;
+                buf->size = left < buf->size ? left : buf->size;
+                io->read_offset += buf->result;
+            } else {
+                io->eof = 1;
+            }
+        } else {
+            if (buf->result < 0 && !io->error) {
+                io->error = buf->error ? buf->error : EIO;
+            }
+            buf->state = FTP_IO_STATE_EMPTY;
+            buf->size = 0;
+        }
+    }
+    pthread_mutex_unlock(&g_ftp.io.mutex);
+}
+
+// returns the poll events the data socket should wait for.
+static int ftp_io_socket_wants_io(struct FtpIoSlot* io) {
+    ftp_io_reap(io);
+    const struct FtpIoBuffer* buf = &io->bufs[io->cur];
+    if (io->session->transfer->mode == FTP_TRANSFER_MODE_RETR) {
+        return buf->state == FTP_IO_STATE_READY;
+    } else {
+        return !io->eof && buf->state == FTP_IO_STATE_EMPTY;
+    }
+}
+
+// tries to hand out a slot to the transfer, if this fails, the
+// transfer falls back to blocking io.
+static void ftp_io_acquire(struct FtpSession* session) {
+    struct FtpTransfer* transfer = session->transfer;
+    if (!g_ftp.io.started) {
+        return;
+    }
+
+    for (size_t i = 0; i < FTP_ARR_SZ(g_ftp.io.slots); i++) {
+        struct FtpIoSlot* io = &g_ftp.io.slots[i];
+        if (!io->session) {
+            io->session = session;
+            io->eof = io->error = 0;
+            io->cur = io->head = 0;
+            io->read_offset = transfer->offset;
+            for (size_t j = 0; j < FTP_ARR_SZ(io->bufs); j++) {
+                io->bufs[j].state = FTP_IO_STATE_EMPTY;
+                io->bufs[j].offset = io->bufs[j].size = 0;
+            }
+            transfer->io = io;
+
+            // start reading ahead straight away.
+            if (transfer->mode == FTP_TRANSFER_MODE_RETR) {
+                ftp_io_submit(io);
+            }
+            break;
+        }
+    }
+}
+
+// waits for outstanding work and returns the slot. data received during STOR that
+// wasn't written yet is only written if write_left is set (the transfer completed),
+// an aborted or failed transfer drops it. returns -1 if writing it failed.
+static int ftp_io_release(struct FtpSession* session, bool write_left) {
+    struct FtpTransfer* transfer = session->transfer;
+    struct FtpIoSlot* io = transfer->io;
+    int rc = 0;
+    if (!io) {
+        return rc;
+    }
+
+    pthread_mutex_lock(&g_ftp.io.mutex);
+    while (ftp_io_is_pending(io)) {
+        pthread_cond_wait(&g_ftp.io.done_cond, &g_ftp.io.mutex);
+    }
+    pthread_mutex_unlock(&g_ftp.io.mutex);
+    ftp_io_reap(io);
+
+    if (write_left && transfer->mode == FTP_TRANSFER_MODE_STOR) {
+        for (size_t i = 0; i < FTP_ARR_SZ(io->bufs) && !rc; i++) {
+            const struct FtpIoBuffer* buf = &io->bufs[(io->head + i) % FTP_ARR_SZ(io->bufs)];
+            if (buf->size && ftp_file_write(transfer, buf->data, buf->size) < 0) {
+                rc = -1;
+            }
+        }
+    }
+
+    io->session = NULL;
+    transfer->io = NULL;
+    return rc;
+}
+
+// called when a worker signals that work has completed.
+static void ftp_file_data_transfer_progress(struct FtpSession* session);
+static void ftp_io_poll(void) {
+    char buf[64];
+    while (read(g_ftp.io.pipe_fds[0], buf, sizeof(buf)) > 0) {
+        ;
+    }
+
+    for (size_t i = 0; i < FTP_ARR_SZ(g_ftp.io.slots); i++) {
+        struct FtpIoSlot* io = &g_ftp.io.slots[i];
+        if (io->session) {
+            ftp_file_data_transfer_progress(io->session);
+        }
+    }
+}
+#endif // FTP_IO_THREADS
+
+// reserves the data connections for a striped transfer, either all of
+// them are reserved or none are, so that the client knows how many to use.
+static int ftp_stripe_acquire(struct FtpSession* session) {
+#if FTP_STRIPE_COUNT
+#if FTP_TLS
+    // the extra connections would each need a handshake, which the stripes don't do.
+    if (session->mode == FTP_MODE_EXTENDED && session->tls_private) {
+        errno = EPROTONOSUPPORT;
+        return -1;
+    }
+#endif
+    if (session->mode == FTP_MODE_EXTENDED) {
+        const unsigned want = session->parallelism ? session->parallelism : 1;
+        unsigned free_count = 0;
+        for (size_t i = 0; i < FTP_ARR_SZ(g_ftp.stripes); i++) {
+            free_count += !g_ftp.stripes[i].session;
+        }
+
+        if (free_count < want) {
+            errno = EBUSY;
+            return -1;
+        }
+
+        for (size_t i = 0; i < FTP_ARR_SZ(g_ftp.stripes) && session->transfer->stripes < want; i++) {
+            struct FtpStripe* stripe = &g_ftp.stripes[i];
+            if (!stripe->session) {
+                memset(stripe, 0, sizeof(*stripe));
+                stripe->session = session;
+                stripe->sock = -1;
+                session->transfer->stripes++;
+            }
+        }
+    }
+#endif
+    return 0;
+}
+
+static void ftp_stripe_release(struct FtpSession* session) {
+#if FTP_STRIPE_COUNT
+    if (session->transfer->stripes) {
+        for (size_t i = 0; i < FTP_ARR_SZ(g_ftp.stripes); i++) {
+            struct FtpStripe* stripe = &g_ftp.stripes[i];
+            if (stripe->session == session) {
+                ftp_close_socket(&stripe->sock);
+                memset(stripe, 0, sizeof(*stripe));
+            }
+        }
+    }
+
+    session->transfer->stripes = 0;
+    session->transfer->stripe_eods = 0;
+    session->transfer->stripe_eodc = 0;
+    session->transfer->stripe_eof = 0;
+    session->transfer->stripe_ready = 0;
+    session->transfer->stripe_deadline_ms = 0;
+#endif
+}
+
+#if FTP_STRIPE_COUNT
+static void ftp_stripe_set_socket(struct FtpStripe* stripe, int sock) {
+    stripe->sock = sock;
+    ftp_set_socket_nonblocking_enable(sock);
+    ftp_set_socket_keepalive_enable(sock);
+    ftp_set_socket_throughput_enable(sock);
+}
+#endif
+
+// hands the data connection opened by ftp_data_open() to the first stripe,
+// with PORT the rest are connected now, with PASV they are accepted as the client connects.
+static void ftp_stripe_begin(struct FtpSession* session) {
+#if FTP_STRIPE_COUNT
+    struct FtpTransfer* transfer = session->transfer;
+    if (!transfer->stripes) {
+        return;
+    }
+
+    transfer->stripe_deadline_ms = ftp_get_time_ms() + g_ftp.cfg.data_timeout_ms;
+    bool first = true;
+    for (size_t i = 0; i < FTP_ARR_SZ(g_ftp.stripes); i++) {
+        struct FtpStripe* stripe = &g_ftp.stripes[i];
+        if (stripe->session != session) {
+            continue;
+        }
+
+        if (first) {
+            stripe->sock = session->data_sock;
+            session->data_sock = -1;
+            first = false;
+        } else if (session->data_connection == FTP_DATA_CONNECTION_ACTIVE) {
+            int sock = socket_open(PF_INET, SOCK_STREAM, 0);
+            if (sock > 0 && socket_connect(sock, (struct sockaddr*)&session->data_sockaddr, sizeof(session->data_sockaddr)) < 0) {
+                ftp_close_socket(&sock);
+            }
+
+            // carry on with the connections that did open, EODC tells the client how many there are.
+            if (sock > 0) {
+                ftp_stripe_set_socket(stripe, sock);
+            } else {
+                memset(stripe, 0, sizeof(*stripe));
+                transfer->stripes--;
+            }
+        }
+    }
+#endif
+}
+
+#if FTP_HASH_CACHE_ENTRIES
+// returns the cached digest of the range, the size and mtime have to match
+// so that a file changed outside of the server isn't given a stale digest.
+static struct FtpHashCacheEntry* ftp_hash_cache_find(const char* path, const struct stat* st, enum FtpHashType type, size_t start, size_t end) {
+    for (size_t i = 0; i < FTP_ARR_SZ(g_ftp.hash_cache); i++) {
+        struct FtpHashCacheEntry* entry = &g_ftp.hash_cache[i];
+        if (entry->used && entry->type == type && entry->start == start && entry->end == end &&
+            entry->size == (size_t)st->st_size && entry->mtime == st->st_mtime && !strcmp(entry->path.s, path)) {
+            entry->used = ++g_ftp.hash_cache_used;
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// replaces the least recently used entry.
+static void ftp_hash_cache_store(const char* path, const struct stat* st, enum FtpHashType type, size_t start, size_t end, const unsigned char* digest) {
+    struct FtpHashCacheEntry* entry = &g_ftp.hash_cache[0];
+    for (size_t i = 1; i < FTP_ARR_SZ(g_ftp.hash_cache) && entry->used; i++) {
+        if (g_ftp.hash_cache[i].used < entry->used) {
+            entry = &g_ftp.hash_cache[i];
+        }
+    }
+
+    snprintf(entry->path.s, sizeof(entry->path), "%s", path);
+    entry->size = st->st_size;
+    entry->mtime = st->st_mtime;
+    entry->type = type;
+    entry->start = start;
+    entry->end = end;
+    memcpy(entry->digest, digest, ftp_hash_size(type));
+    entry->used = ++g_ftp.hash_cache_used;
+}
+#endif
+
+// bytes needed to fill the last record of size bytes of data.
+static size_t ftp_tar_pad(size_t size) {
+    return (FTP_TAR_RECORD_SIZE - size % FTP_TAR_RECORD_SIZE) % FTP_TAR_RECORD_SIZE;
+}
+
+// forgets the digests of a file that is written, removed or renamed by
+// the server, as the mtime alone may not change if done within a second.
+static void ftp_hash_cache_remove(const char* path) {
+#if FTP_HASH_CACHE_ENTRIES
+    for (size_t i = 0; i < FTP_ARR_SZ(g_ftp.hash_cache); i++) {
+        struct FtpHashCacheEntry* entry = &g_ftp.hash_cache[i];
+        if (entry->used && !strcmp(entry->path.s, path)) {
+            entry->used = 0;
+        }
+    }
+#endif
+}
+
+// caches the digest worked out whilst the file was being uploaded,
+// so that a HASH straight after STOR doesn't read the file again.
+static void ftp_hash_cache_store_upload(struct FtpSession* session) {
+#if FTP_HASH_CACHE_ENTRIES
+    struct FtpTransfer* transfer = session->transfer;
+    struct stat st;
+    unsigned char digest[FTP_HASH_MAX_SIZE];
+
+    if (!ftp_vfs_stat(transfer->temp_path.s, &st) && (size_t)st.st_size == transfer->write_offset) {
+        ftp_hash_final(&transfer->hash, digest);
+        ftp_hash_cache_store(transfer->temp_path.s, &st, transfer->hash.type, 0, transfer->write_offset, digest);
+    }
+#endif
+}
+
+// creates the directory along with any missing parents, device names aren't directories that
+// can be made so they're skipped. on failure, failed is set to the directory that couldn't be made.
+static int ftp_mkdirs(const struct Pathname* fullpath, struct Pathname* failed) {
+    struct Pathname path = *fullpath;
+    struct stat st;
+    int rc = 0;
+
+    // each parent is checked in turn.
+    char* p = path.s;
+    do {
+        p = strchr(p + 1, '/');
+        if (p) {
+            *p = '\0';
+        }
+
+        *failed = fix_path_for_device(&path);
+        if (path.s[strlen(path.s) - 1] != ':') {
+            rc = ftp_vfs_stat(failed->s, &st);
+            if (rc < 0) {
+                rc = ftp_vfs_mkdir(failed->s);
+            } else if (!S_ISDIR(st.st_mode)) {
+                errno = ENOTDIR;
+                rc = -1;
+            }
+        }
+
+        if (p) {
+            *p = '/';
+        }
+    } while (p && rc >= 0);
+
+    return rc;
+}
+
+// parses a number from a tar header, numbers are octal unless the top bit
+// of the first byte is set, in which case they're base-256 (GNU).
+static unsigned long long ftp_untar_number(const char* p, size_t size) {
+    unsigned long long v = 0;
+    size_t i = 0;
+
+    if ((unsigned char)p[0] & 0x80) {
+        v = (unsigned char)p[0] & 0x7F;
+        for (i = 1; i < size; i++) {
+            v = (v << 8) | (unsigned char)p[i];
+        }
+    } else {
+        while (i < size && p[i] == ' ') {
+            i++;
+        }
+        for (; i < size && p[i] >= '0' && p[i] <= '7'; i++) {
+            v = (v << 3) | (unsigned)(p[i] - '0');
+        }
+    }
+
+    return v;
+}
+
+// copies a header field that is only nul terminated if it's shorter than the field.
+static size_t ftp_untar_field(char* dst, const char* field, size_t size) {
+    const char* end = memchr(field, '\0', size);
+    const size_t len = end ? (size_t)(end - field) : size;
+    memcpy(dst, field, len);
+    return len;
+}
+
+// takes the path and size from the records of a pax header, the rest are ignored.
+// a record that doesn't fit in its length or in the header fails the entry.
+static int ftp_untar_pax(struct FtpSession* session) {
+    struct FtpUntar* u = &session->transfer->untar;
+    char* buf = session->transfer->temp_path.s + u->base;
+    const char* end = buf + u->name_size;
+    const char* path = NULL;
+    size_t path_len = 0;
+
+    // each record is "<length> <key>=<value>\n", the length includes itself.
+    buf[u->name_size] = '\0';
+    for (const char* p = buf; p < end;) {
+        char* sp;
+        const unsigned long len = isdigit((unsigned char)*p) ? strtoul(p, &sp, 10) : 0;
+        // the length has to cover at least the digits, the space, "k=" and the '\n'.
+        if (!len || sp >= end || *sp != ' ' || len > (size_t)(end - p) || len < (size_t)(sp - p) + 4 || p[len - 1] != '\n') {
+            errno = EBADMSG;
+            return -1;
+        }
+
+        const char* key = sp + 1;
+        const char* value = memchr(key, '=', p + len - 1 - key);
+        if (!value || value == key) {
+            errno = EBADMSG;
+            return -1;
+        }
+
+        value++;
+        if (!strncmp(key, "path=", 5)) {
+            path = value;
+            path_len = p + len - 1 - value;
+        } else if (!strncmp(key, "size=", 5)) {
+            u->pax_size = strtoull(value, NULL, 10);
+        }
+        p += len;
+    }
+
+    if (path) {
+        memmove(buf, path, path_len);
+        buf[path_len] = '\0';
+        u->long_name = 1;
+    }
+    return 0;
+}
+
+// opens the file of the entry, the directories it's in are made if the archive didn't have them.
+static int ftp_untar_open(struct FtpSession* session) {
+    struct FtpTransfer* transfer = session->transfer;
+    struct FtpUntar* u = &transfer->untar;
+    struct Pathname* path = &transfer->temp_path;
+
+    int rc = ftp_vfs_open(&transfer->file_vfs, path->s, FtpVfsOpenMode_WRITE);
+    if (rc < 0 && errno == ENOENT) {
+        struct Pathname parent = *path;
+        struct Pathname failed;
+        *strrchr(parent.s, '/') = '\0';
+        if (ftp_mkdirs(&parent, &failed) < 0) {
+            return -1;
+        }
+        rc = ftp_vfs_open(&transfer->file_vfs, path->s, FtpVfsOpenMode_WRITE);
+    }
+    if (rc < 0) {
+        return -1;
+    }
+
+    ftp_hash_cache_remove(path->s);
+    transfer->write_offset = 0;
+    transfer->sparse = FTP_SPARSE_BLOCK_SIZE != 0;
+    transfer->sparse_seek = 0;
+    transfer->sparse_end = 0;
+    transfer->cache = FtpVfsCache_DEFAULT;
+    transfer->cache_checked = 0;
+    transfer->drop_offset = 0;
+    transfer->writeback_offset = 0;
+    // the size is known up front, so large files are reserved in one go.
+    transfer->alloc_size = 0;
+    if (FTP_PREALLOCATE_MIN && u->size >= FTP_PREALLOCATE_MIN && !ftp_vfs_allocate(&transfer->file_vfs, u->size)) {
+        transfer->alloc_size = u->size;
+    }
+    u->data = FTP_UNTAR_DATA_FILE;
+    return 0;
+}
+
+static int ftp_untar_mkdir(struct FtpSession* session) {
+    struct Pathname path = session->transfer->temp_path;
+    struct Pathname failed;
+    struct stat st;
+
+    size_t len = strlen(path.s);
+    while (len > 1 && path.s[len - 1] == '/') {
+        path.s[--len] = '\0';
+    }
+
+    int rc = ftp_vfs_mkdir(path.s);
+    if (rc < 0 && errno == EEXIST) {
+        rc = ftp_vfs_stat(path.s, &st);
+        if (rc >= 0 && !S_ISDIR(st.st_mode)) {
+            errno = ENOTDIR;
+            rc = -1;
+        }
+    } else if (rc < 0 && errno == ENOENT) {
+        rc = ftp_mkdirs(&path, &failed);
+    }
+    return rc;
+}
+
+// finishes the entry once all of its data is received.
+static int ftp_untar_entry_end(struct FtpSession* session) {
+    struct FtpTransfer* transfer = session->transfer;
+    struct FtpUntar* u = &transfer->untar;
+    int rc = 0;
+
+    if (u->data == FTP_UNTAR_DATA_FILE) {
+        rc = ftp_file_flush(transfer);
+        ftp_vfs_close(&transfer->file_vfs);
+        transfer->alloc_size = 0;
+    } else if (u->data == FTP_UNTAR_DATA_NAME && u->type == 'L') {
+        transfer->temp_path.s[u->base + u->name_size] = '\0';
+        u->long_name = 1;
+    } else if (u->data == FTP_UNTAR_DATA_NAME) {
+        rc = ftp_untar_pax(session);
+    }
+
+    u->data = FTP_UNTAR_DATA_SKIP;
+    return rc;
+}
+
+// handles the header in list_buf. entries are extracted relative to the directory, with
+// the leading '/' and "./" dropped as tar does, and names with ".." in them are refused.
+// links and special files are skipped.
+static int ftp_untar_header(struct FtpSession* session) {
+    struct FtpTransfer* transfer = session->transfer;
+    struct FtpUntar* u = &transfer->untar;
+    struct Pathname* path = &transfer->temp_path;
+    const char* h = transfer->list_buf;
+    char* name = path->s + u->base;
+
+    // the checksum is worked out as if the checksum field were spaces.
+    unsigned sum = 0;
+    bool zero = true;
+    for (size_t i = 0; i < FTP_TAR_RECORD_SIZE; i++) {
+        sum += i >= 148 && i < 156 ? ' ' : (unsigned char)h[i];
+        zero = zero && !h[i];
+    }
+
+    if (zero) {
+        // the end of the archive, the rest of the data is ignored.
+        u->eof = 1;
+        return 0;
+    } else if (sum != ftp_untar_number(h + 148, 8)) {
+        errno = EBADMSG;
+        return -1;
+    }
+
+    u->type = h[156];
+    u->data = FTP_UNTAR_DATA_SKIP;
+    u->size = ftp_untar_number(h + 124, 12);
+
+    if (u->type == 'L' || u->type == 'x') {
+        // the name is put together where it'll be used, pax headers that don't fit are skipped.
+        if (u->size < sizeof(*path) - u->base) {
+            u->data = FTP_UNTAR_DATA_NAME;
+            u->name_size = 0;
+        } else if (u->type == 'L') {
+            errno = ENAMETOOLONG;
+            return -1;
+        } else {
+            ftp_log_callback(FTP_API_LOG_TYPE_ERROR, "untar: pax header too large");
+        }
+    } else if (u->type != 'g' && u->type != 'K') {
+        if (!u->long_name) {
+            // ustar splits long names into a prefix and a name.
+            size_t len = 0;
+            if (!memcmp(h + 257, "ustar", 6) && h[345]) {
+                len = ftp_untar_field(name, h + 345, 155);
+                name[len++] = '/';
+            }
+            if (u->base + len + FTP_TAR_NAME_SIZE >= sizeof(*path)) {
+                errno = ENAMETOOLONG;
+                return -1;
+            }
+            len += ftp_untar_field(name + len, h, FTP_TAR_NAME_SIZE);
+            name[len] = '\0';
+        }
+        if (u->pax_size) {
+            u->size = u->pax_size;
+        }
+        u->long_name = 0;
+        u->pax_size = 0;
+
+        size_t skip = 0;
+        while (name[skip] == '/' || (name[skip] == '.' && name[skip + 1] == '/')) {
+            skip += name[skip] == '/' ? 1 : 2;
+        }
+        memmove(name, name + skip, strlen(name + skip) + 1);
+
+        if (!name[0] || !strcmp(name, ".")) {
+            // the directory itself.
+        } else if (ftp_path_has_dots(path->s)) {
+            errno = EPERM;
+            return -1;
+        } else if (u->type == '0' || u->type == '\0' || u->type == '7') {
+            if (ftp_untar_open(session) < 0) {
+                return -1;
+            }
+        } else if (u->type == '5') {
+            if (ftp_untar_mkdir(session) < 0) {
+                return -1;
+            }
+        } else {
+            ftp_log_callback(FTP_API_LOG_TYPE_ERROR, "untar: skipping link or special file");
+        }
+    }
+
+    // links and directories may have a size set, but no data follows them.
+    if (u->type == '1' || u->type == '2' || u->type == '5') {
+        u->size = 0;
+    }
+    u->count = u->size;
+    u->pad = ftp_tar_pad(u->size);
+    if (!u->count) {
+        return ftp_untar_entry_end(session);
+    }
+    return 0;
+}
+
+// parses the archive as it's received, writing out each file as it arrives.
+static int ftp_untar_write(struct FtpSession* session, const void* buf, size_t size) {
+    struct FtpTransfer* transfer = session->transfer;
+    struct FtpUntar* u = &transfer->untar;
+    const char* data = buf;
+    size_t left = size;
+
+    while (left && !u->eof) {
+        size_t n;
+        if (u->count) {
+            n = left < u->count ? left : u->count;
+            if (u->data == FTP_UNTAR_DATA_FILE && ftp_file_write(transfer, data, n) < 0) {
+                return -1;
+            } else if (u->data == FTP_UNTAR_DATA_NAME) {
+                memcpy(transfer->temp_path.s + u->base + u->name_size, data, n);
+                u->name_size += n;
+            }
+            u->count -= n;
+            if (!u->count && ftp_untar_entry_end(session) < 0) {
+                return -1;
+            }
+        } else if (u->pad) {
+            n = left < u->pad ? left : u->pad;
+            u->pad -= n;
+        } else {
+            n = FTP_TAR_RECORD_SIZE - u->header_size;
+            n = left < n ? left : n;
+            memcpy(transfer->list_buf + u->header_size, data, n);
+            u->header_size += n;
+            if (u->header_size == FTP_TAR_RECORD_SIZE) {
+                u->header_size = 0;
+                if (ftp_untar_header(session) < 0) {
+                    return -1;
+                }
+            }
+        }
+
+        data += n;
+        left -= n;
+    }
+
+    return size;
+}
+
+// closes a data connection that was opened ahead of the transfer, keeping errno for the reply.
+static void ftp_data_early_close(struct FtpSession* session) {
+    const int err = errno;
+    ftp_close_socket(&session->data_sock);
+    session->data_early = 0;
+    session->data_connecting = 0;
+    errno = err;
+}
+
+// starts connecting to the PORT address without waiting, so that the
+// data connection is likely to be up by the time the transfer command arrives.
+static int ftp_data_early_connect(struct FtpSession* session) {
+    session->data_sock = socket_open(PF_INET, SOCK_STREAM, 0);
+    if (session->data_sock < 0) {
+        return -1;
+    }
+
+    ftp_set_socket_nonblocking_enable(session->data_sock);
+    session->data_early = 1;
+    if (!socket_connect(session->data_sock, (struct sockaddr*)&session->data_sockaddr, sizeof(session->data_sockaddr))) {
+        return 0;
+    } else if (errno == EINPROGRESS || errno == EWOULDBLOCK || errno == EAGAIN) {
+        session->data_connecting = 1;
+        return 0;
+    }
+
+    ftp_data_early_close(session);
+    return -1;
+}
+
+// carries on with the connect once the socket is writable, returns 1 if
+// connected, 0 if still connecting, or -1 if it failed and the socket was closed.
+static int ftp_data_early_connect_finish(struct FtpSession* session) {
+    // connecting again gives the result of the connect that was in progress.
+    if (!socket_connect(session->data_sock, (struct sockaddr*)&session->data_sockaddr, sizeof(session->data_sockaddr)) || errno == EISCONN) {
+        session->data_connecting = 0;
+        return 1;
+    } else if (errno == EINPROGRESS || errno == EALREADY || errno == EWOULDBLOCK || errno == EAGAIN) {
+        return 0;
+    }
+
+    ftp_data_early_close(session);
+    return -1;
+}
+
+// accepts a connection on the PASV listener, closing any that don't come from the client's
+// address so that someone else can't take over the transfer. returns -1 if there's none left.
+static int ftp_pasv_accept(struct FtpSession* session, struct sockaddr_in* sa) {
+    int sock;
+    socklen_t socklen = sizeof(*sa);
+    while ((sock = socket_accept(session->pasv_sock, (struct sockaddr*)sa, &socklen)) > 0) {
+        if (sa->sin_addr.s_addr == session->peer_sockaddr.sin_addr.s_addr) {
+            return sock;
+        }
+
+        ftp_log_callback(FTP_API_LOG_TYPE_ERROR, "pasv: refused a data connection from another address");
+        ftp_close_socket(&sock);
+        socklen = sizeof(*sa);
+    }
+    return -1;
+}
+
+// accepts the PASV connection if the client has made it, the listener is non-blocking.
+static void ftp_data_early_accept(struct FtpSession* session) {
+    const int sock = ftp_pasv_accept(session, &session->pasv_sockaddr);
+    if (sock > 0) {
+        session->data_sock = sock;
+        session->data_early = 1;
+    }
+}
+
+// waits for the client to make the PASV connection, connections from other addresses
+// are refused so this keeps waiting for the client's until data_timeout_ms is up.
+static void ftp_data_early_accept_wait(struct FtpSession* session) {
+    const unsigned long long deadline = ftp_get_time_ms() + g_ftp.cfg.data_timeout_ms;
+    while (session->data_sock <= 0) {
+        const unsigned long long now = ftp_get_time_ms();
+        const int rc = now < deadline ? ftp_socket_wait(session->pasv_sock, false, (int)(deadline - now)) : 0;
+        if (rc <= 0) {
+            if (!rc) {
+                errno = ETIMEDOUT;
+            }
+            break;
+        }
+        ftp_data_early_accept(session);
+    }
+}
+
+// returns the socket to poll while the data connection is made between
+// PASV / PORT and the transfer command, -1 if there's nothing to wait for.
+static int ftp_data_early_sock(const struct FtpSession* session, bool* write) {
+    *write = false;
+    if (session->data_connection == FTP_DATA_CONNECTION_PASSIVE && session->data_sock <= 0) {
+        return session->pasv_sock;
+    } else if (session->data_connection == FTP_DATA_CONNECTION_ACTIVE && session->data_connecting) {
+        *write = true;
+        return session->data_sock;
+    }
+    return -1;
+}
+
+static void ftp_data_early_progress(struct FtpSession* session) {
+    if (session->data_connection == FTP_DATA_CONNECTION_PASSIVE) {
+        ftp_data_early_accept(session);
+    } else if (session->data_connection == FTP_DATA_CONNECTION_ACTIVE && session->data_connecting) {
+        ftp_data_early_connect_finish(session);
+    }
+}
+
+static int ftp_data_open(struct FtpSession* session) {
+    int rc = 0;
+#if FTP_ZLIB_STREAMS
+    // check that a stream is free before telling the client to connect.
+    if (session->mode == FTP_MODE_DEFLATE && ftp_zlib_acquire(session->transfer) < 0) {
+        return -1;
+    }
+#endif
+
+    memset(&session->transfer->block, 0, sizeof(session->transfer->block));
+    session->transfer->block.marker = session->transfer->offset + FTP_BLOCK_MARKER_SIZE;
+
+    // the data connection from the last block mode transfer is reused.
+    if (session->data_connection != FTP_DATA_CONNECTION_NONE && session->data_sock > 0 && !session->data_early) {
+        ftp_client_msg(session, "125 Data connection already open; transfer starting.");
+        return session->data_sock;
+    }
+
+    ftp_client_msg(session, "150 File status okay; about to open data connection.");
+
+    // the connection is usually up already, made by the loop after PASV / PORT.
+    switch (session->data_connection) {
+        case FTP_DATA_CONNECTION_NONE:
+            break;
+        case FTP_DATA_CONNECTION_ACTIVE:
+            // the connect started by PORT failed, so it's tried again.
+            if (session->data_sock <= 0) {
+                ftp_data_early_connect(session);
+            }
+            while (session->data_connecting) {
+                rc = ftp_socket_wait(session->data_sock, true, g_ftp.cfg.data_timeout_ms);
+                if (rc <= 0) {
+                    if (!rc) {
+                        errno = ETIMEDOUT;
+                    }
+                    ftp_data_early_close(session);
+                } else {
+                    ftp_data_early_connect_finish(session);
+                }
+            }
+            break;
+        case FTP_DATA_CONNECTION_PASSIVE:
+            if (session->data_sock <= 0) {
+                ftp_data_early_accept_wait(session);
+            }
+            break;
+    }
+
+    rc = session->data_connection != FTP_DATA_CONNECTION_NONE && session->data_sock > 0 ? session->data_sock : -1;
+    session->data_early = 0;
+
+    if (rc > 0) {
+        ftp_set_socket_nonblocking_enable(session->data_sock);
+        ftp_set_socket_keepalive_enable(session->data_sock);
+        ftp_set_socket_throughput_enable(session->data_sock);
+#if FTP_TLS
+        // the handshake is carried on by the loop, before any data is moved.
+        if (session->tls_private && ftp_tls_begin(&session->data_tls, session->data_sock) < 0) {
+            ftp_close_socket(&session->data_sock);
+            rc = -1;
+        }
+#endif
+    }
+#if FTP_ZLIB_STREAMS
+    if (rc <= 0) {
+        ftp_zlib_release(session->transfer);
+    }
+#endif
+
+    return rc;
+}
+
+// gives the session a transfer context if it doesn't have one, returns -1 if they're all in use.
+static int ftp_transfer_acquire(struct FtpSession* session) {
+    if (session->transfer) {
+        return 0;
+    } else if (!g_ftp.transfer_free_count) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    session->transfer = g_ftp.transfer_free[--g_ftp.transfer_free_count];
+    memset(session->transfer, 0, sizeof(*session->transfer));
+    ftp_vfs_file_init(&session->transfer->file_vfs);
+    ftp_vfs_file_init(&session->transfer->copy_vfs);
+    ftp_vfs_file_init(&session->transfer->delta.basis);
+    return 0;
+}
+
+// gives back the transfer context once the session has nothing left that needs it.
+static void ftp_transfer_release(struct FtpSession* session) {
+    if (session->transfer && session->transfer->mode == FTP_TRANSFER_MODE_NONE && !session->path_pending) {
+        g_ftp.transfer_free[g_ftp.transfer_free_count++] = session->transfer;
+        session->transfer = NULL;
+    }
+}
+
+// returns the transfer in progress, none if the session doesn't have a transfer context.
+static enum FTP_TRANSFER_MODE ftp_transfer_mode(const struct FtpSession* session) {
+    return session->transfer ? session->transfer->mode : FTP_TRANSFER_MODE_NONE;
+}
+
+// gives a command that needs it a transfer context, replying 450 if they're all in use.
+static bool ftp_cmd_transfer_acquire(struct FtpSession* session) {
+    if (ftp_transfer_acquire(session) < 0) {
+        ftp_client_msg(session, "450 Requested action not taken, too many sessions busy, try again later.");
+        return false;
+    }
+    return true;
+}
+
+static void ftp_data_transfer_end(struct FtpSession* session) {
+    if (session->transfer && session->transfer->keep_open) {
+        // only the data connection is needed from now on.
+        ftp_pasv_release(session);
+    } else {
+#if FTP_TLS
+        ftp_tls_close(&session->data_tls, session->data_sock);
+#endif
+        switch (session->data_connection) {
+            case FTP_DATA_CONNECTION_NONE:
+                break;
+            case FTP_DATA_CONNECTION_ACTIVE:
+                ftp_close_socket(&session->data_sock);
+                break;
+            case FTP_DATA_CONNECTION_PASSIVE:
+                ftp_close_socket(&session->data_sock);
+                ftp_pasv_release(session);
+                break;
+        }
+        session->data_connection = FTP_DATA_CONNECTION_NONE;
+        session->data_early = 0;
+        session->data_connecting = 0;
+    }
+
+    // nothing else is set up without a transfer context.
+    if (!session->transfer) {
+        return;
+    }
+
+#if FTP_IO_THREADS
+    ftp_io_release(session, false);
+#endif
+#if FTP_WRITE_BUFFER_COUNT
+    ftp_write_buffer_release(session->transfer);
+#endif
+#if FTP_ZLIB_STREAMS
+    ftp_zlib_release(session->transfer);
+#endif
+    ftp_stripe_release(session);
+    // give back whatever was reserved but not written.
+    if (session->transfer->alloc_size) {
+        ftp_vfs_truncate(&session->transfer->file_vfs, session->transfer->write_offset);
+    }
+    if (session->transfer->mode == FTP_TRANSFER_MODE_STOR) {
+        ftp_file_drop_behind(session->transfer, session->transfer->write_offset, 1);
+    } else if (session->transfer->mode == FTP_TRANSFER_MODE_RETR) {
+        ftp_file_drop_behind(session->transfer, session->transfer->offset, 1);
+    }
+    ftp_vfs_close(&session->transfer->file_vfs);
+    ftp_vfs_closedir(&session->transfer->dir_vfs);
+
+    if (session->transfer->delta.active) {
+        ftp_vfs_close(&session->transfer->delta.basis);
+        // the old file is left as it was if the upload didn't make it to the end.
+        if (!session->transfer->delta.done) {
+            ftp_vfs_unlink(session->transfer->temp_path.s);
+        }
+    }
+    memset(&session->transfer->delta, 0, sizeof(session->transfer->delta));
+    ftp_vfs_file_init(&session->transfer->delta.basis);
+
+    // a file that was cut short is removed, the entries before it are kept.
+    if (session->transfer->untar.active && session->transfer->untar.data == FTP_UNTAR_DATA_FILE) {
+        ftp_vfs_unlink(session->transfer->temp_path.s);
+    }
+    memset(&session->transfer->untar, 0, sizeof(session->transfer->untar));
+
+#if FTP_TAR_DEPTH
+    while (session->transfer->tar.depth) {
+        ftp_vfs_closedir(&session->transfer->tar.dirs[--session->transfer->tar.depth]);
+    }
+    memset(&session->transfer->tar, 0, sizeof(session->transfer->tar));
+#endif
+
+    if (session->transfer->hash_inline == 2) {
+        ftp_hash_cache_store_upload(session);
+    }
+    session->transfer->hash_inline = 0;
+    session->transfer->hash_reply = 0;
+    // the path held for RNTO / CPTO is in temp_path, so it's gone too.
+    session->transfer->temp_path.s[0] = '\0';
+    session->path_pending = FTP_PATH_PENDING_NONE;
+    session->transfer->offset = 0;
+    session->transfer->size = 0;
+    session->transfer->deficit = 0;
+    session->transfer->write_offset = 0;
+    session->transfer->alloc_size = 0;
+    session->transfer->alloc_failed = 0;
+    session->transfer->sparse = 0;
+    session->transfer->sparse_seek = 0;
+    session->transfer->sparse_end = 0;
+    session->transfer->ascii = 0;
+    session->transfer->ascii_cr = 0;
+    session->transfer->cache = FtpVfsCache_DEFAULT;
+    session->transfer->cache_checked = 0;
+    session->transfer->drop_offset = 0;
+    session->transfer->writeback_offset = 0;
+    session->transfer->finishing = 0;
+    session->transfer->keep_open = 0;
+    session->transfer->mode = FTP_TRANSFER_MODE_NONE;
+}
+
+// ends a transfer that went ok, with MODE Z / MODE B the end of the data is sent first.
+static void ftp_data_transfer_complete(struct FtpSession* session) {
+    struct FtpTransfer* transfer = session->transfer;
+
+#if FTP_IO_THREADS
+    // anything the io threads were given but didn't write is written before the reply.
+    if (transfer->mode == FTP_TRANSFER_MODE_STOR && ftp_io_release(session, true) < 0) {
+        ftp_client_msg(session, "451 Requested action aborted: local error in processing, %s.", strerror(errno));
+        ftp_data_transfer_end(session);
+        return;
+    }
+#endif
+#if FTP_ZLIB_STREAMS
+    // the connection was closed before the end of the stream, so the file is missing its end.
+    if (transfer->mode == FTP_TRANSFER_MODE_STOR && transfer->zlib && !transfer->zlib->finished) {
+        ftp_client_msg(session, "451 Requested action aborted: local error in processing, compressed stream ended early.");
+        ftp_data_transfer_end(session);
+        return;
+    }
+#endif
+
+    if (transfer->mode != FTP_TRANSFER_MODE_STOR) {
+        int rc = 1;
+#if FTP_ZLIB_STREAMS
+        if (transfer->zlib) {
+            rc = ftp_zlib_finish(session);
+        }
+#endif
+        if (session->mode == FTP_MODE_BLOCK || session->mode == FTP_MODE_EXTENDED) {
+            rc = ftp_block_finish(session);
+        }
+#if FTP_TLS
+        // the last records have to be sent before the connection is closed.
+        if (rc > 0 && session->data_tls.ssl) {
+            rc = ftp_tls_finish(&session->data_tls, session->data_sock);
+        }
+#endif
+
+        if (!rc) {
+            // carried on by ftp_data_flush() once the socket is writable.
+            transfer->finishing = 1;
+            return;
+        } else if (rc < 0) {
+            ftp_client_msg(session, "426 bad Connection closed; transfer aborted, %s.", strerror(errno));
+            ftp_data_transfer_end(session);
+            return;
+        }
+    }
+
+    if (transfer->hash_inline) {
+        transfer->hash_inline = 2;
+    }
+
+    // in block mode the client knows where the file ends from the EOF
+    // block, so the data connection can be used for the next transfer.
+    if (session->mode == FTP_MODE_BLOCK && (transfer->mode != FTP_TRANSFER_MODE_STOR || transfer->block.eof)) {
+        transfer->keep_open = 1;
+        ftp_client_msg(session, "250 Requested file action okay, completed.");
+    } else {
+        ftp_client_msg(session, "226 Closing data connection.");
+    }
+    ftp_data_transfer_end(session);
+}
+
+// sends the data left over from the last poll (MODE Z / MODE B), returns
+// false if the transfer has to wait for the socket or has ended.
+static bool ftp_data_flush(struct FtpSession* session) {
+    struct FtpTransfer* transfer = session->transfer;
+    int rc = 0;
+
+    if (transfer->finishing) {
+        ftp_data_transfer_complete(session);
+        return false;
+    } else if (transfer->mode == FTP_TRANSFER_MODE_STOR) {
+        return true;
+    }
+
+#if FTP_ZLIB_STREAMS
+    if (transfer->zlib) {
+        rc = ftp_zlib_send_pending(session);
+    }
+#endif
+    if (session->mode == FTP_MODE_BLOCK || session->mode == FTP_MODE_EXTENDED) {
+        rc = ftp_block_send_pending(session);
+    }
+
+    if (rc < 0) {
+        if (errno != EWOULDBLOCK && errno != EAGAIN) {
+            ftp_client_msg(session, "426 bad Connection closed; transfer aborted, %s.", strerror(errno));
+            ftp_data_transfer_end(session);
+        }
+        return false;
+    }
+    return true;
+}
+
+#if FTP_STRIPE_COUNT
+// returns true if a reserved data connection is still waiting for the client to connect.
+static bool ftp_stripe_wants_accept(const struct FtpSession* session) {
+    if (session->data_connection == FTP_DATA_CONNECTION_PASSIVE) {
+        for (size_t i = 0; i < FTP_ARR_SZ(g_ftp.stripes); i++) {
+            const struct FtpStripe* stripe = &g_ftp.stripes[i];
+            if (stripe->session == session && stripe->sock <= 0) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// returns true if the data connection has run out of data but the EOF block, which holds the number
+// of connections, has to wait until the client has opened the rest of them or they are given up on.
+static bool ftp_stripe_wants_eof(const struct FtpStripe* stripe) {
+    const struct FtpTransfer* transfer = stripe->session->transfer;
+    return transfer->mode == FTP_TRANSFER_MODE_RETR && !stripe->count && stripe->header_offset >= stripe->header_size &&
+        transfer->offset >= transfer->size && !transfer->stripe_eof && ftp_stripe_wants_accept(stripe->session);
+}
+
+// returns true if the data connection has something left to send / receive.
+static bool ftp_stripe_wants_io(const struct FtpStripe* stripe) {
+    return stripe->sock > 0 && (!stripe->eod || stripe->header_offset < stripe->header_size) && !ftp_stripe_wants_eof(stripe);
+}
+
+static void ftp_stripe_accept(struct FtpSession* session) {
+    for (size_t i = 0; i < FTP_ARR_SZ(g_ftp.stripes); i++) {
+        struct FtpStripe* stripe = &g_ftp.stripes[i];
+        if (stripe->session == session && stripe->sock <= 0) {
+            struct sockaddr_in sa;
+            const int sock = ftp_pasv_accept(session, &sa);
+            if (sock <= 0) {
+                break;
+            }
+            ftp_stripe_set_socket(stripe, sock);
+        }
+    }
+}
+
+// returns the ms left for the client to open the rest of the data connections, 0 once it's too late.
+static int ftp_stripe_accept_wait(const struct FtpSession* session) {
+    const unsigned long long now = ftp_get_time_ms();
+    const unsigned long long deadline = session->transfer->stripe_deadline_ms;
+    return now < deadline ? (int)(deadline - now) : 0;
+}
+
+// gives up on the data connections that the client didn't open in time, blocks are only handed
+// out to connections that are writable so the ones that did open send the rest of the file.
+static void ftp_stripe_accept_timeout(struct FtpSession* session) {
+    struct FtpTransfer* transfer = session->transfer;
+    for (size_t i = 0; i < FTP_ARR_SZ(g_ftp.stripes); i++) {
+        struct FtpStripe* stripe = &g_ftp.stripes[i];
+        if (stripe->session == session && stripe->sock <= 0) {
+            memset(stripe, 0, sizeof(*stripe));
+            transfer->stripes--;
+        }
+    }
+}
+
+static void ftp_stripe_queue(struct FtpStripe* stripe, int flags, size_t count, size_t offset) {
+    stripe->header[0] = flags;
+    ftp_block_put64(stripe->header + 1, count);
+    ftp_block_put64(stripe->header + 9, offset);
+    stripe->header_offset = 0;
+    stripe->header_size = sizeof(stripe->header);
+}
+
+// sends the next part of the file on the data connection, each block is read
+// at its own offset so the blocks can be sent in any order.
+static int ftp_stripe_send(struct FtpSession* session, struct FtpStripe* stripe) {
+    struct FtpTransfer* transfer = session->transfer;
+
+    while (1) {
+        if (stripe->header_offset < stripe->header_size) {
+            const int n = socket_send(stripe->sock, stripe->header + stripe->header_offset, stripe->header_size - stripe->header_offset, 0);
+            if (n < 0) {
+                return -1;
+            }
+            ftp_rate_limit_take(session, n);
+            stripe->header_offset += n;
+            continue;
+        }
+
+        if (stripe->count) {
+            break;
+        } else if (stripe->eod) {
+            return 0;
+        } else if (transfer->offset < transfer->size) {
+            const size_t left = transfer->size - transfer->offset;
+            stripe->count = left < FTP_STRIPE_BLOCK_SIZE ? left : FTP_STRIPE_BLOCK_SIZE;
+            stripe->offset = transfer->offset;
+            transfer->offset += stripe->count;
+            ftp_stripe_queue(stripe, 0, stripe->count, stripe->offset);
+        } else if (ftp_stripe_wants_eof(stripe)) {
+            return 0;
+        } else if (!transfer->stripe_eof) {
+            // the first connection to run out of data tells the client how many EOD blocks to expect.
+            transfer->stripe_eof = 1;
+            stripe->eod = 1;
+            ftp_stripe_queue(stripe, FTP_BLOCK_DESCRIPTOR_EOF | FTP_BLOCK_DESCRIPTOR_EOD, 0, transfer->stripes);
+        } else {
+            stripe->eod = 1;
+            ftp_stripe_queue(stripe, FTP_BLOCK_DESCRIPTOR_EOD, 0, 0);
+        }
+    }
+
+    const size_t size = ftp_data_transfer_budget(session, stripe->count < g_ftp.cfg.file_buffer_size ? stripe->count : g_ftp.cfg.file_buffer_size);
+    if (!size) {
+        return 0;
+    }
+
+    int n = ftp_vfs_seek(&transfer->file_vfs, stripe->offset);
+    if (n >= 0) {
+        n = ftp_vfs_read(&transfer->file_vfs, g_ftp.data_buf, size);
+        if (n == 0) {
+            // the file was truncated whilst being sent.
+            errno = EIO;
+            n = -1;
+        }
+    }
+    if (n < 0) {
+        ftp_client_msg(session, "451 Requested action aborted: local error in processing, %s.", strerror(errno));
+        ftp_data_transfer_end(session);
+        return -2;
+    }
+
+    n = socket_send(stripe->sock, g_ftp.data_buf, n, 0);
+    if (n > 0) {
+        ftp_rate_limit_take(session, n);
+        ftp_data_transfer_consume(session, n);
+        stripe->offset += n;
+        stripe->count -= n;
+    }
+    return n;
+}
+
+// writes at an offset, used by striped transfers as the blocks can arrive in any order.
+static int ftp_file_write_at(struct FtpTransfer* transfer, const void* buf, size_t size, size_t off) {
+    const unsigned char* data = buf;
+    ftp_file_set_cache(transfer, off + size, 0);
+    ftp_file_preallocate(transfer, off + size);
+
+    if (ftp_vfs_seek(&transfer->file_vfs, off) < 0) {
+        return -1;
+    }
+
+    for (size_t written = 0; written < size;) {
+        const int rc = ftp_vfs_write(&transfer->file_vfs, data + written, size - written);
+        if (rc < 0) {
+            return -1;
+        } else if (rc == 0) {
+            errno = ENOSPC;
+            return -1;
+        }
+        written += rc;
+    }
+
+    if (off + size > transfer->write_offset) {
+        transfer->write_offset = off + size;
+    }
+    return size;
+}
+
+// receives the next part of the file from the data connection, writing
+// each block at the offset given in its header.
+static int ftp_stripe_recv(struct FtpSession* session, struct FtpStripe* stripe) {
+    struct FtpTransfer* transfer = session->transfer;
+    int n;
+
+    if (stripe->header_offset < sizeof(stripe->header)) {
+        n = socket_recv(stripe->sock, stripe->header + stripe->header_offset, sizeof(stripe->header) - stripe->header_offset, 0);
+        if (n <= 0) {
+            goto recv_error;
+        }
+        ftp_rate_limit_take(session, n);
+
+        stripe->header_offset += n;
+        if (stripe->header_offset < sizeof(stripe->header)) {
+            return n;
+        }
+
+        stripe->flags = stripe->header[0];
+        stripe->count = ftp_block_get64(stripe->header + 1);
+        stripe->offset = ftp_block_get64(stripe->header + 9);
+
+        // the offset of the EOF block is the number of EOD blocks to expect.
+        if (stripe->flags & FTP_BLOCK_DESCRIPTOR_EOF) {
+            if (stripe->count || !stripe->offset) {
+                errno = EBADMSG;
+                goto local_error;
+            }
+            transfer->stripe_eodc = stripe->offset;
+        }
+    }
+
+    if (stripe->count) {
+        const size_t size = ftp_data_transfer_budget(session, stripe->count < g_ftp.cfg.file_buffer_size ? stripe->count : g_ftp.cfg.file_buffer_size);
+        if (!size) {
+            return 0;
+        }
+
+        n = socket_recv(stripe->sock, g_ftp.data_buf, size, 0);
+        if (n <= 0) {
+            goto recv_error;
+        }
+
+        ftp_rate_limit_take(session, n);
+        ftp_data_transfer_consume(session, n);
+        if (ftp_file_write_at(transfer, g_ftp.data_buf, n, stripe->offset) < 0) {
+            goto local_error;
+        }
+        stripe->offset += n;
+        stripe->count -= n;
+    }
+
+    if (!stripe->count) {
+        stripe->header_offset = 0;
+        if (stripe->flags & FTP_BLOCK_DESCRIPTOR_EOD) {
+            stripe->eod = 1;
+            transfer->stripe_eods++;
+        }
+    }
+    return 1;
+
+recv_error:
+    // the connection must not be closed until EOD has been sent.
+    if (n == 0) {
+        errno = ECONNRESET;
+    }
+    return -1;
+
+local_error:
+    ftp_client_msg(session, "451 Requested action aborted: local error in processing, %s.", strerror(errno));
+    ftp_data_transfer_end(session);
+    return -2;
+}
+
+// services every data connection of a striped transfer.
+static void ftp_stripe_progress(struct FtpSession* session) {
+    struct FtpTransfer* transfer = session->transfer;
+    transfer->stripe_ready = 0;
+
+    if (ftp_stripe_wants_accept(session)) {
+        ftp_stripe_accept(session);
+    }
+    if (ftp_stripe_wants_accept(session) && !ftp_stripe_accept_wait(session)) {
+        ftp_stripe_accept_timeout(session);
+    }
+
+    bool done = true;
+    for (size_t i = 0; i < FTP_ARR_SZ(g_ftp.stripes); i++) {
+        struct FtpStripe* stripe = &g_ftp.stripes[i];
+        if (stripe->session != session) {
+            continue;
+        } else if (!ftp_stripe_wants_io(stripe)) {
+            done &= stripe->sock > 0;
+            continue;
+        }
+
+        const int n = transfer->mode == FTP_TRANSFER_MODE_STOR ? ftp_stripe_recv(session, stripe) : ftp_stripe_send(session, stripe);
+        if (n == -2) {
+            return;
+        } else if (n < 0 && errno != EWOULDBLOCK && errno != EAGAIN) {
+            ftp_client_msg(session, "426 bad Connection closed; transfer aborted, %s.", strerror(errno));
+            ftp_data_transfer_end(session);
+            return;
+        }
+
+        done &= !ftp_stripe_wants_io(stripe);
+    }
+
+    if (transfer->mode == FTP_TRANSFER_MODE_STOR) {
+        done = transfer->stripe_eodc && transfer->stripe_eods >= transfer->stripe_eodc;
+    }
+
+    if (done) {
+        ftp_client_msg(session, "226 Closing data connection.");
+        ftp_data_transfer_end(session);
+    }
+}
+#endif // FTP_STRIPE_COUNT
+
+// ends a HASH / XCRC / XMD5 / SITE CPTO / SITE RMTREE, the data connection is left alone as it's not used.
+static void ftp_local_transfer_end(struct FtpSession* session) {
+    struct FtpTransfer* transfer = session->transfer;
+    ftp_vfs_close(&transfer->file_vfs);
+    ftp_vfs_closedir(&transfer->dir_vfs);
+    // a copy that didn't finish is removed rather than left half written.
+    if (ftp_vfs_isfile_open(&transfer->copy_vfs)) {
+        if (transfer->alloc_size) {
+            ftp_vfs_truncate(&transfer->copy_vfs, transfer->offset);
+        }
+        ftp_vfs_close(&transfer->copy_vfs);
+        ftp_vfs_unlink(transfer->temp_path.s);
+    }
+    transfer->alloc_size = 0;
+    transfer->copy_fast = 0;
+    transfer->temp_path.s[0] = '\0';
+    session->path_pending = FTP_PATH_PENDING_NONE;
+    transfer->offset = 0;
+    transfer->size = 0;
+    transfer->index = 0;
+    transfer->deficit = 0;
+    transfer->hash_reply = 0;
+    transfer->mode = FTP_TRANSFER_MODE_NONE;
+}
+
+static void ftp_hash_reply(struct FtpSession* session, const unsigned char* digest) {
+    const struct FtpTransfer* transfer = session->transfer;
+    const size_t size = ftp_hash_size(transfer->hash.type);
+    char hex[FTP_HASH_MAX_SIZE * 2 + 1];
+
+    for (size_t i = 0; i < size; i++) {
+        snprintf(hex + i * 2, 3, transfer->hash_reply == 213 ? "%02x" : "%02X", digest[i]);
+    }
+
+    if (transfer->hash_reply == 213) {
+        const size_t last = transfer->size > transfer->hash_start ? transfer->size - 1 : transfer->hash_start;
+        ftp_client_msg(session, "213 %s %zu-%zu %s %s", ftp_hash_name(transfer->hash.type), transfer->hash_start, last, hex, transfer->temp_path.s);
+    } else {
+        ftp_client_msg(session, "%d %s", transfer->hash_reply, hex);
+    }
+}
+
+// hashes the next part of the file, the file is read a quantum at a time so
+// that hashing a large file doesn't hold up the other sessions.
+static void ftp_hash_data_transfer_progress(struct FtpSession* session) {
+    struct FtpTransfer* transfer = session->transfer;
+    const size_t left = transfer->size - transfer->offset;
+    size_t size = transfer->deficit < g_ftp.cfg.file_buffer_size ? transfer->deficit : g_ftp.cfg.file_buffer_size;
+    size = left < size ? left : size;
+
+    if (size) {
+        const int n = ftp_vfs_read(&transfer->file_vfs, g_ftp.data_buf, size);
+        if (n <= 0) {
+            // the file was truncated whilst being hashed.
+            if (n == 0) {
+                errno = EIO;
+            }
+            ftp_client_msg(session, "451 Requested action aborted: local error in processing, %s.", strerror(errno));
+            ftp_local_transfer_end(session);
+            return;
+        }
+
+        ftp_hash_update(&transfer->hash, g_ftp.data_buf, n);
+        transfer->offset += n;
+        transfer->deficit -= n;
+    }
+
+    if (transfer->offset == transfer->size) {
+        unsigned char digest[FTP_HASH_MAX_SIZE];
+        ftp_hash_final(&transfer->hash, digest);
+#if FTP_HASH_CACHE_ENTRIES
+        struct stat st;
+        if (!ftp_vfs_fstat(&transfer->file_vfs, transfer->temp_path.s, &st)) {
+            ftp_hash_cache_store(transfer->temp_path.s, &st, transfer->hash.type, transfer->hash_start, transfer->size, digest);
+        }
+#endif
+        ftp_hash_reply(session, digest);
+        ftp_local_transfer_end(session);
+    }
+}
+
+static void ftp_dir_data_transfer_progress(struct FtpSession* session) {
+    const time_t cur_time = time(NULL);
+    const bool nlist = session->transfer->mode == FTP_TRANSFER_MODE_NLST;
+    const bool device_list = g_ftp.cfg.devices && g_ftp.cfg.devices_count && !strcmp("/", session->transfer->temp_path.s);
+    const bool is_root = !strcmp("/", session->transfer->temp_path.s);
+    struct FtpTransfer* transfer = session->transfer;
+
+    // send as much data as possible, up to a limited number of entries
+    // so that huge directories don't stall the other sessions.
+    for (size_t entries = 0; entries < FTP_SCHED_LIST_ENTRIES;) {
+        if (transfer->size) {
+            const size_t size = ftp_data_transfer_budget(session, transfer->size);
+            if (!size) {
+                break;
+            }
+
+            errno = 0;
+            const int n = ftp_data_send(session, transfer->list_buf + transfer->offset, size);
+            if (n > 0) {
+                ftp_data_transfer_consume(session, n);
+            }
+
+            if (n < 0) {
+                // check if it failed due to anything but blocking.
+                if (errno != EWOULDBLOCK && errno != EAGAIN) {
+                    ftp_client_msg(session, "426 bad Connection closed; transfer aborted, %s.", strerror(errno));
+                    ftp_data_transfer_end(session);
+                }
+                break;
+            } else if (n != transfer->size) {
+                // partial transfer.
+                transfer->offset += n;
+                transfer->size -= n;
+                break;
+            } else {
+                transfer->list_buf[0] = '\0';
+                transfer->offset = 0;
+                transfer->size = 0;
+
+                // check if we are finished with this transfer.
+                if (!ftp_vfs_isdir_open(&transfer->dir_vfs)) {
+                    if (!device_list || transfer->index == g_ftp.cfg.devices_count) {
+                        ftp_data_transfer_complete(session);
+                        break;
                     }
                 }
             }
-        } else {
-            // parse the next file.
-            if (device_list) {
-                struct stat st = {0};
-                st.st_nlink = 1;
-                st.st_mode = S_IFDIR | S_IRWXU | S_IRWXG | S_IRWXO;
-                ftp_build_list_entry(session, cur_time, NULL, g_ftp.cfg.devices[transfer->index++].mount, &st, nlist);
+        } else {
+            // parse the next file.
+            entries++;
+            if (device_list) {
+                struct stat st = {0};
+                st.st_nlink = 1;
+                st.st_mode = S_IFDIR | S_IRWXU | S_IRWXG | S_IRWXO;
+                ftp_build_list_entry(session, cur_time, NULL, g_ftp.cfg.devices[transfer->index++].mount, &st, nlist);
+            } else {
+                struct FtpVfsDirEntry entry;
+                const char* name = ftp_vfs_readdir(&transfer->dir_vfs, &entry);
+                if (!name) {
+                    ftp_data_transfer_complete(session);
+                    break;
+                }
+
+                if (!strcmp(".", name) || !strcmp("..", name)) {
+                    continue;
+                }
+
+                int rc;
+                struct Pathname filepath;
+                if (is_root) {
+                    rc = snprintf(filepath.s, sizeof(filepath), "%s%s", transfer->temp_path.s, name);
+                } else {
+                    rc = snprintf(filepath.s, sizeof(filepath), "%s/%s", transfer->temp_path.s, name);
+                }
+
+                if (rc <= 0 || rc > sizeof(filepath)) {
+                    continue;
+                }
+
+                struct stat st = {0};
+                rc = ftp_vfs_dirlstat(&transfer->dir_vfs, &entry, filepath.s, &st);
+                if (rc < 0) {
+                    continue;
+                }
+
+                ftp_build_list_entry(session, cur_time, &filepath, name, &st, nlist);
+            }
+        }
+    }
+}
+
+#if FTP_IO_THREADS
+// double buffered transfer, the socket side works on bufs[cur] whilst a
+// worker reads / writes the other buffer.
+static void ftp_file_data_transfer_progress_async(struct FtpSession* session) {
+    struct FtpTransfer* transfer = session->transfer;
+    struct FtpIoSlot* io = transfer->io;
+    struct FtpIoBuffer* buf = &io->bufs[io->cur];
+    int n;
+    errno = 0;
+
+    ftp_io_reap(io);
+
+    if (transfer->mode == FTP_TRANSFER_MODE_RETR) {
+        if (buf->state == FTP_IO_STATE_READY) {
+            if (buf->result < 0) {
+                errno = buf->error;
+                ftp_client_msg(session, "426 bad Connection closed; transfer aborted. vfs read failed %s", strerror(errno));
+                ftp_data_transfer_end(session);
+                return;
+            } else if (!buf->size) {
+                ftp_data_transfer_complete(session);
+                return;
+            }
+
+            const size_t size = ftp_data_transfer_budget(session, buf->size - buf->offset);
+            n = size ? ftp_data_sock_send(session, buf->data + buf->offset, size) : 0;
+            if (n < 0) {
+                if (errno != EWOULDBLOCK && errno != EAGAIN) {
+                    ftp_client_msg(session, "426 bad Connection closed; transfer aborted. %d %s", n, strerror(errno));
+                    ftp_data_transfer_end(session);
+                    return;
+                }
+            } else {
+                ftp_data_transfer_consume(session, n);
+                buf->offset += n;
+                transfer->offset += n;
+                ftp_file_drop_behind(transfer, transfer->offset, 0);
+                if (buf->offset == buf->size) {
+                    buf->state = FTP_IO_STATE_EMPTY;
+                    io->cur ^= 1;
+                }
+
+                if (transfer->offset >= transfer->size) {
+                    ftp_data_transfer_complete(session);
+                    return;
+                }
+            }
+        }
+
+        // read ahead into the free buffer.
+        if (!io->eof && !ftp_io_is_pending(io) && io->read_offset < transfer->size && io->bufs[io->head].state == FTP_IO_STATE_EMPTY) {
+            ftp_io_submit(io);
+        }
+    } else {
+        const size_t size = ftp_data_transfer_budget(session, sizeof(buf->data) - buf->size);
+        if (!io->eof && buf->state == FTP_IO_STATE_EMPTY && size) {
+            n = ftp_data_sock_recv(session, buf->data + buf->size, size);
+            if (n < 0) {
+                if (errno != EWOULDBLOCK && errno != EAGAIN) {
+                    ftp_client_msg(session, "426 bad Connection closed; transfer aborted. %d %s", n, strerror(errno));
+                    ftp_data_transfer_end(session);
+                    return;
+                }
+            } else if (n == 0) {
+                io->eof = 1;
+                if (buf->size) {
+                    buf->state = FTP_IO_STATE_FULL;
+                }
+            } else {
+                ftp_data_transfer_consume(session, n);
+                buf->size += n;
+                transfer->offset += n;
+                if (buf->size == sizeof(buf->data)) {
+                    buf->state = FTP_IO_STATE_FULL;
+                    io->cur ^= 1;
+                }
+            }
+        }
+
+        if (io->error) {
+            errno = io->error;
+            ftp_client_msg(session, "451 Requested action aborted: local error in processing, %s.", strerror(errno));
+            ftp_data_transfer_end(session);
+            return;
+        }
+
+        if (!ftp_io_is_pending(io)) {
+            if (io->bufs[io->head].state == FTP_IO_STATE_FULL) {
+                ftp_io_submit(io);
+            } else if (io->eof) {
+                if (ftp_file_flush(transfer) < 0) {
+                    ftp_client_msg(session, "451 Requested action aborted: local error in processing, %s.", strerror(errno));
+                    ftp_data_transfer_end(session);
+                } else {
+                    ftp_data_transfer_complete(session);
+                }
+            }
+        }
+    }
+}
+#endif // FTP_IO_THREADS
+
+// adds the block to the rsync style rolling checksum, a is the sum of the
+// bytes and b the sum of a, both taken mod 2^16 when the record is made.
+static void ftp_blocksums_update(struct FtpDelta* d, const unsigned char* p, size_t size) {
+    uint32_t a = d->a, b = d->b;
+    for (size_t i = 0; i < size; i++) {
+        a += p[i];
+        b += a;
+    }
+    d->a = a;
+    d->b = b;
+}
+
+// sends the records waiting in list_buf, returns false if the transfer has to wait or has ended.
+static bool ftp_blocksums_send(struct FtpSession* session) {
+    struct FtpTransfer* transfer = session->transfer;
+    struct FtpDelta* d = &transfer->delta;
+
+    while (d->out_offset < d->out_size) {
+        const size_t size = ftp_data_transfer_budget(session, d->out_size - d->out_offset);
+        if (!size) {
+            return false;
+        }
+
+        const int n = ftp_data_send(session, transfer->list_buf + d->out_offset, size);
+        if (n < 0) {
+            if (errno != EWOULDBLOCK && errno != EAGAIN) {
+                ftp_client_msg(session, "426 bad Connection closed; transfer aborted, %s.", strerror(errno));
+                ftp_data_transfer_end(session);
+            }
+            return false;
+        }
+
+        ftp_data_transfer_consume(session, n);
+        d->out_offset += n;
+    }
+
+    d->out_offset = d->out_size = 0;
+    return true;
+}
+
+// sums the next part of the file, reading at most a quantum per call, and sends
+// a record for each block that's done. the last block may be short.
+static void ftp_blocksums_progress(struct FtpSession* session) {
+    struct FtpTransfer* transfer = session->transfer;
+    struct FtpDelta* d = &transfer->delta;
+
+    if (!ftp_blocksums_send(session)) {
+        return;
+    } else if (transfer->offset == transfer->size) {
+        ftp_data_transfer_complete(session);
+        return;
+    }
+
+    size_t budget = FTP_SCHED_QUANTUM;
+    while (budget && transfer->offset < transfer->size && d->out_size + FTP_BLOCKSUMS_RECORD_SIZE <= sizeof(transfer->list_buf)) {
+        size_t size = d->block_size - d->block_offset;
+        size = transfer->size - transfer->offset < size ? transfer->size - transfer->offset : size;
+        size = budget < size ? budget : size;
+        size = g_ftp.cfg.file_buffer_size < size ? g_ftp.cfg.file_buffer_size : size;
+
+        const int n = ftp_vfs_read(&transfer->file_vfs, g_ftp.data_buf, size);
+        if (n <= 0) {
+            // the file was truncated whilst being read.
+            if (n == 0) {
+                errno = EIO;
+            }
+            ftp_client_msg(session, "451 Requested action aborted: local error in processing, %s.", strerror(errno));
+            ftp_data_transfer_end(session);
+            return;
+        }
+
+        ftp_blocksums_update(d, (const unsigned char*)g_ftp.data_buf, n);
+        ftp_hash_update(&transfer->hash, g_ftp.data_buf, n);
+        transfer->offset += n;
+        d->block_offset += n;
+        budget -= n;
+
+        if (d->block_offset == d->block_size || transfer->offset == transfer->size) {
+            unsigned char* p = (unsigned char*)transfer->list_buf + d->out_size;
+            const uint32_t weak = (d->a & 0xFFFF) | (d->b << 16);
+            p[0] = weak >> 24;
+            p[1] = weak >> 16;
+            p[2] = weak >> 8;
+            p[3] = weak;
+            ftp_hash_final(&transfer->hash, p + 4);
+            ftp_hash_init(&transfer->hash, FtpHashType_MD5);
+            d->out_size += FTP_BLOCKSUMS_RECORD_SIZE;
+            d->block_offset = 0;
+            d->a = d->b = 0;
+        }
+    }
+
+    ftp_blocksums_send(session);
+}
+
+// returns true if a delta upload is copying from the old file, which doesn't need the socket.
+static bool ftp_delta_is_copying(const struct FtpTransfer* transfer) {
+    const struct FtpDelta* d = &transfer->delta;
+    return d->active && d->header_size == FTP_DELTA_HEADER_SIZE && d->op == FTP_DELTA_OP_COPY && d->count;
+}
+
+// swaps the old file for the new one once the END record is received.
+static void ftp_delta_finish(struct FtpSession* session) {
+    struct FtpTransfer* transfer = session->transfer;
+    struct FtpDelta* d = &transfer->delta;
+    struct Pathname path = transfer->temp_path;
+    path.s[strlen(path.s) - strlen(FTP_DELTA_SUFFIX)] = '\0';
+
+    if (d->count != d->size) {
+        errno = EBADMSG;
+    } else if (ftp_file_flush(transfer) >= 0) {
+        if (transfer->alloc_size) {
+            ftp_vfs_truncate(&transfer->file_vfs, transfer->write_offset);
+            transfer->alloc_size = 0;
+        }
+        ftp_vfs_close(&transfer->file_vfs);
+        ftp_vfs_close(&d->basis);
+
+        if (!ftp_vfs_rename(transfer->temp_path.s, path.s)) {
+            d->done = 1;
+            ftp_hash_cache_remove(path.s);
+            ftp_data_transfer_complete(session);
+            return;
+        }
+    }
+
+    ftp_client_msg(session, "451 Requested action aborted: local error in processing, %s.", strerror(errno));
+    ftp_data_transfer_end(session);
+}
+
+// receives the next part of a delta upload, literal data is written as it arrives and
+// copies are done a buffer at a time so that a large copy doesn't hold up the other sessions.
+static void ftp_delta_progress(struct FtpSession* session) {
+    struct FtpTransfer* transfer = session->transfer;
+    struct FtpDelta* d = &transfer->delta;
+    int n;
+
+    if (ftp_delta_is_copying(transfer)) {
+        const size_t size = d->count < g_ftp.cfg.file_buffer_size ? d->count : g_ftp.cfg.file_buffer_size;
+        n = ftp_vfs_seek(&d->basis, d->offset);
+        if (n >= 0) {
+            n = ftp_vfs_read(&d->basis, g_ftp.data_buf, size);
+            // the record points past the end of the old file.
+            if (n == 0) {
+                errno = EBADMSG;
+                n = -1;
+            }
+        }
+        if (n > 0) {
+            n = ftp_file_write(transfer, g_ftp.data_buf, n);
+        }
+        if (n < 0) {
+            ftp_client_msg(session, "451 Requested action aborted: local error in processing, %s.", strerror(errno));
+            ftp_data_transfer_end(session);
+            return;
+        }
+
+        d->offset += n;
+        d->count -= n;
+        d->size += n;
+    } else if (d->header_size < FTP_DELTA_HEADER_SIZE) {
+        n = ftp_data_sock_recv(session, d->header + d->header_size, FTP_DELTA_HEADER_SIZE - d->header_size);
+        if (n <= 0) {
+            goto recv_error;
+        }
+
+        d->header_size += n;
+        if (d->header_size < FTP_DELTA_HEADER_SIZE) {
+            return;
+        }
+
+        d->op = d->header[0];
+        d->count = ftp_block_get64(d->header + 1);
+        d->offset = ftp_block_get64(d->header + 9);
+        if (d->op == FTP_DELTA_OP_END) {
+            ftp_delta_finish(session);
+            return;
+        } else if (d->op != FTP_DELTA_OP_LITERAL && d->op != FTP_DELTA_OP_COPY) {
+            errno = EBADMSG;
+            ftp_client_msg(session, "451 Requested action aborted: local error in processing, %s.", strerror(errno));
+            ftp_data_transfer_end(session);
+            return;
+        }
+    } else if (d->count) {
+        // only take the literal data, the next record header is read on its own.
+        size_t size = ftp_data_transfer_budget(session, g_ftp.cfg.file_buffer_size);
+        size = d->count < size ? d->count : size;
+        if (!size) {
+            return;
+        }
+
+        n = ftp_data_sock_recv(session, g_ftp.data_buf, size);
+        if (n <= 0) {
+            goto recv_error;
+        }
+
+        ftp_data_transfer_consume(session, n);
+        if (ftp_file_write(transfer, g_ftp.data_buf, n) < 0) {
+            ftp_client_msg(session, "451 Requested action aborted: local error in processing, %s.", strerror(errno));
+            ftp_data_transfer_end(session);
+            return;
+        }
+
+        d->count -= n;
+        d->size += n;
+    }
+
+    if (!d->count) {
+        d->header_size = 0;
+    }
+    return;
+
+recv_error:
+    if (n < 0 && (errno == EWOULDBLOCK || errno == EAGAIN)) {
+        return;
+    }
+    // the connection closed before the END record.
+    if (n == 0) {
+        errno = ECONNRESET;
+    }
+    ftp_client_msg(session, "426 bad Connection closed; transfer aborted, %s.", strerror(errno));
+    ftp_data_transfer_end(session);
+}
+
+// copies the next part of the file for SITE CPTO, within the fs if it can be done
+// there, otherwise it's read and written a quantum at a time like HASH.
+static void ftp_copy_progress(struct FtpSession* session) {
+    struct FtpTransfer* transfer = session->transfer;
+    size_t size = transfer->deficit;
+    int n = -1;
+
+    if (transfer->copy_fast) {
+        n = ftp_vfs_copy(&transfer->copy_vfs, &transfer->file_vfs, size);
+        if (n < 0 && errno == ENOSYS) {
+            transfer->copy_fast = 0;
+        }
+    }
+
+    if (!transfer->copy_fast) {
+        size = g_ftp.cfg.file_buffer_size < size ? g_ftp.cfg.file_buffer_size : size;
+        const int read = n = ftp_vfs_read(&transfer->file_vfs, g_ftp.data_buf, size);
+        if (n > 0) {
+            n = ftp_vfs_write(&transfer->copy_vfs, g_ftp.data_buf, n);
+            if (n >= 0 && n != read) {
+                ftp_vfs_seek(&transfer->file_vfs, transfer->offset + (size_t)n);
+            }
+        }
+    }
+
+    if (n < 0) {
+        ftp_client_msg(session, "451 Requested action aborted: local error in processing, %s.", strerror(errno));
+        ftp_local_transfer_end(session);
+    } else if (n == 0) {
+        if (transfer->alloc_size) {
+            ftp_vfs_truncate(&transfer->copy_vfs, transfer->offset);
+        }
+        ftp_vfs_close(&transfer->copy_vfs);
+        ftp_client_msg(session, "250 Requested file action okay, completed.");
+        ftp_local_transfer_end(session);
+    } else {
+        transfer->offset += n;
+        transfer->deficit -= (size_t)n < transfer->deficit ? (size_t)n : transfer->deficit;
+    }
+}
+
+// removes the next few entries of the tree for SITE RMTREE, depth first. only the directory
+// being emptied is open and the path doubles as the stack, so going back up is a matter of
+// cutting off the last name. offset counts the entries removed, size is the length of the
+// path of the top directory and index the entries removed since the directory was opened.
+static void ftp_rmtree_progress(struct FtpSession* session) {
+    struct FtpTransfer* transfer = session->transfer;
+    struct Pathname* path = &transfer->temp_path;
+    struct Pathname child;
+    const char* failed = path->s;
+    struct stat st;
+    int rc = 0;
+
+    for (size_t entries = 0; entries < FTP_SCHED_LIST_ENTRIES; entries++) {
+        if (!ftp_vfs_isdir_open(&transfer->dir_vfs)) {
+            rc = ftp_vfs_opendir(&transfer->dir_vfs, path->s);
+            if (rc < 0) {
+                break;
+            }
+            transfer->index = 0;
+        }
+
+        struct FtpVfsDirEntry entry;
+        const char* name = ftp_vfs_readdir(&transfer->dir_vfs, &entry);
+        if (!name) {
+            ftp_vfs_closedir(&transfer->dir_vfs);
+            rc = ftp_vfs_rmdir(path->s);
+            if (rc < 0) {
+                // the fs may not return every entry if they're removed whilst reading, so read it again.
+                if ((errno == ENOTEMPTY || errno == EEXIST) && transfer->index) {
+                    rc = 0;
+                    continue;
+                }
+                break;
+            }
+        } else if (!strcmp(".", name) || !strcmp("..", name)) {
+            continue;
+        } else {
+            if (path->s[strlen(path->s) - 1] == '/') {
+                rc = snprintf(child.s, sizeof(child), "%s%s", path->s, name);
+            } else {
+                rc = snprintf(child.s, sizeof(child), "%s/%s", path->s, name);
+            }
+            if (rc <= 0 || rc >= (int)sizeof(child)) {
+                errno = ENAMETOOLONG;
+                rc = -1;
+                break;
+            }
+
+            failed = child.s;
+            rc = ftp_vfs_dirlstat(&transfer->dir_vfs, &entry, child.s, &st);
+            if (rc < 0) {
+                break;
+            } else if (S_ISDIR(st.st_mode)) {
+                // empty it first, the parent is read again from the start once it's removed.
+                ftp_vfs_closedir(&transfer->dir_vfs);
+                *path = child;
+                failed = path->s;
+                continue;
+            }
+
+            rc = ftp_vfs_unlink(child.s);
+            if (rc < 0) {
+                break;
+            }
+            ftp_hash_cache_remove(child.s);
+            failed = path->s;
+            transfer->index++;
+        }
+
+        transfer->offset++;
+        if (FTP_RMTREE_PROGRESS && !(transfer->offset % FTP_RMTREE_PROGRESS)) {
+            ftp_client_msg(session, "150 %zu entries removed.", transfer->offset);
+        }
+
+        if (!name) {
+            if (strlen(path->s) <= transfer->size) {
+                ftp_client_msg(session, "250 Requested file action okay, completed.");
+                ftp_local_transfer_end(session);
+                return;
+            }
+            *strrchr(path->s, '/') = '\0';
+        }
+    }
+
+    if (rc < 0) {
+        ftp_client_msg(session, "550 Requested action not taken, %s. Failed to remove: %s.", strerror(errno), failed);
+        ftp_local_transfer_end(session);
+    }
+}
+
+#if FTP_TAR_DEPTH
+// writes v as an octal number of size - 1 digits, numbers that don't fit are
+// written in base-256 with the top bit of the first byte set, as GNU tar does.
+static void ftp_tar_number(char* p, size_t size, unsigned long long v) {
+    if (v >> (3 * (size - 1))) {
+        p[0] = (char)0x80;
+        for (size_t i = size - 1; i > 0; i--, v >>= 8) {
+            p[i] = (char)(v & 0xFF);
+        }
+    } else {
+        for (size_t i = size - 1; i-- > 0; v >>= 3) {
+            p[i] = '0' + (v & 7);
+        }
+        p[size - 1] = '\0';
+    }
+}
+
+// writes the header record of an entry (GNU format), st is NULL for the long name header.
+static void ftp_tar_header(char* buf, const char* name, char type, size_t size, const struct stat* st, const char* link) {
+    const size_t name_len = strlen(name);
+    memset(buf, 0, FTP_TAR_RECORD_SIZE);
+    memcpy(buf, name, name_len < FTP_TAR_NAME_SIZE ? name_len : FTP_TAR_NAME_SIZE);
+    ftp_tar_number(buf + 100, 8, st ? st->st_mode & 07777 : 0);
+    ftp_tar_number(buf + 108, 8, st ? st->st_uid : 0);
+    ftp_tar_number(buf + 116, 8, st ? st->st_gid : 0);
+    ftp_tar_number(buf + 124, 12, size);
+    ftp_tar_number(buf + 136, 12, st && st->st_mtime > 0 ? st->st_mtime : 0);
+    memset(buf + 148, ' ', 8);
+    buf[156] = type;
+    if (link) {
+        memcpy(buf + 157, link, strlen(link));
+    }
+    memcpy(buf + 257, "ustar  ", 8);
+    if (st) {
+        // left empty if there's no name so that the ids are used when extracting.
+        const char* uname = ftp_vfs_getpwuid(st);
+        const char* gname = ftp_vfs_getgrgid(st);
+        if (strcmp(uname, "unknown") && strlen(uname) < 32) {
+            strcpy(buf + 265, uname);
+        }
+        if (strcmp(gname, "unknown") && strlen(gname) < 32) {
+            strcpy(buf + 297, gname);
+        }
+    }
+
+    unsigned sum = 0;
+    for (size_t i = 0; i < FTP_TAR_RECORD_SIZE; i++) {
+        sum += (unsigned char)buf[i];
+    }
+    snprintf(buf + 148, 8, "%06o", sum);
+    buf[155] = ' ';
+}
+
+static void ftp_tar_set_part(struct FtpTar* tar, enum FTP_TAR_PART part, size_t size) {
+    tar->part = part;
+    tar->offset = 0;
+    tar->size = size;
+}
+
+// cuts the last name off the path, this works for both files and directories
+// as the trailing '/' of a directory goes along with the last character.
+static void ftp_tar_cut(struct Pathname* path) {
+    path->s[strlen(path->s) - 1] = '\0';
+    strrchr(path->s, '/')[1] = '\0';
+}
+
+// queues the headers for the entry at temp_path, the header record is built in
+// the second half of list_buf so the first half is free for the long name header.
+static void ftp_tar_queue(struct FtpSession* session, const struct stat* st, const char* link) {
+    struct FtpTransfer* transfer = session->transfer;
+    struct FtpTar* tar = &transfer->tar;
+    const char* name = transfer->temp_path.s + tar->base;
+    const char type = S_ISDIR(st->st_mode) ? '5' : link ? '2' : '0';
+
+    tar->body = type == '0' ? st->st_size : 0;
+    ftp_tar_header(transfer->list_buf + FTP_TAR_RECORD_SIZE, name, type, tar->body, st, link);
+
+    if (strlen(name) > FTP_TAR_NAME_SIZE) {
+        ftp_tar_header(transfer->list_buf, "././@LongLink", 'L', strlen(name) + 1, NULL, NULL);
+        ftp_tar_set_part(tar, FTP_TAR_PART_LONG_HEADER, FTP_TAR_RECORD_SIZE);
+    } else {
+        ftp_tar_set_part(tar, FTP_TAR_PART_HEADER, FTP_TAR_RECORD_SIZE);
+    }
+}
+
+// reads the next entry of the deepest directory and queues it, or goes back up once it's
+// all been read. entries that can't be read are left out. returns -1 if the archive can't go on.
+static int ftp_tar_next(struct FtpSession* session) {
+    struct FtpTransfer* transfer = session->transfer;
+    struct FtpTar* tar = &transfer->tar;
+    struct Pathname* path = &transfer->temp_path;
+    struct FtpVfsDir* dir = &tar->dirs[tar->depth - 1];
+    struct FtpVfsDirEntry entry;
+    struct stat st;
+
+    const char* name = ftp_vfs_readdir(dir, &entry);
+    if (!name) {
+        ftp_vfs_closedir(dir);
+        if (!--tar->depth) {
+            memset(transfer->list_buf, 0, FTP_TAR_RECORD_SIZE * 2);
+            ftp_tar_set_part(tar, FTP_TAR_PART_END, FTP_TAR_RECORD_SIZE * 2);
+        } else {
+            ftp_tar_cut(path);
+        }
+        return 0;
+    } else if (!strcmp(".", name) || !strcmp("..", name)) {
+        return 0;
+    }
+
+    // room is kept for the '/' added to directories.
+    const size_t len = strlen(path->s);
+    const int rc = snprintf(path->s + len, sizeof(*path) - len, "%s", name);
+    if (rc <= 0 || (size_t)rc + 1 >= sizeof(*path) - len) {
+        path->s[len] = '\0';
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    if (ftp_vfs_dirlstat(dir, &entry, path->s, &st) < 0) {
+        ftp_log_callback(FTP_API_LOG_TYPE_ERROR, "tar: failed to stat entry");
+    } else if (S_ISDIR(st.st_mode)) {
+        if (tar->depth == FTP_TAR_DEPTH) {
+            errno = ELOOP;
+            return -1;
+        }
+        strcat(path->s, "/");
+        if (ftp_vfs_opendir(&tar->dirs[tar->depth], path->s) < 0) {
+            ftp_log_callback(FTP_API_LOG_TYPE_ERROR, "tar: failed to open directory");
+        } else {
+            tar->depth++;
+            ftp_tar_queue(session, &st, NULL);
+            return 0;
+        }
+    } else if (S_ISREG(st.st_mode)) {
+        if (ftp_vfs_open(&transfer->file_vfs, path->s, FtpVfsOpenMode_READ) < 0) {
+            ftp_log_callback(FTP_API_LOG_TYPE_ERROR, "tar: failed to open file");
+        } else {
+            ftp_tar_queue(session, &st, NULL);
+            return 0;
+        }
+    } else if (S_ISLNK(st.st_mode)) {
+        char link[FTP_TAR_NAME_SIZE + 1];
+        const int n = ftp_vfs_readlink(path->s, link, sizeof(link));
+        // targets that don't fit in the header are left out.
+        if (n > 0 && n < (int)sizeof(link)) {
+            link[n] = '\0';
+            ftp_tar_queue(session, &st, link);
+            return 0;
+        }
+    }
+
+    path->s[len] = '\0';
+    return 0;
+}
+
+// sends the rest of the part from buf, returns false if the transfer has to wait or has ended.
+static bool ftp_tar_send(struct FtpSession* session, const char* buf) {
+    struct FtpTransfer* transfer = session->transfer;
+    struct FtpTar* tar = &transfer->tar;
+
+    while (tar->offset < tar->size) {
+        const size_t size = ftp_data_transfer_budget(session, tar->size - tar->offset);
+        if (!size) {
+            return false;
+        }
+
+        const int n = ftp_data_send(session, buf + tar->offset, size);
+        if (n < 0) {
+            if (errno != EWOULDBLOCK && errno != EAGAIN) {
+                ftp_client_msg(session, "426 bad Connection closed; transfer aborted, %s.", strerror(errno));
+                ftp_data_transfer_end(session);
+            }
+            return false;
+        }
+
+        ftp_data_transfer_consume(session, n);
+        tar->offset += n;
+        transfer->offset += n;
+    }
+
+    return true;
+}
+
+// sends the rest of the file, the same way as RETR.
+static bool ftp_tar_send_body(struct FtpSession* session) {
+    struct FtpTransfer* transfer = session->transfer;
+    struct FtpTar* tar = &transfer->tar;
+
+    while (tar->offset < tar->size) {
+        const size_t size = ftp_data_transfer_budget(session, tar->size - tar->offset);
+        if (!size) {
+            return false;
+        }
+
+        int n = 0;
+        bool use_buf = true;
+        #if defined(FTP_VFS_FD) && defined(HAVE_SENDFILE) && HAVE_SENDFILE
+        if (ftp_file_use_sendfile(session)) {
+            n = sendfile(session->data_sock, transfer->file_vfs.fd, NULL, size);
+            use_buf = n < 0 && (errno == EINVAL || errno == ENOSYS);
+            if (n > 0) {
+                ftp_rate_limit_take(session, n);
+            }
+        }
+        #endif
+        if (use_buf) {
+            const int read = n = ftp_vfs_read(&transfer->file_vfs, g_ftp.data_buf, size < g_ftp.cfg.file_buffer_size ? size : g_ftp.cfg.file_buffer_size);
+            if (n > 0) {
+                n = ftp_data_send(session, g_ftp.data_buf, n);
+                if (n >= 0 && n != read) {
+                    ftp_vfs_seek(&transfer->file_vfs, tar->offset + (size_t)n);
+                }
+            } else if (n < 0) {
+                ftp_client_msg(session, "451 Requested action aborted: local error in processing, %s.", strerror(errno));
+                ftp_data_transfer_end(session);
+                return false;
+            }
+        }
+
+        if (n == 0) {
+            // the header has already gone out with the old size.
+            ftp_client_msg(session, "451 Requested action aborted: local error in processing, file changed whilst being sent.");
+            ftp_data_transfer_end(session);
+            return false;
+        } else if (n < 0) {
+            if (errno == EWOULDBLOCK || errno == EAGAIN) {
+                ftp_vfs_seek(&transfer->file_vfs, tar->offset);
             } else {
-                struct FtpVfsDirEntry entry;
-                const char* name = ftp_vfs_readdir(&transfer->dir_vfs, &entry);
-                if (!name) {
-                    ftp_client_msg(session, "226 Closing data connection.");
+                ftp_client_msg(session, "426 bad Connection closed; transfer aborted, %s.", strerror(errno));
+                ftp_data_transfer_end(session);
+            }
+            return false;
+        }
+
+        ftp_data_transfer_consume(session, n);
+        tar->offset += n;
+        transfer->offset += n;
+    }
+
+    return true;
+}
+
+// sends the next part of the archive, reading at most FTP_SCHED_LIST_ENTRIES entries per call.
+static void ftp_tar_progress(struct FtpSession* session) {
+    struct FtpTransfer* transfer = session->transfer;
+    struct FtpTar* tar = &transfer->tar;
+
+    for (size_t entries = 0; entries < FTP_SCHED_LIST_ENTRIES;) {
+        switch (tar->part) {
+            case FTP_TAR_PART_LONG_HEADER:
+                if (!ftp_tar_send(session, transfer->list_buf)) {
+                    return;
+                }
+                // the name is sent along with its terminator.
+                ftp_tar_set_part(tar, FTP_TAR_PART_LONG_NAME, strlen(transfer->temp_path.s + tar->base) + 1);
+                break;
+            case FTP_TAR_PART_LONG_NAME:
+                if (!ftp_tar_send(session, transfer->temp_path.s + tar->base)) {
+                    return;
+                }
+                memset(transfer->list_buf, 0, FTP_TAR_RECORD_SIZE);
+                ftp_tar_set_part(tar, FTP_TAR_PART_LONG_PAD, ftp_tar_pad(tar->size));
+                break;
+            case FTP_TAR_PART_LONG_PAD:
+                if (!ftp_tar_send(session, transfer->list_buf)) {
+                    return;
+                }
+                ftp_tar_set_part(tar, FTP_TAR_PART_HEADER, FTP_TAR_RECORD_SIZE);
+                break;
+            case FTP_TAR_PART_HEADER:
+                if (!ftp_tar_send(session, transfer->list_buf + FTP_TAR_RECORD_SIZE)) {
+                    return;
+                }
+                ftp_tar_set_part(tar, FTP_TAR_PART_BODY, tar->body);
+                break;
+            case FTP_TAR_PART_BODY:
+                if (!ftp_tar_send_body(session)) {
+                    return;
+                }
+                ftp_vfs_close(&transfer->file_vfs);
+                memset(transfer->list_buf, 0, FTP_TAR_RECORD_SIZE);
+                ftp_tar_set_part(tar, FTP_TAR_PART_PAD, ftp_tar_pad(tar->size));
+                break;
+            case FTP_TAR_PART_PAD:
+                if (!ftp_tar_send(session, transfer->list_buf)) {
+                    return;
+                }
+                // directories stay on the path until they've been read.
+                if (transfer->temp_path.s[strlen(transfer->temp_path.s) - 1] != '/') {
+                    ftp_tar_cut(&transfer->temp_path);
+                }
+                ftp_tar_set_part(tar, FTP_TAR_PART_NEXT, 0);
+                break;
+            case FTP_TAR_PART_NEXT:
+                if (ftp_tar_next(session) < 0) {
+                    ftp_client_msg(session, "451 Requested action aborted: local error in processing, %s.", strerror(errno));
                     ftp_data_transfer_end(session);
-                    break;
+                    return;
                 }
-
-                if (!strcmp(".", name) || !strcmp("..", name)) {
-                    continue;
+                entries++;
+                break;
+            case FTP_TAR_PART_END:
+                if (ftp_tar_send(session, transfer->list_buf)) {
+                    ftp_data_transfer_complete(session);
                 }
+                return;
+        }
+    }
+}
+#endif
 
-                int rc;
-                struct Pathname filepath;
-                if (is_root) {
-                    rc = snprintf(filepath.s, sizeof(filepath), "%s%s", session->temp_path.s, name);
-                } else {
-                    rc = snprintf(filepath.s, sizeof(filepath), "%s/%s", session->temp_path.s, name);
-                }
+// RETR <dir>.tar sends the directory as a tar archive made whilst it's sent, if there's no
+// such file. returns false if the path isn't one, otherwise the reply has been sent.
+static bool ftp_tar_begin(struct FtpSession* session, const struct Pathname* fullpath) {
+#if FTP_TAR_DEPTH
+    struct FtpTransfer* transfer = session->transfer;
+    struct FtpTar* tar = &transfer->tar;
+    struct Pathname path = fix_path_for_device(fullpath);
+    const int err = errno;
+    size_t len = strlen(path.s);
+    struct stat st;
+
+    if (err != ENOENT || len <= 4 || strcmp(path.s + len - 4, ".tar")) {
+        return false;
+    }
 
-                if (rc <= 0 || rc > sizeof(filepath)) {
-                    continue;
-                }
+    path.s[len -= 4] = '\0';
+    if (path.s[len - 1] == '/' || path.s[len - 1] == ':' || ftp_vfs_stat(path.s, &st) < 0 || !S_ISDIR(st.st_mode)) {
+        errno = err;
+        return false;
+    }
 
-                struct stat st = {0};
-                rc = ftp_vfs_dirlstat(&transfer->dir_vfs, &entry, filepath.s, &st);
-                if (rc < 0) {
-                    continue;
-                }
+    if (session->server_marker || session->range_end) {
+        ftp_client_msg(session, "504 Command not implemented for that parameter.");
+        session->server_marker = 0;
+        session->range_end = 0;
+        return true;
+    } else if (len + 1 >= sizeof(path)) {
+        ftp_client_msg(session, "553 Requested action not taken, %s.", strerror(ENAMETOOLONG));
+        return true;
+    }
 
-                ftp_build_list_entry(session, cur_time, &filepath, name, &st, nlist);
-            }
-        }
+    strcat(path.s, "/");
+    if (ftp_vfs_opendir(&tar->dirs[0], path.s) < 0) {
+        ftp_client_msg(session, "550 Requested action not taken, %s.", strerror(errno));
+        return true;
     }
+
+    tar->depth = 1;
+    transfer->offset = 0;
+    if (ftp_data_open(session) < 0) {
+        ftp_client_msg(session, "425 Can't open data connection, %s.", strerror(errno));
+        ftp_vfs_closedir(&tar->dirs[0]);
+        memset(tar, 0, sizeof(*tar));
+        return true;
+    }
+
+    // names in the archive start with the name of the directory.
+    transfer->temp_path = path;
+    path.s[len] = '\0';
+    tar->base = strrchr(path.s, '/') ? strrchr(path.s, '/') + 1 - path.s : 0;
+    transfer->mode = FTP_TRANSFER_MODE_TAR;
+    transfer->cache = FtpVfsCache_DEFAULT;
+    ftp_tar_queue(session, &st, NULL);
+    return true;
+#else
+    return false;
+#endif
 }
 
 static void ftp_file_data_transfer_progress(struct FtpSession* session) {
     int n = 0;
     errno = 0;
-    struct FtpTransfer* transfer = &session->transfer;
+    struct FtpTransfer* transfer = session->transfer;
+
+#if FTP_IO_THREADS
+    if (transfer->io) {
+        ftp_file_data_transfer_progress_async(session);
+        return;
+    }
+#endif
+#if FTP_STRIPE_COUNT
+    if (transfer->stripes) {
+        ftp_stripe_progress(session);
+        return;
+    }
+#endif
+    if (transfer->delta.active) {
+        ftp_delta_progress(session);
+        return;
+    }
+
+    // only move as much as the rate limit allows.
+    const size_t size = ftp_data_transfer_budget(session, g_ftp.cfg.file_buffer_size);
+    if (!size) {
+        return;
+    }
 
     if (transfer->mode == FTP_TRANSFER_MODE_RETR) {
+        bool use_buf = true;
         #if defined(FTP_VFS_FD) && defined(HAVE_SENDFILE) && HAVE_SENDFILE
-        n = sendfile(session->data_sock, transfer->file_vfs.fd, NULL, transfer->size - transfer->offset);
-        if (n < 0 && (errno == EINVAL || errno == ENOSYS))
+        if (ftp_file_use_sendfile(session)) {
+            const size_t count = ftp_data_transfer_budget(session, transfer->size - transfer->offset);
+            n = sendfile(session->data_sock, transfer->file_vfs.fd, NULL, count);
+            use_buf = n < 0 && (errno == EINVAL || errno == ENOSYS);
+            if (n > 0) {
+                ftp_rate_limit_take(session, n);
+            }
+        }
         #endif
-        {
-            const int read = n = ftp_vfs_read(&transfer->file_vfs, g_ftp.data_buf, sizeof(g_ftp.data_buf));
+        if (use_buf) {
+            // don't read past the end of a RANG range.
+            const size_t left = transfer->size - transfer->offset;
+            size_t count = left < size ? left : size;
+#if FTP_ASCII_BUFFER_SIZE
+            // each LF may be sent as CRLF.
+            if (transfer->ascii && count > FTP_ASCII_BUFFER_SIZE / 2) {
+                count = FTP_ASCII_BUFFER_SIZE / 2;
+            }
+#endif
+            const int read = n = ftp_vfs_read(&transfer->file_vfs, g_ftp.data_buf, count);
             if (n > 0) {
-                n = socket_send(session->data_sock, g_ftp.data_buf, n, 0);
+                n = ftp_file_send(session, g_ftp.data_buf, n);
                 if (n >= 0 && n != read) {
                     ftp_vfs_seek(&transfer->file_vfs, transfer->offset + (size_t)n);
                 }
@@ -592,41 +5008,214 @@ static void ftp_file_data_transfer_progress(struct FtpSession* session) {
                 ftp_log_callback(FTP_API_LOG_TYPE_ERROR, "vfs read failed");
             }
         }
+
+        if (n > 0) {
+            ftp_data_transfer_consume(session, n);
+        }
     } else {
-        n = socket_recv(session->data_sock, g_ftp.data_buf, sizeof(g_ftp.data_buf), 0);
+        n = ftp_data_sock_recv(session, g_ftp.data_buf, size);
         if (n > 0) {
-            n = ftp_vfs_write(&transfer->file_vfs, g_ftp.data_buf, n);
+            ftp_data_transfer_consume(session, n);
+            n = ftp_data_write(session, g_ftp.data_buf, n);
+            if (n < 0) {
+                ftp_client_msg(session, "451 Requested action aborted: local error in processing, %s.", strerror(errno));
+                ftp_data_transfer_end(session);
+                return;
+            } else if (transfer->block.eof) {
+                // in block mode, the end of the file is marked by the EOF block.
+                n = 0;
+            }
+        }
+
+        if (n == 0 && ftp_data_store_flush(session) < 0) {
+            ftp_client_msg(session, "451 Requested action aborted: local error in processing, %s.", strerror(errno));
+            ftp_data_transfer_end(session);
+            return;
         }
     }
 
     if (n < 0) {
         if (errno == EWOULDBLOCK || errno == EAGAIN) {
             ftp_log_callback(FTP_API_LOG_TYPE_ERROR, "blocking transfer!");
-            ftp_vfs_seek(&transfer->file_vfs, transfer->offset);
+            // nothing was received for STOR, and the file position is where the
+            // write buffer last flushed to, which can be behind the offset.
+            if (transfer->mode == FTP_TRANSFER_MODE_RETR) {
+                ftp_vfs_seek(&transfer->file_vfs, transfer->offset);
+            }
         } else {
             ftp_client_msg(session, "426 bad Connection closed; transfer aborted. %d %s", n, strerror(errno));
             ftp_data_transfer_end(session);
         }
     } else {
         transfer->offset += n;
-        if (n == 0) {
-            ftp_client_msg(session, "226 Closing data connection.");
-            ftp_data_transfer_end(session);
-        } else if (transfer->mode == FTP_TRANSFER_MODE_RETR && transfer->offset == transfer->size) {
-            ftp_client_msg(session, "226 Closing data connection.");
+        if (transfer->mode == FTP_TRANSFER_MODE_RETR) {
+            ftp_file_drop_behind(transfer, transfer->offset, 0);
+        }
+        if (n == 0 || (transfer->mode == FTP_TRANSFER_MODE_RETR && transfer->offset == transfer->size)) {
+            ftp_data_transfer_complete(session);
+        }
+    }
+}
+
+// returns the socket to poll for the transfer, -1 if none.
+static int ftp_data_transfer_sock(const struct FtpSession* session) {
+    if (ftp_data_transfer_is_local(session)) {
+        return -1;
+    }
+#if FTP_STRIPE_COUNT
+    // the data connections are polled on their own, this waits for the next one to connect.
+    if (session->transfer->stripes) {
+        return ftp_stripe_wants_accept(session) ? session->pasv_sock : -1;
+    }
+#endif
+    return session->data_sock;
+}
+
+// returns true if the transfer can progress without its socket being ready, which is the case for
+// transfers that don't use the data connection and delta copies, or if a data connection of a striped transfer was ready.
+static bool ftp_data_transfer_is_ready(struct FtpSession* session) {
+    if (ftp_data_transfer_is_local(session) || ftp_delta_is_copying(session->transfer)) {
+        return true;
+    }
+#if FTP_TLS
+    // openssl may have read more of the upload than it has handed over, which the socket won't wake up for.
+    if (session->transfer->mode == FTP_TRANSFER_MODE_STOR && session->data_tls.ready && SSL_has_pending(session->data_tls.ssl) && !ftp_rate_limit_wait(session)) {
+        return true;
+    }
+#endif
+#if FTP_STRIPE_COUNT
+    // the data connections that weren't opened in time are given up on.
+    if (session->transfer->stripes && ftp_stripe_wants_accept(session) && !ftp_stripe_accept_wait(session)) {
+        return true;
+    }
+    return session->transfer->stripe_ready;
+#else
+    return false;
+#endif
+}
+
+// returns true if the data socket should be polled.
+static bool ftp_data_transfer_wants_io(struct FtpSession* session) {
+    // throttled sessions are woken up by the loop timeout instead.
+    if (ftp_rate_limit_wait(session)) {
+        return false;
+    }
+#if FTP_IO_THREADS
+    // whatever is left to finish the transfer is sent from the loop.
+    if (session->transfer->io && !session->transfer->finishing) {
+        return ftp_io_socket_wants_io(session->transfer->io);
+    }
+#endif
+    return true;
+}
+
+// returns true if the data socket is polled for reading, otherwise it's polled for writing.
+static bool ftp_data_transfer_wants_read(const struct FtpSession* session, int sock) {
+#if FTP_TLS
+    if (ftp_data_tls_pending(session)) {
+        return !session->data_tls.want_write;
+    }
+#endif
+    return session->transfer->mode == FTP_TRANSFER_MODE_STOR || sock != session->data_sock;
+}
+
+// shortens the timeout so that the loop wakes up once a throttled transfer can continue,
+// or once the client has run out of time to open the data connections of a striped transfer.
+static int ftp_data_transfer_timeout(int timeout_ms) {
+    for (size_t i = 0; i < g_ftp.cfg.max_sessions; i++) {
+        struct FtpSession* session = &g_ftp.sessions[i];
+        if (session->active && ftp_transfer_mode(session) != FTP_TRANSFER_MODE_NONE && ftp_data_transfer_is_ready(session)) {
+            // hashing, copying and removing trees carry on straight away.
+            return 0;
+        } else if (session->active && ftp_transfer_mode(session) != FTP_TRANSFER_MODE_NONE) {
+            int wait = ftp_rate_limit_wait(session);
+#if FTP_STRIPE_COUNT
+            if (session->transfer->stripes && ftp_stripe_wants_accept(session)) {
+                const int accept_wait = ftp_stripe_accept_wait(session);
+                wait = wait && wait < accept_wait ? wait : accept_wait;
+            }
+#endif
+            if (wait && (timeout_ms < 0 || wait < timeout_ms)) {
+                timeout_ms = wait;
+            }
+        }
+    }
+    return timeout_ms;
+}
+
+// file transfers, tar archives, hashing, copying, removing trees and block sums are bulk, listings are interactive and are serviced first.
+static bool ftp_data_transfer_is_bulk(const struct FtpSession* session) {
+    switch (session->transfer->mode) {
+        case FTP_TRANSFER_MODE_RETR:
+        case FTP_TRANSFER_MODE_STOR:
+        case FTP_TRANSFER_MODE_HASH:
+        case FTP_TRANSFER_MODE_BLOCKSUMS:
+        case FTP_TRANSFER_MODE_COPY:
+        case FTP_TRANSFER_MODE_RMTREE:
+        case FTP_TRANSFER_MODE_TAR:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// carries on with the handshake on the data connection, returns true once data can be moved.
+static bool ftp_data_tls_ready(struct FtpSession* session) {
+#if FTP_TLS
+    if (ftp_data_tls_pending(session)) {
+        const int rc = ftp_tls_handshake(&session->data_tls);
+        if (rc < 0) {
+            ftp_client_msg(session, "425 Can't open data connection, TLS handshake failed.");
             ftp_data_transfer_end(session);
+            return false;
+        } else if (!rc) {
+            return false;
         }
+#if FTP_IO_THREADS
+        // held back by RETR / STOR until the handshake is done.
+        if ((session->transfer->mode == FTP_TRANSFER_MODE_STOR || (session->transfer->mode == FTP_TRANSFER_MODE_RETR && !ftp_file_use_sendfile(session))) && ftp_data_transfer_is_raw(session)) {
+            ftp_io_acquire(session);
+        }
+#endif
     }
+#endif
+    return true;
 }
 
 static void ftp_data_transfer_progress(struct FtpSession* session) {
-    const struct FtpTransfer* transfer = &session->transfer;
+    struct FtpTransfer* transfer = session->transfer;
     if (transfer->mode) {
-        if (transfer->mode == FTP_TRANSFER_MODE_RETR || transfer->mode == FTP_TRANSFER_MODE_STOR) {
+        // the unused deficit is only carried over whilst the transfer is busy,
+        // an idle transfer doesn't get to save up for a burst later on.
+        const size_t deficit = transfer->deficit += FTP_SCHED_QUANTUM;
+
+        if (transfer->mode == FTP_TRANSFER_MODE_HASH) {
+            ftp_hash_data_transfer_progress(session);
+        } else if (transfer->mode == FTP_TRANSFER_MODE_COPY) {
+            ftp_copy_progress(session);
+        } else if (transfer->mode == FTP_TRANSFER_MODE_RMTREE) {
+            ftp_rmtree_progress(session);
+        } else if (!ftp_data_tls_ready(session)) {
+            // waiting for the handshake.
+        } else if (!ftp_data_flush(session)) {
+            // waiting for the socket.
+        } else if (transfer->mode == FTP_TRANSFER_MODE_BLOCKSUMS) {
+            ftp_blocksums_progress(session);
+#if FTP_TAR_DEPTH
+        } else if (transfer->mode == FTP_TRANSFER_MODE_TAR) {
+            ftp_tar_progress(session);
+#endif
+        } else if (ftp_data_transfer_is_bulk(session)) {
             ftp_file_data_transfer_progress(session);
         } else {
             ftp_dir_data_transfer_progress(session);
         }
+
+        if (transfer->deficit == deficit) {
+            transfer->deficit = 0;
+        } else if (transfer->deficit > FTP_SCHED_QUANTUM) {
+            transfer->deficit = FTP_SCHED_QUANTUM;
+        }
     }
 }
 
@@ -755,50 +5344,34 @@ static void ftp_cmd_PORT(struct FtpSession* session, const char* data) {
             session->data_sockaddr.sin_family = PF_INET;
             session->data_sockaddr.sin_port = htons((p[0] << 8) + p[1]);
             session->data_connection = FTP_DATA_CONNECTION_ACTIVE;
+            // the connect is finished by the loop, if it fails it's tried again by the transfer.
+            ftp_data_early_connect(session);
             ftp_client_msg(session, "200 Command okay.");
         }
     }
 }
 
-// PASV <CRLF> | 227, 500, 501, 502, 421, 530
+// PASV <CRLF> | 227, 425, 500, 501, 502, 421, 530
+// the listener comes from the pool and listens on all addresses, the reply
+// gives the address the client connected to for the control connection.
 static void ftp_cmd_PASV(struct FtpSession* session, const char* data) {
     ftp_data_transfer_end(session);
-    int rc = session->pasv_sock = socket_open(PF_INET, SOCK_STREAM, 0);
 
-    if (rc < 0) {
-        ftp_client_msg(session, "501 open failed Syntax error in parameters or arguments.");
+    if (ftp_pasv_acquire(session) < 0) {
+        ftp_client_msg(session, "425 Can't open data connection, %s.", strerror(errno));
     } else {
-        // copy current over ip addr
-        session->pasv_sockaddr = session->control_sockaddr;
-        session->pasv_sockaddr.sin_port = htons(socket_bind_port());
-
-        rc = socket_bind(session->pasv_sock, (struct sockaddr*)&session->pasv_sockaddr, sizeof(session->pasv_sockaddr));
-        if (rc < 0) {
-            ftp_client_msg(session, "501 bind failed Syntax error in parameters or arguments. %d", rc);
-        } else {
-            rc = socket_listen(session->pasv_sock, 1);
-            if (rc < 0) {
-                ftp_client_msg(session, "501 listen failed Syntax error in parameters or arguments, %s.", strerror(errno));
-            } else {
-                socklen_t base_len = sizeof(session->pasv_sockaddr);
-                rc = socket_getsockname(session->pasv_sock, (struct sockaddr*)&session->pasv_sockaddr, &base_len);
-
-                char ip_buf[16] = {0};
-                const char* addr_s = inet_ntoa(session->control_sockaddr.sin_addr);
-                for (int i = 0; addr_s[i]; i++) {
-                    ip_buf[i] = addr_s[i];
-                    if (ip_buf[i] == '.') {
-                        ip_buf[i] = ',';
-                    }
-                }
-
-                const unsigned port = ntohs(session->pasv_sockaddr.sin_port);
-                session->data_connection = FTP_DATA_CONNECTION_PASSIVE;
-                ftp_client_msg(session, "227 Entering Passive Mode (%s,%u,%u)", ip_buf, port >> 8, port & 0xFF);
-                return;
+        char ip_buf[16] = {0};
+        const char* addr_s = inet_ntoa(session->control_sockaddr.sin_addr);
+        for (int i = 0; addr_s[i]; i++) {
+            ip_buf[i] = addr_s[i];
+            if (ip_buf[i] == '.') {
+                ip_buf[i] = ',';
             }
         }
-        ftp_close_socket(&session->pasv_sock);
+
+        const unsigned port = session->pasv_port;
+        session->data_connection = FTP_DATA_CONNECTION_PASSIVE;
+        ftp_client_msg(session, "227 Entering Passive Mode (%s,%u,%u)", ip_buf, port >> 8, port & 0xFF);
     }
 }
 
@@ -842,11 +5415,24 @@ static void ftp_cmd_MODE(struct FtpSession* session, const char* data) {
 
     if (rc <= 0) {
         ftp_client_msg(session, "501 Syntax error in parameters or arguments.");
-    } else if (code == 'S') {
-        session->mode = FTP_MODE_STREAM;
-        ftp_client_msg(session, "200 Command okay.");
-    } else {
+    } else if (code != 'S' && code != 'B' && (code != 'Z' || !FTP_ZLIB_STREAMS) && (code != 'E' || !FTP_STRIPE_COUNT)) {
         ftp_client_msg(session, "504 Command not implemented for that parameter.");
+    } else {
+        // the data connection kept open by block mode can't be used by the other modes.
+        if (session->mode == FTP_MODE_BLOCK && code != 'B' && session->data_sock > 0) {
+            ftp_data_transfer_end(session);
+        }
+
+        if (code == 'B') {
+            session->mode = FTP_MODE_BLOCK;
+        } else if (code == 'Z') {
+            session->mode = FTP_MODE_DEFLATE;
+        } else if (code == 'E') {
+            session->mode = FTP_MODE_EXTENDED;
+        } else {
+            session->mode = FTP_MODE_STREAM;
+        }
+        ftp_client_msg(session, "200 Command okay.");
     }
 }
 
@@ -857,48 +5443,136 @@ static void ftp_cmd_RETR(struct FtpSession* session, const char* data) {
 
     if (rc <= 0) {
         ftp_client_msg(session, "501 Syntax error in parameters or arguments.");
+    } else if (ftp_ascii_is_striped(session)) {
+        ftp_client_msg(session, "504 Command not implemented for that parameter.");
     } else {
         struct Pathname fullpath = {0};
         rc = build_fullpath(session, &fullpath, pathname);
         if (rc < 0) {
             ftp_client_msg(session, "550 Requested action not taken.");
         } else {
-            rc = ftp_vfs_open(&session->transfer.file_vfs, fix_path_for_device(&fullpath).s, FtpVfsOpenMode_READ);
-            if (rc < 0) {
+            rc = ftp_vfs_open(&session->transfer->file_vfs, fix_path_for_device(&fullpath).s, FtpVfsOpenMode_READ);
+            if (rc < 0 && ftp_tar_begin(session, &fullpath)) {
+                // sending the directory as a tar archive.
+            } else if (rc < 0) {
                 ftp_client_msg(session, "550 Requested action not taken, %s.", strerror(errno));
             } else {
                 struct stat st = {0};
-                rc = ftp_vfs_fstat(&session->transfer.file_vfs, fix_path_for_device(&fullpath).s, &st);
+                rc = ftp_vfs_fstat(&session->transfer->file_vfs, fix_path_for_device(&fullpath).s, &st);
                 if (rc < 0) {
                     ftp_client_msg(session, "550 Requested action not taken, %s.", strerror(errno));
                 } else {
-                    session->transfer.offset = 0;
-                    session->transfer.size = st.st_size;
+                    session->transfer->offset = 0;
+                    session->transfer->size = st.st_size;
+
+                    // stop at the end of the RANG range, or at eof if the range goes past it.
+                    if (session->range_end && session->range_end < session->transfer->size) {
+                        session->transfer->size = session->range_end;
+                    }
+                    session->range_end = 0;
 
                     if (session->server_marker > 0) {
-                        session->transfer.offset = session->server_marker;
-                        rc = ftp_vfs_seek(&session->transfer.file_vfs, session->transfer.offset);
+                        session->transfer->offset = session->server_marker;
                         session->server_marker = 0;
+                        if (session->transfer->offset > session->transfer->size) {
+                            ftp_client_msg(session, "554 Requested action not taken: invalid REST parameter.");
+                            ftp_vfs_close(&session->transfer->file_vfs);
+                            return;
+                        }
+                        rc = ftp_vfs_seek(&session->transfer->file_vfs, session->transfer->offset);
                     }
 
+                    session->transfer->cache = FtpVfsCache_DEFAULT;
+                    session->transfer->cache_checked = 0;
+                    ftp_file_set_cache(session->transfer, session->transfer->size, session->transfer->offset);
+
                     if (rc < 0) {
                         ftp_client_msg(session, "550 Requested action not taken, %s.", strerror(errno));
                     } else {
-                        rc = ftp_data_open(session);
+                        rc = ftp_stripe_acquire(session);
+                        if (rc >= 0) {
+                            rc = ftp_data_open(session);
+                        }
                         if (rc < 0) {
                             ftp_client_msg(session, "425 Can't open data connection, %s.", strerror(errno));
+                            ftp_stripe_release(session);
                         } else {
-                            session->transfer.mode = FTP_TRANSFER_MODE_RETR;
+                            session->transfer->mode = FTP_TRANSFER_MODE_RETR;
+                            session->transfer->ascii = FTP_ASCII_BUFFER_SIZE && session->type == FTP_TYPE_ASCII;
+                            ftp_stripe_begin(session);
+                            ftp_zlib_set_path(session->transfer, fullpath.s);
+#if FTP_IO_THREADS
+                            // with PROT P this waits for the handshake, as it decides if sendfile can be used.
+                            if (!ftp_data_tls_pending(session) && !ftp_file_use_sendfile(session) && ftp_data_transfer_is_raw(session)) {
+                                ftp_io_acquire(session);
+                            }
+#endif
                             return;
                         }
                     }
                 }
-                ftp_vfs_close(&session->transfer.file_vfs);
+                ftp_vfs_close(&session->transfer->file_vfs);
             }
         }
     }
 }
 
+// STOR <dir> after SITE UNTAR extracts the archive received into the directory, which is made if
+// it doesn't exist. the whole archive is streamed through, so REST, APPE, RANG and MODE E aren't supported.
+static void ftp_untar_begin(struct FtpSession* session, const struct Pathname* fullpath, enum FtpVfsOpenMode flags) {
+    struct FtpTransfer* transfer = session->transfer;
+    struct FtpUntar* u = &transfer->untar;
+    struct Pathname path = fix_path_for_device(fullpath);
+    struct stat st;
+
+    if (flags != FtpVfsOpenMode_WRITE || session->mode == FTP_MODE_EXTENDED) {
+        ftp_client_msg(session, "504 Command not implemented for that parameter.");
+        return;
+    } else if (ftp_path_has_dots(path.s)) {
+        ftp_client_msg(session, "553 Requested action not taken, %s.", strerror(EPERM));
+        return;
+    }
+
+    int rc = ftp_vfs_stat(path.s, &st);
+    if (rc < 0 && errno == ENOENT) {
+        rc = ftp_vfs_mkdir(path.s);
+    } else if (rc >= 0 && !S_ISDIR(st.st_mode)) {
+        errno = ENOTDIR;
+        rc = -1;
+    }
+    if (rc < 0) {
+        ftp_client_msg(session, "550 Requested action not taken, %s.", strerror(errno));
+        return;
+    }
+
+    // room is left for the longest name a ustar header can have.
+    const size_t len = strlen(path.s);
+    if (len + 2 + FTP_TAR_NAME_SIZE + 155 >= sizeof(path)) {
+        ftp_client_msg(session, "553 Requested action not taken, %s.", strerror(ENAMETOOLONG));
+        return;
+    } else if (path.s[len - 1] != '/') {
+        strcat(path.s, "/");
+    }
+
+    transfer->offset = 0;
+    if (ftp_data_open(session) < 0) {
+        ftp_client_msg(session, "425 Can't open data connection, %s.", strerror(errno));
+        return;
+    }
+
+    transfer->temp_path = path;
+    memset(u, 0, sizeof(*u));
+    u->active = 1;
+    u->base = strlen(path.s);
+    transfer->write_offset = 0;
+    transfer->alloc_size = 0;
+    transfer->alloc_failed = 1;
+    transfer->mode = FTP_TRANSFER_MODE_STOR;
+#if FTP_WRITE_BUFFER_COUNT
+    ftp_write_buffer_acquire(transfer, 0);
+#endif
+}
+
 // STOR <SP> <pathname> <CRLF> | 125, 150, (110), 226, 250, 425, 426, 451, 551, 552, 532, 450, 452, 553, 500, 501, 421, 530
 static void ftp_cmd_STOR(struct FtpSession* session, const char* data) {
     struct Pathname pathname = {0};
@@ -908,28 +5582,172 @@ static void ftp_cmd_STOR(struct FtpSession* session, const char* data) {
         ftp_client_msg(session, "501 Syntax error in parameters or arguments.");
     } else {
         enum FtpVfsOpenMode flags = FtpVfsOpenMode_WRITE;
+        size_t start_off = 0;
         if (session->server_marker == -1) {
             flags = FtpVfsOpenMode_APPEND;
-            session->server_marker = 0;
+        } else if (session->server_marker > 0 || session->range_end) {
+            // resumed or segmented upload, so write from the marker without truncating.
+            // the client is trusted to stop at the end of a RANG range.
+            flags = FtpVfsOpenMode_WRITE_AT;
+            start_off = session->server_marker;
+        }
+        session->server_marker = 0;
+        session->range_end = 0;
+
+        const size_t alloc_size = session->alloc_size;
+        session->alloc_size = 0;
+
+        const int delta = session->delta_next;
+        session->delta_next = 0;
+        const int untar = session->untar_next;
+        session->untar_next = 0;
+        // the delta records are read straight off the socket and the whole file is replaced.
+        if ((delta && (flags != FtpVfsOpenMode_WRITE || session->mode != FTP_MODE_STREAM)) || ftp_ascii_is_striped(session)) {
+            ftp_client_msg(session, "504 Command not implemented for that parameter.");
+            return;
         }
 
         struct Pathname fullpath = {0};
         rc = build_fullpath(session, &fullpath, pathname);
         if (rc < 0) {
             ftp_client_msg(session, "551 Requested action aborted: page type unknown, %s.", strerror(errno));
+        } else if (untar) {
+            ftp_untar_begin(session, &fullpath, flags);
         } else {
-            rc = ftp_vfs_open(&session->transfer.file_vfs, fix_path_for_device(&fullpath).s, flags);
+            struct Pathname path = fix_path_for_device(&fullpath);
+            ftp_hash_cache_remove(path.s);
+            if (delta) {
+                // the new file is put together next to the old one, which it replaces once complete.
+                if (ftp_vfs_open(&session->transfer->delta.basis, path.s, FtpVfsOpenMode_READ) < 0) {
+                    ftp_client_msg(session, "550 Requested action not taken, %s.", strerror(errno));
+                    return;
+                }
+                session->transfer->temp_path = path;
+                rc = snprintf(path.s, sizeof(path.s), "%s%s", session->transfer->temp_path.s, FTP_DELTA_SUFFIX);
+                if (rc <= 0 || rc >= (int)sizeof(path.s)) {
+                    ftp_vfs_close(&session->transfer->delta.basis);
+                    session->transfer->temp_path.s[0] = '\0';
+                    ftp_client_msg(session, "553 Requested action not taken, %s.", strerror(ENAMETOOLONG));
+                    return;
+                }
+                session->transfer->temp_path = path;
+            }
+
+            // an existing file is only truncated once the space for the upload has been
+            // reserved, so that it's left as it was if the upload is refused with 452.
+            struct stat st;
+            const bool existed = !ftp_vfs_stat(path.s, &st);
+            const bool truncate_later = flags == FtpVfsOpenMode_WRITE && alloc_size && existed;
+            rc = ftp_vfs_open(&session->transfer->file_vfs, path.s, truncate_later ? FtpVfsOpenMode_WRITE_AT : flags);
             if (rc < 0) {
                 ftp_client_msg(session, "551 Requested action aborted: page type unknown, %s.", strerror(errno));
+                if (delta) {
+                    ftp_vfs_close(&session->transfer->delta.basis);
+                    session->transfer->temp_path.s[0] = '\0';
+                }
             } else {
-                rc = ftp_data_open(session);
+                session->transfer->write_offset = 0;
+                session->transfer->alloc_size = 0;
+                session->transfer->alloc_failed = 0;
+                session->transfer->cache = FtpVfsCache_DEFAULT;
+                session->transfer->cache_checked = 0;
+                if (flags == FtpVfsOpenMode_WRITE_AT) {
+                    if (ftp_vfs_seek(&session->transfer->file_vfs, start_off) < 0) {
+                        const int err = errno;
+                        ftp_vfs_close(&session->transfer->file_vfs);
+                        ftp_client_msg(session, "554 Requested action not taken: invalid REST parameter, %s.", strerror(err));
+                        return;
+                    }
+                    // other sessions may be writing to the rest of the file,
+                    // so it must not be grown or trimmed from here.
+                    session->transfer->write_offset = start_off;
+                    session->transfer->alloc_failed = 1;
+                } else if (flags == FtpVfsOpenMode_APPEND) {
+                    // without the size, trimming the file afterwards would lose data.
+                    if (!ftp_vfs_fstat(&session->transfer->file_vfs, path.s, &st)) {
+                        session->transfer->write_offset = st.st_size;
+                    } else {
+                        session->transfer->alloc_failed = 1;
+                    }
+                }
+
+                // reserve the whole file up front if the client said how large it is,
+                // only running out of space is fatal as the fs may not support it.
+                if (alloc_size && !session->transfer->alloc_failed && session->transfer->write_offset + alloc_size >= alloc_size) {
+                    rc = ftp_vfs_allocate(&session->transfer->file_vfs, session->transfer->write_offset + alloc_size);
+                    if (rc < 0 && (errno == ENOSPC || errno == EFBIG)) {
+                        const int err = errno;
+                        ftp_vfs_close(&session->transfer->file_vfs);
+                        if (flags == FtpVfsOpenMode_WRITE && !existed) {
+                            ftp_vfs_unlink(path.s);
+                        }
+                        if (delta) {
+                            ftp_vfs_close(&session->transfer->delta.basis);
+                            session->transfer->temp_path.s[0] = '\0';
+                        }
+                        ftp_client_msg(session, "452 Requested action not taken, %s.", strerror(err));
+                        return;
+                    } else if (rc < 0) {
+                        session->transfer->alloc_failed = 1;
+                    } else {
+                        session->transfer->alloc_size = session->transfer->write_offset + alloc_size;
+                    }
+                }
+
+                if (truncate_later) {
+                    // truncating frees the space reserved past the end too, so it's reserved again.
+                    ftp_vfs_truncate(&session->transfer->file_vfs, 0);
+                    if (session->transfer->alloc_size && ftp_vfs_allocate(&session->transfer->file_vfs, session->transfer->alloc_size) < 0) {
+                        session->transfer->alloc_size = 0;
+                        session->transfer->alloc_failed = 1;
+                    }
+                }
+
+                session->transfer->delta.active = delta;
+                rc = ftp_stripe_acquire(session);
+                if (rc >= 0) {
+                    rc = ftp_data_open(session);
+                }
                 if (rc < 0) {
                     ftp_client_msg(session, "425 Can't open data connection, %s.", strerror(errno));
+                    ftp_stripe_release(session);
                 } else {
-                    session->transfer.mode = FTP_TRANSFER_MODE_STOR;
+                    session->transfer->mode = FTP_TRANSFER_MODE_STOR;
+                    session->transfer->ascii = FTP_ASCII_BUFFER_SIZE && session->type == FTP_TYPE_ASCII && !delta;
+                    ftp_stripe_begin(session);
+                    // appends always go to the end and striped writes are positioned, so neither can skip zeros.
+                    // a resumed upload may be over old data, in which case the holes are punched.
+                    session->transfer->sparse = FTP_SPARSE_BLOCK_SIZE && flags != FtpVfsOpenMode_APPEND && session->mode != FTP_MODE_EXTENDED;
+                    session->transfer->sparse_end = flags == FtpVfsOpenMode_WRITE_AT ? SIZE_MAX : 0;
+                    // a new file is written in order from the start, so it can be hashed as it's written.
+                    if (FTP_HASH_CACHE_ENTRIES && flags == FtpVfsOpenMode_WRITE && session->mode != FTP_MODE_EXTENDED && !delta) {
+                        ftp_hash_init(&session->transfer->hash, session->hash_type);
+                        session->transfer->hash_inline = 1;
+                        session->transfer->temp_path = path;
+                    }
+#if FTP_WRITE_BUFFER_COUNT
+                    // striped writes are positioned, so they go straight to the vfs.
+                    if (session->mode != FTP_MODE_EXTENDED) {
+                        ftp_write_buffer_acquire(session->transfer, session->transfer->write_offset);
+                    }
+#endif
+#if FTP_IO_THREADS
+                    if (!ftp_data_tls_pending(session) && ftp_data_transfer_is_raw(session)) {
+                        ftp_io_acquire(session);
+                    }
+#endif
                     return;
                 }
-                ftp_vfs_close(&session->transfer.file_vfs);
+                if (session->transfer->alloc_size) {
+                    ftp_vfs_truncate(&session->transfer->file_vfs, session->transfer->write_offset);
+                }
+                ftp_vfs_close(&session->transfer->file_vfs);
+                if (delta) {
+                    ftp_vfs_unlink(path.s);
+                    ftp_vfs_close(&session->transfer->delta.basis);
+                    session->transfer->temp_path.s[0] = '\0';
+                }
+                session->transfer->delta.active = 0;
             }
         }
     }
@@ -949,28 +5767,68 @@ static void ftp_cmd_STOU(struct FtpSession* session, const char* data) {
 
 // APPE <SP> <pathname> <CRLF> | 125, 150, (110), 226, 250, 425, 426, 451, 551, 552, 532, 450, 550, 452, 553, 500, 501, 502, 421, 530
 static void ftp_cmd_APPE(struct FtpSession* session, const char* data) {
+    // striped blocks are written at the offset the client gives.
+    if (session->mode == FTP_MODE_EXTENDED) {
+        ftp_client_msg(session, "504 Command not implemented for that parameter.");
+        return;
+    }
     session->server_marker = -1;
     ftp_cmd_STOR(session, data);
 }
 
-// ALLO <SP> <decimal-integer> <CRLF> | 200, 202, 500, 501, 504, 421, 530
+// ALLO <SP> <decimal-integer> [<SP> R <SP> <decimal-integer>] <CRLF> | 200, 202, 500, 501, 504, 421, 530
 static void ftp_cmd_ALLO(struct FtpSession* session, const char* data) {
-    ftp_client_msg(session, "200 Command okay.");
+    unsigned long long size;
+    int rc = sscanf(data, "%llu", &size);
+
+    // %llu takes "-1" as 2^64-1.
+    if (rc <= 0 || data[strspn(data, " ")] == '-') {
+        ftp_client_msg(session, "501 Syntax error in parameters or arguments.");
+    } else if (size > (size_t)-1) {
+        ftp_client_msg(session, "504 Command not implemented for that parameter.");
+    } else {
+        session->alloc_size = size;
+        ftp_client_msg(session, "200 Command okay.");
+    }
 }
 
 // REST <SP> <marker> <CRLF> | 500, 501, 502, 421, 530, 350
 static void ftp_cmd_REST(struct FtpSession* session, const char* data) {
-    int server_marker;
-    int rc = sscanf(data, "%d", &server_marker);
+    long long server_marker;
+    int rc = sscanf(data, "%lld", &server_marker);
 
-    if (rc <= 0 || server_marker < 0) {
+    if (rc <= 0 || server_marker < 0 || (unsigned long long)server_marker > (size_t)-1) {
         ftp_client_msg(session, "501 Syntax error in parameters or arguments.");
     } else {
         session->server_marker = server_marker;
+        session->range_end = 0;
         ftp_client_msg(session, "350 Requested file action pending further information.");
     }
 }
 
+// RANG <SP> <start-point> <SP> <end-point> <CRLF> | 350, 500, 501, 502, 421, 530
+// https://datatracker.ietf.org/doc/html/draft-bryan-ftp-range
+static void ftp_cmd_RANG(struct FtpSession* session, const char* data) {
+    long long start, end;
+    int rc = sscanf(data, "%lld %lld", &start, &end);
+
+    if (rc != 2 || start < 0 || end < 0) {
+        ftp_client_msg(session, "501 Syntax error in parameters or arguments.");
+    } else if (start == 1 && end == 0) {
+        // resets the range, same as REST 0.
+        session->server_marker = 0;
+        session->range_end = 0;
+        ftp_client_msg(session, "350 Restarting at 0. Ending byte reset.");
+    } else if (start > end || (unsigned long long)end >= (size_t)-1) {
+        ftp_client_msg(session, "501 Syntax error in parameters or arguments.");
+    } else {
+        // the end point is inclusive.
+        session->server_marker = start;
+        session->range_end = (size_t)end + 1;
+        ftp_client_msg(session, "350 Restarting at %lld. Ending byte %lld.", start, end);
+    }
+}
+
 // RNFR <SP> <pathname> <CRLF> | 450, 550, 500, 501, 502, 421, 530, 350
 static void ftp_cmd_RNFR(struct FtpSession* session, const char* data) {
     struct Pathname pathname = {0};
@@ -979,10 +5837,14 @@ static void ftp_cmd_RNFR(struct FtpSession* session, const char* data) {
     if (rc <= 0) {
         ftp_client_msg(session, "501 Syntax error in parameters or arguments.");
     } else {
-        rc = build_fullpath(session, &session->temp_path, pathname);
+        rc = build_fullpath(session, &session->transfer->temp_path, pathname);
         if (rc < 0) {
             ftp_client_msg(session, "550 Requested action not taken, %s.", strerror(errno));
+            session->transfer->temp_path.s[0] = '\0';
+            session->path_pending = FTP_PATH_PENDING_NONE;
         } else {
+            // the path is kept until RNTO, along with the transfer context it's in.
+            session->path_pending = FTP_PATH_PENDING_RNFR;
             ftp_client_msg(session, "350 Requested file action pending further information.");
         }
     }
@@ -996,7 +5858,8 @@ static void ftp_cmd_RNTO(struct FtpSession* session, const char* data) {
     if (rc <= 0) {
         ftp_client_msg(session, "501 Syntax error in parameters or arguments.");
     } else {
-        if (session->temp_path.s[0] == '\0') {
+        // the path may have come from SITE CPFR.
+        if (session->path_pending != FTP_PATH_PENDING_RNFR) {
             ftp_client_msg(session, "503 Bad sequence of commands.");
         } else {
             struct Pathname dst_path;
@@ -1004,7 +5867,9 @@ static void ftp_cmd_RNTO(struct FtpSession* session, const char* data) {
             if (rc < 0) {
                 ftp_client_msg(session, "553 Requested action not taken, %s.", strerror(errno));
             } else {
-                rc = ftp_vfs_rename(session->temp_path.s, dst_path.s);
+                rc = ftp_vfs_rename(session->transfer->temp_path.s, dst_path.s);
+                ftp_hash_cache_remove(fix_path_for_device(&session->transfer->temp_path).s);
+                ftp_hash_cache_remove(fix_path_for_device(&dst_path).s);
                 if (rc < 0) {
                     ftp_client_msg(session, "553 Requested action not taken, %s.", strerror(errno));
                 } else {
@@ -1014,20 +5879,33 @@ static void ftp_cmd_RNTO(struct FtpSession* session, const char* data) {
         }
     }
 
-    session->temp_path.s[0] = '\0';
+    session->transfer->temp_path.s[0] = '\0';
+    session->path_pending = FTP_PATH_PENDING_NONE;
+}
+
+// ends the transfer in progress, the reply to ABOR itself is sent by the caller.
+static void ftp_data_transfer_abort(struct FtpSession* session) {
+    if (ftp_data_transfer_is_local(session)) {
+        ftp_local_transfer_end(session);
+    } else {
+        ftp_data_transfer_end(session);
+    }
+    ftp_client_msg(session, "426 Connection closed; transfer aborted.");
 }
 
 // ABOR <CRLF> | 225, 226, 500, 501, 502, 421
 static void ftp_cmd_ABOR(struct FtpSession* session, const char* data) {
-    if (session->data_connection == FTP_DATA_CONNECTION_NONE) {
+    if (session->transfer && ftp_data_transfer_is_local(session)) {
+        ftp_data_transfer_abort(session);
+        ftp_client_msg(session, "226 Closing data connection.");
+    } else if (session->data_connection == FTP_DATA_CONNECTION_NONE) {
         ftp_client_msg(session, "226 Closing data connection.");
     } else {
-        if (session->transfer.mode == FTP_TRANSFER_MODE_NONE) {
+        if (ftp_transfer_mode(session) == FTP_TRANSFER_MODE_NONE) {
             ftp_data_transfer_end(session);
             ftp_client_msg(session, "225 Data connection open; no transfer in progress.");
         } else {
-            ftp_data_transfer_end(session);
-            ftp_client_msg(session, "426 Connection closed; transfer aborted.");
+            ftp_data_transfer_abort(session);
             ftp_client_msg(session, "226 Closing data connection.");
         }
     }
@@ -1047,6 +5925,7 @@ static void ftp_remove_file(struct FtpSession* session, const char* data, int (*
             ftp_client_msg(session, "550 Requested action not taken, %s.", strerror(errno));
         } else {
             rc = func(fix_path_for_device(&fullpath).s);
+            ftp_hash_cache_remove(fix_path_for_device(&fullpath).s);
             if (rc < 0) {
                 ftp_client_msg(session, "550 Requested action not taken, %s.", strerror(errno));
             } else {
@@ -1103,22 +5982,22 @@ static void ftp_list_directory(struct FtpSession* session, const char* data, int
     // see issue: #2
     if (rc <= 0 || !strcmp("-a", pathname.s) || !strcmp("-la", pathname.s)) {
         rc = 0;
-        session->temp_path = session->pwd;
+        session->transfer->temp_path = session->pwd;
     } else {
-        rc = build_fullpath(session, &session->temp_path, pathname);
+        rc = build_fullpath(session, &session->transfer->temp_path, pathname);
     }
 
     if (rc < 0) {
         ftp_client_msg(session, "501 Syntax error in parameters or arguments.");
     } else {
         // check if on root and using devices
-        if (g_ftp.cfg.devices && g_ftp.cfg.devices_count && !strcmp("/", session->temp_path.s)) {
+        if (g_ftp.cfg.devices && g_ftp.cfg.devices_count && !strcmp("/", session->transfer->temp_path.s)) {
             rc = ftp_data_open(session);
             if (rc < 0) {
                 ftp_client_msg(session, "425 Can't open data connection, %s.", strerror(errno));
             } else {
-                session->transfer.index = 0;
-                session->transfer.mode = mode;
+                session->transfer->index = 0;
+                session->transfer->mode = mode;
                 return;
             }
         } else {
@@ -1126,42 +6005,42 @@ static void ftp_list_directory(struct FtpSession* session, const char* data, int
             ftp_log_callback(FTP_API_LOG_TYPE_RESPONSE, "\tLOG START");
             ftp_log_callback(FTP_API_LOG_TYPE_RESPONSE, g_ftp.cfg.devices ? "has dev array" : "no dev array");
             ftp_log_callback(FTP_API_LOG_TYPE_RESPONSE, g_ftp.cfg.devices_count ? "has dev count" : "no dev count");
-            ftp_log_callback(FTP_API_LOG_TYPE_RESPONSE, !strcmp("/", session->temp_path.s) ? "is root" : "not root");
-            ftp_log_callback(FTP_API_LOG_TYPE_RESPONSE, session->temp_path.s);
+            ftp_log_callback(FTP_API_LOG_TYPE_RESPONSE, !strcmp("/", session->transfer->temp_path.s) ? "is root" : "not root");
+            ftp_log_callback(FTP_API_LOG_TYPE_RESPONSE, session->transfer->temp_path.s);
             ftp_log_callback(FTP_API_LOG_TYPE_RESPONSE, "\tLOG END.");
             #endif
 
-            session->temp_path = fix_path_for_device(&session->temp_path);
+            session->transfer->temp_path = fix_path_for_device(&session->transfer->temp_path);
             struct stat st = {0};
-            rc = ftp_vfs_lstat(session->temp_path.s, &st);
+            rc = ftp_vfs_lstat(session->transfer->temp_path.s, &st);
             if (rc < 0) {
-                ftp_client_msg(session, "450 Requested file action not taken. %s. Failed to stat path: %s.", strerror(errno), session->temp_path.s);
+                ftp_client_msg(session, "450 Requested file action not taken. %s. Failed to stat path: %s.", strerror(errno), session->transfer->temp_path.s);
             } else {
                 if (S_ISDIR(st.st_mode)) {
-                    rc = ftp_vfs_opendir(&session->transfer.dir_vfs, session->temp_path.s);
+                    rc = ftp_vfs_opendir(&session->transfer->dir_vfs, session->transfer->temp_path.s);
                     if (rc < 0) {
-                        ftp_client_msg(session, "450 Requested file action not taken. %s. Failed to open dir: %s.", strerror(errno), session->temp_path.s);
+                        ftp_client_msg(session, "450 Requested file action not taken. %s. Failed to open dir: %s.", strerror(errno), session->transfer->temp_path.s);
                     } else {
                         rc = ftp_data_open(session);
                         if (rc < 0) {
                             ftp_client_msg(session, "425 Can't open data connection, %s.", strerror(errno));
                         } else {
-                            session->transfer.mode = mode;
+                            session->transfer->mode = mode;
                             return;
                         }
-                        ftp_vfs_closedir(&session->transfer.dir_vfs);
+                        ftp_vfs_closedir(&session->transfer->dir_vfs);
                     }
                 } else if (!nlist) {
                     const time_t cur_time = time(NULL);
-                    rc = ftp_build_list_entry(session, cur_time, &session->temp_path, pathname.s, &st, nlist);
+                    rc = ftp_build_list_entry(session, cur_time, &session->transfer->temp_path, pathname.s, &st, nlist);
                     if (rc < 0) {
-                        ftp_client_msg(session, "450 Requested file action not taken, %s. Failed to build entry: %s.", strerror(errno), session->temp_path.s);
+                        ftp_client_msg(session, "450 Requested file action not taken, %s. Failed to build entry: %s.", strerror(errno), session->transfer->temp_path.s);
                     } else {
                         rc = ftp_data_open(session);
                         if (rc < 0) {
                             ftp_client_msg(session, "425 Can't open data connection, %s.", strerror(errno));
                         } else {
-                            session->transfer.mode = mode;
+                            session->transfer->mode = mode;
                             return;
                         }
                     }
@@ -1171,50 +6050,591 @@ static void ftp_list_directory(struct FtpSession* session, const char* data, int
             }
         }
     }
-}
+}
+
+// LIST [<SP> <pathname>] <CRLF> | 125, 150, 226, 250, 425, 426, 451, 450, 500, 501, 502, 421, 530
+static void ftp_cmd_LIST(struct FtpSession* session, const char* data) {
+    ftp_list_directory(session, data, 0);
+}
+
+// NLST [<SP> <pathname>] <CRLF> | 125, 150, 226, 250, 425, 426, 451, 450, 500, 501, 502, 421, 530
+static void ftp_cmd_NLST(struct FtpSession* session, const char* data) {
+    ftp_list_directory(session, data, 1);
+}
+
+// SITE BLOCKSUMS <SP> <pathname> <SP> <block-size> <CRLF> | 125, 150, 226, 250, 425, 426, 451, 501, 550
+// sends a record for each block of the file over the data connection, the 32-bit rsync style
+// rolling checksum (big endian) followed by the MD5 of the block. the last block may be short.
+static void ftp_site_BLOCKSUMS(struct FtpSession* session, const char* data) {
+    struct FtpTransfer* transfer = session->transfer;
+    struct Pathname pathname = {0};
+    int rc = sscanf(data, "%"FTP_PATHNAME_SSCANF"[^"TELNET_EOL"]", pathname.s);
+
+    // the block size comes last, so the path may contain spaces.
+    char* block_arg = rc > 0 ? strrchr(pathname.s, ' ') : NULL;
+    unsigned long long block_size = 0;
+    if (!block_arg || sscanf(block_arg + 1, "%llu", &block_size) != 1 || !block_size || block_size > FTP_BLOCKSUMS_MAX_SIZE) {
+        ftp_client_msg(session, "501 Syntax error in parameters or arguments.");
+        return;
+    }
+    *block_arg = '\0';
+
+    struct Pathname fullpath = {0};
+    struct stat st;
+    rc = build_fullpath(session, &fullpath, pathname);
+    if (rc < 0) {
+        ftp_client_msg(session, "550 Requested action not taken, %s.", strerror(errno));
+        return;
+    }
+
+    fullpath = fix_path_for_device(&fullpath);
+    rc = ftp_vfs_open(&transfer->file_vfs, fullpath.s, FtpVfsOpenMode_READ);
+    if (rc < 0) {
+        ftp_client_msg(session, "550 Requested action not taken, %s.", strerror(errno));
+        return;
+    }
+
+    rc = ftp_vfs_fstat(&transfer->file_vfs, fullpath.s, &st);
+    if (rc < 0 || S_ISDIR(st.st_mode)) {
+        ftp_client_msg(session, "550 Requested action not taken, %s.", rc < 0 ? strerror(errno) : strerror(EISDIR));
+        ftp_vfs_close(&transfer->file_vfs);
+        return;
+    }
+
+    transfer->offset = 0;
+    transfer->size = st.st_size;
+    memset(&transfer->delta, 0, sizeof(transfer->delta));
+    ftp_vfs_file_init(&transfer->delta.basis);
+    transfer->delta.block_size = block_size;
+    ftp_hash_init(&transfer->hash, FtpHashType_MD5);
+
+    if (ftp_data_open(session) < 0) {
+        ftp_client_msg(session, "425 Can't open data connection, %s.", strerror(errno));
+        ftp_vfs_close(&transfer->file_vfs);
+        transfer->size = 0;
+        return;
+    }
+    transfer->mode = FTP_TRANSFER_MODE_BLOCKSUMS;
+}
+
+// SITE DELTA <CRLF> | 200
+// the next STOR replaces the file using a stream of records made against the
+// SITE BLOCKSUMS of the file, the file is only replaced once the stream is complete.
+static void ftp_site_DELTA(struct FtpSession* session, const char* data) {
+    session->delta_next = 1;
+    session->untar_next = 0;
+    ftp_client_msg(session, "200 Command okay.");
+}
+
+// SITE UNTAR <CRLF> | 200
+// the next STOR is a tar archive that is extracted into the directory it names as it's received.
+static void ftp_site_UNTAR(struct FtpSession* session, const char* data) {
+    session->untar_next = 1;
+    session->delta_next = 0;
+    ftp_client_msg(session, "200 Command okay.");
+}
+
+// SITE CPFR <SP> <pathname> <CRLF> | 350, 501, 550
+// https://www.proftpd.org/docs/contrib/mod_copy.html
+static void ftp_site_CPFR(struct FtpSession* session, const char* data) {
+    struct Pathname pathname = {0};
+    struct stat st;
+    int rc = sscanf(data, "%"FTP_PATHNAME_SSCANF"[^"TELNET_EOL"]", pathname.s);
+
+    if (rc <= 0) {
+        ftp_client_msg(session, "501 Syntax error in parameters or arguments.");
+    } else {
+        rc = build_fullpath(session, &session->transfer->temp_path, pathname);
+        if (rc >= 0) {
+            session->transfer->temp_path = fix_path_for_device(&session->transfer->temp_path);
+            rc = ftp_vfs_stat(session->transfer->temp_path.s, &st);
+        }
+        if (rc < 0) {
+            ftp_client_msg(session, "550 Requested action not taken, %s.", strerror(errno));
+            session->transfer->temp_path.s[0] = '\0';
+            session->path_pending = FTP_PATH_PENDING_NONE;
+        } else {
+            session->path_pending = FTP_PATH_PENDING_CPFR;
+            ftp_client_msg(session, "350 File or directory exists, ready for destination name.");
+        }
+    }
+}
+
+// SITE CPTO <SP> <pathname> <CRLF> | 250, 451, 452, 501, 503, 550, 553
+// the copy is done on the loop like HASH, so the reply comes once it's done.
+static void ftp_site_CPTO(struct FtpSession* session, const char* data) {
+    struct FtpTransfer* transfer = session->transfer;
+    struct Pathname pathname = {0};
+    struct Pathname src_path = transfer->temp_path;
+    struct Pathname dst_path = {0};
+    struct stat st, dst_st;
+    int rc = sscanf(data, "%"FTP_PATHNAME_SSCANF"[^"TELNET_EOL"]", pathname.s);
+    // the path may have come from RNFR.
+    const bool pending = session->path_pending == FTP_PATH_PENDING_CPFR;
+    transfer->temp_path.s[0] = '\0';
+    session->path_pending = FTP_PATH_PENDING_NONE;
+
+    if (rc <= 0) {
+        ftp_client_msg(session, "501 Syntax error in parameters or arguments.");
+        return;
+    } else if (!pending) {
+        ftp_client_msg(session, "503 Bad sequence of commands.");
+        return;
+    }
+
+    rc = build_fullpath(session, &dst_path, pathname);
+    if (rc < 0) {
+        ftp_client_msg(session, "553 Requested action not taken, %s.", strerror(errno));
+        return;
+    }
+    dst_path = fix_path_for_device(&dst_path);
+
+    rc = ftp_vfs_open(&transfer->file_vfs, src_path.s, FtpVfsOpenMode_READ);
+    if (rc < 0) {
+        ftp_client_msg(session, "550 Requested action not taken, %s.", strerror(errno));
+        return;
+    }
+
+    rc = ftp_vfs_fstat(&transfer->file_vfs, src_path.s, &st);
+    if (rc < 0 || S_ISDIR(st.st_mode)) {
+        ftp_client_msg(session, "550 Requested action not taken, %s.", rc < 0 ? strerror(errno) : strerror(EISDIR));
+        ftp_vfs_close(&transfer->file_vfs);
+        return;
+    }
+
+    // opening the destination truncates it, which would lose the source if it's the same file.
+    if (!strcmp(src_path.s, dst_path.s) || (!ftp_vfs_stat(dst_path.s, &dst_st) && st.st_ino && st.st_ino == dst_st.st_ino && st.st_dev == dst_st.st_dev)) {
+        ftp_client_msg(session, "553 Requested action not taken, %s.", strerror(EINVAL));
+        ftp_vfs_close(&transfer->file_vfs);
+        return;
+    }
+
+    ftp_hash_cache_remove(dst_path.s);
+    rc = ftp_vfs_open(&transfer->copy_vfs, dst_path.s, FtpVfsOpenMode_WRITE);
+    if (rc < 0) {
+        ftp_client_msg(session, "553 Requested action not taken, %s.", strerror(errno));
+        ftp_vfs_close(&transfer->file_vfs);
+        return;
+    }
+
+    transfer->temp_path = dst_path;
+    transfer->offset = 0;
+    transfer->size = st.st_size;
+    transfer->deficit = 0;
+    transfer->alloc_size = 0;
+
+    // on a copy on write fs the data is shared, so there's nothing left to copy.
+    if (!ftp_vfs_clone(&transfer->copy_vfs, &transfer->file_vfs)) {
+        ftp_vfs_close(&transfer->copy_vfs);
+        ftp_client_msg(session, "250 Requested file action okay, completed.");
+        ftp_local_transfer_end(session);
+        return;
+    }
+
+    // the whole size is known up front, only running out of space is fatal.
+    if (st.st_size) {
+        rc = ftp_vfs_allocate(&transfer->copy_vfs, st.st_size);
+        if (rc < 0 && (errno == ENOSPC || errno == EFBIG)) {
+            ftp_client_msg(session, "452 Requested action not taken, %s.", strerror(errno));
+            ftp_local_transfer_end(session);
+            return;
+        } else if (!rc) {
+            transfer->alloc_size = st.st_size;
+        }
+    }
+
+    transfer->copy_fast = 1;
+    transfer->mode = FTP_TRANSFER_MODE_COPY;
+}
+
+// SITE RMTREE <SP> <pathname> <CRLF> | 150, 250, 501, 550
+// removes the directory and everything in it. the tree is removed on the loop a few entries at a
+// time, with a 150 reply every FTP_RMTREE_PROGRESS entries, and the reply comes once it's done.
+static void ftp_site_RMTREE(struct FtpSession* session, const char* data) {
+    struct FtpTransfer* transfer = session->transfer;
+    struct Pathname pathname = {0};
+    struct Pathname fullpath = {0};
+    struct stat st;
+    int rc = sscanf(data, "%"FTP_PATHNAME_SSCANF"[^"TELNET_EOL"]", pathname.s);
+
+    if (rc <= 0) {
+        ftp_client_msg(session, "501 Syntax error in parameters or arguments.");
+        return;
+    }
+
+    rc = build_fullpath(session, &fullpath, pathname);
+    if (rc < 0) {
+        ftp_client_msg(session, "550 Requested action not taken, %s.", strerror(errno));
+        return;
+    }
+    fullpath = fix_path_for_device(&fullpath);
+
+    // the root, or the root of a device, is off limits, as is anything that may lead back up to it.
+    const char* root = strchr(fullpath.s, ':');
+    root = root ? root + 1 : fullpath.s;
+    if (root[strspn(root, "/")] == '\0' || ftp_path_has_dots(fullpath.s)) {
+        ftp_client_msg(session, "550 Requested action not taken, %s.", strerror(EPERM));
+        return;
+    }
+
+    rc = ftp_vfs_lstat(fullpath.s, &st);
+    if (rc < 0 || !S_ISDIR(st.st_mode)) {
+        ftp_client_msg(session, "550 Requested action not taken, %s.", rc < 0 ? strerror(errno) : strerror(ENOTDIR));
+        return;
+    }
+
+    transfer->temp_path = fullpath;
+    transfer->offset = 0;
+    transfer->size = strlen(fullpath.s);
+    transfer->index = 0;
+    transfer->deficit = 0;
+    transfer->mode = FTP_TRANSFER_MODE_RMTREE;
+}
+
+// SITE MKDIRS <SP> <pathname> <CRLF> | 257, 501, 550
+// creates the directory along with any of its parents that are missing, like mkdir -p.
+static void ftp_site_MKDIRS(struct FtpSession* session, const char* data) {
+    struct Pathname pathname = {0};
+    struct Pathname fullpath = {0};
+    struct Pathname path;
+    int rc = sscanf(data, "%"FTP_PATHNAME_SSCANF"[^"TELNET_EOL"]", pathname.s);
+
+    if (rc <= 0) {
+        ftp_client_msg(session, "501 Syntax error in parameters or arguments.");
+        return;
+    }
+
+    rc = build_fullpath(session, &fullpath, pathname);
+    if (rc < 0) {
+        ftp_client_msg(session, "550 Requested action not taken, %s.", strerror(errno));
+        return;
+    }
+
+    rc = ftp_mkdirs(&fullpath, &path);
+    if (rc < 0) {
+        ftp_client_msg(session, "550 Requested action not taken, %s. Failed to create: %s.", strerror(errno), path.s);
+    } else {
+        ftp_client_msg(session, "257 \"%s\" created.", fullpath.s);
+    }
+}
+
+static const struct FtpCommand FTP_SITE_COMMANDS[] = {
+    { "BLOCKSUMS", ftp_site_BLOCKSUMS, 1, FTP_ARGS_REQUIRED, 1 },
+    { "CPFR", ftp_site_CPFR, 1, FTP_ARGS_REQUIRED, 1 },
+    { "CPTO", ftp_site_CPTO, 1, FTP_ARGS_REQUIRED, 1 },
+    { "DELTA", ftp_site_DELTA, 1, FTP_ARGS_NONE, 0 },
+    { "MKDIRS", ftp_site_MKDIRS, 1, FTP_ARGS_REQUIRED, 0 },
+    { "RMTREE", ftp_site_RMTREE, 1, FTP_ARGS_REQUIRED, 1 },
+    { "UNTAR", ftp_site_UNTAR, 1, FTP_ARGS_NONE, 0 },
+};
+
+// SITE <SP> <string> <CRLF> | 200, 202, 500, 501, 530
+static void ftp_cmd_SITE(struct FtpSession* session, const char* data) {
+    char name[16] = {0};
+    int rc = sscanf(data, "%15[^ "TELNET_EOL"]", name);
+
+    if (rc <= 0) {
+        ftp_client_msg(session, "501 Syntax error in parameters or arguments.");
+        return;
+    }
+
+    for (size_t i = 0; i < FTP_ARR_SZ(FTP_SITE_COMMANDS); i++) {
+        const struct FtpCommand* cmd = &FTP_SITE_COMMANDS[i];
+        if (!strcasecmp(name, cmd->name)) {
+            const char* args = data + strlen(name);
+            if (cmd->transfer_required && !ftp_cmd_transfer_acquire(session)) {
+                // replied to by ftp_cmd_transfer_acquire().
+            } else if (*args == ' ' && cmd->args_required != FTP_ARGS_NONE) {
+                cmd->cmd_func(session, args + 1);
+            } else if (*args != ' ' && cmd->args_required != FTP_ARGS_REQUIRED) {
+                cmd->cmd_func(session, "\0");
+            } else {
+                ftp_client_msg(session, "501 Syntax error in parameters or arguments.");
+            }
+            return;
+        }
+    }
+
+    ftp_client_msg(session, "500 Syntax error, command unrecognized.");
+}
+
+// SYST <CRLF> | 215, 500, 501, 502, 421
+static void ftp_cmd_SYST(struct FtpSession* session, const char* data) {
+    ftp_client_msg(session, "215 UNIX Type: L8");
+}
+
+// replies to STAT without a pathname, giving the progress of the transfer if there's one.
+static void ftp_stat_session(struct FtpSession* session) {
+    static const char* const transfer_names[] = {
+        [FTP_TRANSFER_MODE_NONE] = "none",
+        [FTP_TRANSFER_MODE_RETR] = "RETR",
+        [FTP_TRANSFER_MODE_STOR] = "STOR",
+        [FTP_TRANSFER_MODE_LIST] = "LIST",
+        [FTP_TRANSFER_MODE_NLST] = "NLST",
+        [FTP_TRANSFER_MODE_HASH] = "HASH",
+        [FTP_TRANSFER_MODE_BLOCKSUMS] = "SITE BLOCKSUMS",
+        [FTP_TRANSFER_MODE_COPY] = "SITE CPTO",
+        [FTP_TRANSFER_MODE_RMTREE] = "SITE RMTREE",
+        [FTP_TRANSFER_MODE_TAR] = "RETR tar",
+    };
+    static const char types[] = { [FTP_TYPE_ASCII] = 'A', [FTP_TYPE_EBCDIC] = 'E', [FTP_TYPE_IMAGE] = 'I', [FTP_TYPE_LOCAL] = 'L' };
+    static const char modes[] = { [FTP_MODE_STREAM] = 'S', [FTP_MODE_BLOCK] = 'B', [FTP_MODE_COMPRESSED] = 'C', [FTP_MODE_DEFLATE] = 'Z', [FTP_MODE_EXTENDED] = 'E' };
+    static const char* const connections[] = {
+        [FTP_DATA_CONNECTION_NONE] = "none",
+        [FTP_DATA_CONNECTION_ACTIVE] = "PORT",
+        [FTP_DATA_CONNECTION_PASSIVE] = "PASV",
+    };
+
+    const struct FtpTransfer* transfer = session->transfer;
+    char progress[128] = {0};
+    if (!transfer || transfer->mode == FTP_TRANSFER_MODE_NONE) {
+        snprintf(progress, sizeof(progress), "No data transfer in progress");
+    } else if (transfer->mode == FTP_TRANSFER_MODE_STOR) {
+        snprintf(progress, sizeof(progress), "Transfer: STOR, %zu bytes written", transfer->write_offset);
+    } else if (transfer->mode == FTP_TRANSFER_MODE_RETR && transfer->size) {
+        snprintf(progress, sizeof(progress), "Transfer: RETR, at %zu of %zu bytes", transfer->offset, transfer->size);
+    } else {
+        snprintf(progress, sizeof(progress), "Transfer: %s", transfer_names[transfer->mode]);
+    }
+
+    ftp_client_msg(session,
+        "211-Status of ftpsrv:" TELNET_EOL
+        " Connected from %s" TELNET_EOL
+        " TYPE: %c, STRU: F, MODE: %c" TELNET_EOL
+        " Data connection: %s" TELNET_EOL
+        " %s" TELNET_EOL
+        "211 End of status.",
+        inet_ntoa(session->control_sockaddr.sin_addr), types[session->type], modes[session->mode],
+        connections[session->data_connection], progress);
+}
+
+// STAT [<SP> <string>] <CRLF> | 211, 212, 213, 450, 500, 501, 502, 421, 530
+// without a pathname it can be sent during a transfer to see how far it has got.
+static void ftp_cmd_STAT(struct FtpSession* session, const char* data) {
+    struct Pathname pathname = {0};
+    int rc = sscanf(data, "%"FTP_PATHNAME_SSCANF"[^"TELNET_EOL"]", pathname.s);
+
+    if (rc <= 0) {
+        ftp_stat_session(session);
+        return;
+    }
+
+    struct Pathname fullpath = {0};
+    rc = build_fullpath(session, &fullpath, pathname);
+    if (rc < 0) {
+        ftp_client_msg(session, "501 Syntax error in parameters or arguments, %s.", strerror(errno));
+        return;
+    }
+
+    // the entry is given in the LIST format, a directory isn't listed.
+    fullpath = fix_path_for_device(&fullpath);
+    struct stat st = {0};
+    rc = ftp_vfs_lstat(fullpath.s, &st);
+    if (rc < 0) {
+        ftp_client_msg(session, "450 Requested file action not taken. %s. Failed to stat path: %s.", strerror(errno), fullpath.s);
+    } else if (!ftp_cmd_transfer_acquire(session)) {
+        // the entry is built in the list buffer of the transfer context.
+    } else if (ftp_build_list_entry(session, time(NULL), &fullpath, pathname.s, &st, 0) < 0) {
+        ftp_client_msg(session, "450 Requested file action not taken, %s. Failed to build entry: %s.", strerror(errno), fullpath.s);
+    } else {
+        ftp_client_msg(session, "213-Status of %s:" TELNET_EOL "%s" "213 End of status.", pathname.s, session->transfer->list_buf);
+    }
+}
+
+// HELP <CRLF> | 211, 214, 500, 501, 502, 421
+static void ftp_cmd_HELP(struct FtpSession* session, const char* data) {
+    ftp_client_msg(session, "214 ftpsrv 0.2.0 By TotalJustice.");
+}
+
+// NOOP <CRLF> | 200, 500, 421
+static void ftp_cmd_NOOP(struct FtpSession* session, const char* data) {
+    ftp_client_msg(session, "200 Command okay.");
+}
+
+// FEAT <CRLF> | 211, 550
+static void ftp_cmd_FEAT(struct FtpSession* session, const char* data) {
+    // the algorithm in use is marked with a *.
+    char hash_feat[64] = {0};
+    for (int i = 0; i < FtpHashType_COUNT; i++) {
+        const size_t len = strlen(hash_feat);
+        snprintf(hash_feat + len, sizeof(hash_feat) - len, "%s%s%s", i ? ";" : "", ftp_hash_name(i), i == (int)session->hash_type ? "*" : "");
+    }
+
+    ftp_client_msg(session,
+        "211-Extensions supported:" TELNET_EOL
+        " SIZE" TELNET_EOL
+        " REST STREAM" TELNET_EOL
+        " RANG STREAM" TELNET_EOL
+        " HASH %s" TELNET_EOL
+        " XCRC" TELNET_EOL
+        " XMD5" TELNET_EOL
+#if FTP_ZLIB_STREAMS
+        " MODE Z" TELNET_EOL
+#endif
+#if FTP_STRIPE_COUNT
+        " PARALLEL" TELNET_EOL
+#endif
+        "%s"
+        // " MLST modify*;perm*;size*;type*;" TELNET_EOL
+        "211 END", hash_feat,
+#if FTP_TLS
+        g_ftp.tls_ctx ? " AUTH TLS" TELNET_EOL " PBSZ" TELNET_EOL " PROT" TELNET_EOL : "");
+#else
+        "");
+#endif
+}
+
+// OPTS <SP> <command-name> [<SP> <command-options>] <CRLF> | 200, 451, 501, 504
+// "OPTS RETR Parallelism=<start>[,<min>,<max>];" sets the number of data connections
+// for MODE E transfers, both for RETR and STOR.
+// "OPTS HASH [<SP> <algorithm>]" sets or returns the algorithm used by HASH.
+static void ftp_cmd_OPTS(struct FtpSession* session, const char* data) {
+    static const char parallelism[] = "RETR Parallelism=";
+    char name[16] = {0};
+    char option[16] = {0};
+    unsigned count;
+
+    if (sscanf(data, "%15[^ "TELNET_EOL"]%*[ ]%15[^"TELNET_EOL"]", name, option) >= 1 && !strcasecmp(name, "HASH")) {
+        for (int i = 0; option[0] && i < FtpHashType_COUNT; i++) {
+            if (!strcasecmp(option, ftp_hash_name(i))) {
+                session->hash_type = i;
+                option[0] = '\0';
+            }
+        }
+
+        if (option[0]) {
+            ftp_client_msg(session, "504 Command not implemented for that parameter.");
+        } else {
+            ftp_client_msg(session, "200 %s", ftp_hash_name(session->hash_type));
+        }
+    } else if (strncasecmp(data, parallelism, strlen(parallelism)) || !FTP_STRIPE_COUNT) {
+        ftp_client_msg(session, "501 Syntax error in parameters or arguments.");
+    } else if (sscanf(data + strlen(parallelism), "%u", &count) != 1 || !count) {
+        ftp_client_msg(session, "501 Syntax error in parameters or arguments.");
+    } else {
+        session->parallelism = count < FTP_STRIPE_MAX ? count : FTP_STRIPE_MAX;
+        ftp_client_msg(session, "200 Parallel streams set to %u.", session->parallelism);
+    }
+}
+
+// starts hashing the range of the file, end is one past the last byte, 0 for the end of the file.
+// the reply is sent by ftp_hash_data_transfer_progress() once done, unless the digest is cached.
+static void ftp_hash_begin(struct FtpSession* session, struct Pathname pathname, enum FtpHashType type, size_t start, size_t end, int reply) {
+    struct FtpTransfer* transfer = session->transfer;
+    struct Pathname fullpath = {0};
+    struct stat st = {0};
+
+    int rc = build_fullpath(session, &fullpath, pathname);
+    if (rc < 0) {
+        ftp_client_msg(session, "550 Requested action not taken, %s.", strerror(errno));
+        return;
+    }
+
+    fullpath = fix_path_for_device(&fullpath);
+    rc = ftp_vfs_open(&transfer->file_vfs, fullpath.s, FtpVfsOpenMode_READ);
+    if (rc < 0) {
+        ftp_client_msg(session, "550 Requested action not taken, %s.", strerror(errno));
+        return;
+    }
+
+    rc = ftp_vfs_fstat(&transfer->file_vfs, fullpath.s, &st);
+    if (rc < 0 || S_ISDIR(st.st_mode)) {
+        ftp_client_msg(session, "550 Requested action not taken, %s.", rc < 0 ? strerror(errno) : strerror(EISDIR));
+        ftp_vfs_close(&transfer->file_vfs);
+        return;
+    }
+
+    if (!end || end > (size_t)st.st_size) {
+        end = st.st_size;
+    }
+    if (start > end || (start && ftp_vfs_seek(&transfer->file_vfs, start) < 0)) {
+        ftp_client_msg(session, "554 Requested action not taken: invalid REST parameter.");
+        ftp_vfs_close(&transfer->file_vfs);
+        return;
+    }
+
+    ftp_hash_init(&transfer->hash, type);
+    transfer->hash_start = start;
+    transfer->hash_reply = reply;
+    transfer->offset = start;
+    transfer->size = end;
+    transfer->deficit = 0;
+    transfer->temp_path = fullpath;
+
+#if FTP_HASH_CACHE_ENTRIES
+    const struct FtpHashCacheEntry* entry = ftp_hash_cache_find(fullpath.s, &st, type, start, end);
+    if (entry) {
+        ftp_hash_reply(session, entry->digest);
+        ftp_local_transfer_end(session);
+        return;
+    }
+#endif
+
+    transfer->mode = FTP_TRANSFER_MODE_HASH;
+}
+
+// XCRC and XMD5 take the path, which has to be quoted if followed by the start and end offset.
+static int ftp_hash_parse_args(const char* data, struct Pathname* pathname, size_t* start, size_t* end) {
+    unsigned long long s = 0, e = 0;
+    int rc;
+
+    if (data[0] == '"') {
+        rc = sscanf(data + 1, "%"FTP_PATHNAME_SSCANF"[^\""TELNET_EOL"]", pathname->s);
+        if (rc > 0) {
+            const char* args = data + 1 + strlen(pathname->s);
+            if (*args == '"') {
+                sscanf(args + 1, " %llu %llu", &s, &e);
+            }
+        }
+    } else {
+        rc = sscanf(data, "%"FTP_PATHNAME_SSCANF"[^"TELNET_EOL"]", pathname->s);
+    }
 
-// LIST [<SP> <pathname>] <CRLF> | 125, 150, 226, 250, 425, 426, 451, 450, 500, 501, 502, 421, 530
-static void ftp_cmd_LIST(struct FtpSession* session, const char* data) {
-    ftp_list_directory(session, data, 0);
+    *start = s;
+    *end = e;
+    return rc;
 }
 
-// NLST [<SP> <pathname>] <CRLF> | 125, 150, 226, 250, 425, 426, 451, 450, 500, 501, 502, 421, 530
-static void ftp_cmd_NLST(struct FtpSession* session, const char* data) {
-    ftp_list_directory(session, data, 1);
-}
+// HASH <SP> <pathname> <CRLF> | 213, 450, 501, 504, 550, 554
+// the range is set with RANG, the algorithm with OPTS HASH.
+static void ftp_cmd_HASH(struct FtpSession* session, const char* data) {
+    struct Pathname pathname = {0};
+    int rc = sscanf(data, "%"FTP_PATHNAME_SSCANF"[^"TELNET_EOL"]", pathname.s);
 
-// SITE [<SP> <string>] <CRLF> | 200, 202, 500, 501, 530
-static void ftp_cmd_SITE(struct FtpSession* session, const char* data) {
-    ftp_client_msg(session, "500 Syntax error, command unrecognized.");
-}
+    const size_t start = session->server_marker > 0 ? session->server_marker : 0;
+    const size_t end = session->range_end;
+    session->server_marker = 0;
+    session->range_end = 0;
 
-// SYST <CRLF> | 215, 500, 501, 502, 421
-static void ftp_cmd_SYST(struct FtpSession* session, const char* data) {
-    ftp_client_msg(session, "215 UNIX Type: L8");
+    if (rc <= 0) {
+        ftp_client_msg(session, "501 Syntax error in parameters or arguments.");
+    } else {
+        ftp_hash_begin(session, pathname, session->hash_type, start, end, 213);
+    }
 }
 
-// STAT [<SP> <string>] <CRLF> | 211, 212, 213, 450, 500, 501, 502, 421, 530
-static void ftp_cmd_STAT(struct FtpSession* session, const char* data) {
-    ftp_client_msg(session, "500 Syntax error, command unrecognized.");
-}
+// XCRC <SP> <pathname> [<SP> <start> [<SP> <end>]] <CRLF> | 250, 501, 550, 554
+static void ftp_cmd_XCRC(struct FtpSession* session, const char* data) {
+    struct Pathname pathname = {0};
+    size_t start, end;
 
-// HELP <CRLF> | 211, 214, 500, 501, 502, 421
-static void ftp_cmd_HELP(struct FtpSession* session, const char* data) {
-    ftp_client_msg(session, "214 ftpsrv 0.2.0 By TotalJustice.");
+    if (ftp_hash_parse_args(data, &pathname, &start, &end) <= 0) {
+        ftp_client_msg(session, "501 Syntax error in parameters or arguments.");
+    } else {
+        ftp_hash_begin(session, pathname, FtpHashType_CRC32, start, end, 250);
+    }
 }
 
-// NOOP <CRLF> | 200, 500, 421
-static void ftp_cmd_NOOP(struct FtpSession* session, const char* data) {
-    ftp_client_msg(session, "200 Command okay.");
-}
+// XMD5 <SP> <pathname> [<SP> <start> [<SP> <end>]] <CRLF> | 250, 501, 550, 554
+static void ftp_cmd_XMD5(struct FtpSession* session, const char* data) {
+    struct Pathname pathname = {0};
+    size_t start, end;
 
-// FEAT <CRLF> | 211, 550
-static void ftp_cmd_FEAT(struct FtpSession* session, const char* data) {
-    ftp_client_msg(session,
-        "211-Extensions supported:" TELNET_EOL
-        " SIZE" TELNET_EOL
-        // " MLST modify*;perm*;size*;type*;" TELNET_EOL
-        "211 END");
+    if (ftp_hash_parse_args(data, &pathname, &start, &end) <= 0) {
+        ftp_client_msg(session, "501 Syntax error in parameters or arguments.");
+    } else {
+        ftp_hash_begin(session, pathname, FtpHashType_MD5, start, end, 250);
+    }
 }
 
 // SIZE <SP> <pathname> <CRLF> | 213, 550
@@ -1235,55 +6655,138 @@ static void ftp_cmd_SIZE(struct FtpSession* session, const char* data) {
             if (rc < 0) {
                 ftp_client_msg(session, "550 Requested action not taken, %s. Bad path: %s.", strerror(errno), fullpath.s);
             } else {
-                ftp_client_msg(session, "213 %d", st.st_size);
+                ftp_client_msg(session, "213 %lld", (long long)st.st_size);
             }
         }
     }
 }
 
+// AUTH <SP> <mechanism-name> <CRLF> | 234, 431, 500, 501, 502, 503, 504
+// the reply is sent in the clear, everything after it on the control connection uses TLS.
+static void ftp_cmd_AUTH(struct FtpSession* session, const char* data) {
+#if FTP_TLS
+    char mechanism[8] = {0};
+    int rc = sscanf(data, "%7[^"TELNET_EOL"]", mechanism);
+
+    if (rc <= 0) {
+        ftp_client_msg(session, "501 Syntax error in parameters or arguments.");
+    } else if (strcasecmp(mechanism, "TLS") && strcasecmp(mechanism, "TLS-C")) {
+        ftp_client_msg(session, "504 Command not implemented for that parameter.");
+    } else if (!g_ftp.tls_ctx) {
+        ftp_client_msg(session, "431 Need some unavailable resource to process security.");
+    } else if (session->control_tls.ssl) {
+        ftp_client_msg(session, "503 Bad sequence of commands.");
+    } else {
+        struct FtpTls tls;
+        if (ftp_tls_begin(&tls, session->control_sock) < 0) {
+            ftp_client_msg(session, "431 Need some unavailable resource to process security.");
+        } else {
+            ftp_client_msg(session, "234 Proceed with negotiation.");
+            // the handshake is done from the loop, so the socket mustn't block it.
+            ftp_set_socket_nonblocking_enable(session->control_sock);
+            session->control_tls = tls;
+#if FTP_CMD_QUEUE_SIZE
+            // commands sent along with AUTH came in the clear, so they aren't run as if they came over TLS.
+            session->cmd_queue_len = 0;
+            session->cmd_queue[0] = '\0';
+#endif
+        }
+    }
+#else
+    ftp_client_msg(session, "502 Command not implemented.");
+#endif
+}
+
+// PBSZ <SP> <decimal-integer> <CRLF> | 200, 501, 502, 503
+// TLS doesn't use a protection buffer, so it's always 0.
+static void ftp_cmd_PBSZ(struct FtpSession* session, const char* data) {
+#if FTP_TLS
+    if (!session->control_tls.ssl) {
+        ftp_client_msg(session, "503 Bad sequence of commands.");
+    } else {
+        session->tls_pbsz = 1;
+        ftp_client_msg(session, "200 PBSZ=0");
+    }
+#else
+    ftp_client_msg(session, "502 Command not implemented.");
+#endif
+}
+
+// PROT <SP> <prot-code> <CRLF> | 200, 501, 502, 503, 504, 536
+// C sends the data in the clear, P uses TLS on each data connection.
+static void ftp_cmd_PROT(struct FtpSession* session, const char* data) {
+#if FTP_TLS
+    char code = 0;
+    int rc = sscanf(data, "%c", &code);
+
+    if (rc <= 0) {
+        ftp_client_msg(session, "501 Syntax error in parameters or arguments.");
+    } else if (!session->control_tls.ssl || !session->tls_pbsz) {
+        ftp_client_msg(session, "503 Bad sequence of commands.");
+    } else if (toupper(code) == 'C' || toupper(code) == 'P') {
+        session->tls_private = toupper(code) == 'P';
+        ftp_client_msg(session, "200 Command okay.");
+    } else if (toupper(code) == 'S' || toupper(code) == 'E') {
+        ftp_client_msg(session, "536 Requested PROT level not supported by mechanism.");
+    } else {
+        ftp_client_msg(session, "504 Command not implemented for that parameter.");
+    }
+#else
+    ftp_client_msg(session, "502 Command not implemented.");
+#endif
+}
+
 static const struct FtpCommand FTP_COMMANDS[] = {
     // ACCESS CONTROL COMMANDS: https://datatracker.ietf.org/doc/html/rfc959#section-4
-    { "USER", ftp_cmd_USER, 0, FTP_ARGS_REQUIRED },
-    { "PASS", ftp_cmd_PASS, 0, FTP_ARGS_REQUIRED },
-    { "ACCT", ftp_cmd_ACCT, 0, FTP_ARGS_REQUIRED },
-    { "CWD", ftp_cmd_CWD, 1, FTP_ARGS_REQUIRED },
-    { "CDUP", ftp_cmd_CDUP, 1, FTP_ARGS_NONE },
-    { "SMNT", ftp_cmd_SMNT, 1, FTP_ARGS_REQUIRED },
-    { "REIN", ftp_cmd_REIN, 0, FTP_ARGS_NONE },
-    { "QUIT", ftp_cmd_QUIT, 0, FTP_ARGS_NONE },
+    { "USER", ftp_cmd_USER, 0, FTP_ARGS_REQUIRED, 0 },
+    { "PASS", ftp_cmd_PASS, 0, FTP_ARGS_REQUIRED, 0 },
+    { "ACCT", ftp_cmd_ACCT, 0, FTP_ARGS_REQUIRED, 0 },
+    { "CWD", ftp_cmd_CWD, 1, FTP_ARGS_REQUIRED, 0 },
+    { "CDUP", ftp_cmd_CDUP, 1, FTP_ARGS_NONE, 0 },
+    { "SMNT", ftp_cmd_SMNT, 1, FTP_ARGS_REQUIRED, 0 },
+    { "REIN", ftp_cmd_REIN, 0, FTP_ARGS_NONE, 0 },
+    { "QUIT", ftp_cmd_QUIT, 0, FTP_ARGS_NONE, 0 },
 
     // TRANSFER PARAMETER COMMANDS
-    { "PORT", ftp_cmd_PORT, 1, FTP_ARGS_REQUIRED },
-    { "PASV", ftp_cmd_PASV, 1, FTP_ARGS_NONE },
-    { "TYPE", ftp_cmd_TYPE, 1, FTP_ARGS_REQUIRED },
-    { "STRU", ftp_cmd_STRU, 1, FTP_ARGS_REQUIRED },
-    { "MODE", ftp_cmd_MODE, 1, FTP_ARGS_REQUIRED },
+    { "PORT", ftp_cmd_PORT, 1, FTP_ARGS_REQUIRED, 0 },
+    { "PASV", ftp_cmd_PASV, 1, FTP_ARGS_NONE, 0 },
+    { "TYPE", ftp_cmd_TYPE, 1, FTP_ARGS_REQUIRED, 0 },
+    { "STRU", ftp_cmd_STRU, 1, FTP_ARGS_REQUIRED, 0 },
+    { "MODE", ftp_cmd_MODE, 1, FTP_ARGS_REQUIRED, 0 },
 
     // FTP SERVICE COMMANDS
-    { "RETR", ftp_cmd_RETR, 1, FTP_ARGS_REQUIRED },
-    { "STOR", ftp_cmd_STOR, 1, FTP_ARGS_REQUIRED },
-    // { "STOU", ftp_cmd_STOU, 1, FTP_ARGS_NONE },
-    { "APPE", ftp_cmd_APPE, 1, FTP_ARGS_REQUIRED },
-    { "ALLO", ftp_cmd_ALLO, 1, FTP_ARGS_REQUIRED },
-    { "REST", ftp_cmd_REST, 1, FTP_ARGS_REQUIRED },
-    { "RNFR", ftp_cmd_RNFR, 1, FTP_ARGS_REQUIRED },
-    { "RNTO", ftp_cmd_RNTO, 1, FTP_ARGS_REQUIRED },
-    { "ABOR", ftp_cmd_ABOR, 0, FTP_ARGS_NONE },
-    { "DELE", ftp_cmd_DELE, 1, FTP_ARGS_REQUIRED },
-    { "RMD", ftp_cmd_RMD, 1, FTP_ARGS_REQUIRED },
-    { "MKD", ftp_cmd_MKD, 1, FTP_ARGS_REQUIRED },
-    { "PWD", ftp_cmd_PWD, 1, FTP_ARGS_NONE },
-    { "LIST", ftp_cmd_LIST, 1, FTP_ARGS_OPTIONAL },
-    { "NLST", ftp_cmd_NLST, 1, FTP_ARGS_OPTIONAL },
-    { "SITE", ftp_cmd_SITE, 1, FTP_ARGS_REQUIRED },
-    { "SYST", ftp_cmd_SYST, 0, FTP_ARGS_NONE },
-    { "STAT", ftp_cmd_STAT, 1, FTP_ARGS_OPTIONAL },
-    { "HELP", ftp_cmd_HELP, 0, FTP_ARGS_OPTIONAL },
-    { "NOOP", ftp_cmd_NOOP, 0, FTP_ARGS_NONE },
+    { "RETR", ftp_cmd_RETR, 1, FTP_ARGS_REQUIRED, 1 },
+    { "STOR", ftp_cmd_STOR, 1, FTP_ARGS_REQUIRED, 1 },
+    // { "STOU", ftp_cmd_STOU, 1, FTP_ARGS_NONE, 0 },
+    { "APPE", ftp_cmd_APPE, 1, FTP_ARGS_REQUIRED, 1 },
+    { "ALLO", ftp_cmd_ALLO, 1, FTP_ARGS_REQUIRED, 0 },
+    { "REST", ftp_cmd_REST, 1, FTP_ARGS_REQUIRED, 0 },
+    { "RNFR", ftp_cmd_RNFR, 1, FTP_ARGS_REQUIRED, 1 },
+    { "RNTO", ftp_cmd_RNTO, 1, FTP_ARGS_REQUIRED, 1 },
+    { "ABOR", ftp_cmd_ABOR, 0, FTP_ARGS_NONE, 0 },
+    { "DELE", ftp_cmd_DELE, 1, FTP_ARGS_REQUIRED, 0 },
+    { "RMD", ftp_cmd_RMD, 1, FTP_ARGS_REQUIRED, 0 },
+    { "MKD", ftp_cmd_MKD, 1, FTP_ARGS_REQUIRED, 0 },
+    { "PWD", ftp_cmd_PWD, 1, FTP_ARGS_NONE, 0 },
+    { "LIST", ftp_cmd_LIST, 1, FTP_ARGS_OPTIONAL, 1 },
+    { "NLST", ftp_cmd_NLST, 1, FTP_ARGS_OPTIONAL, 1 },
+    { "SITE", ftp_cmd_SITE, 1, FTP_ARGS_REQUIRED, 0 },
+    { "SYST", ftp_cmd_SYST, 0, FTP_ARGS_NONE, 0 },
+    { "STAT", ftp_cmd_STAT, 1, FTP_ARGS_OPTIONAL, 0 },
+    { "HELP", ftp_cmd_HELP, 0, FTP_ARGS_OPTIONAL, 0 },
+    { "NOOP", ftp_cmd_NOOP, 0, FTP_ARGS_NONE, 0 },
 
     // extensions
-    { "FEAT", ftp_cmd_FEAT, 0, FTP_ARGS_NONE },
-    { "SIZE", ftp_cmd_SIZE, 1, FTP_ARGS_REQUIRED },
+    { "FEAT", ftp_cmd_FEAT, 0, FTP_ARGS_NONE, 0 },
+    { "SIZE", ftp_cmd_SIZE, 1, FTP_ARGS_REQUIRED, 0 },
+    { "RANG", ftp_cmd_RANG, 1, FTP_ARGS_REQUIRED, 0 },
+    { "OPTS", ftp_cmd_OPTS, 1, FTP_ARGS_REQUIRED, 0 },
+    { "HASH", ftp_cmd_HASH, 1, FTP_ARGS_REQUIRED, 1 },
+    { "XCRC", ftp_cmd_XCRC, 1, FTP_ARGS_REQUIRED, 1 },
+    { "XMD5", ftp_cmd_XMD5, 1, FTP_ARGS_REQUIRED, 1 },
+    { "AUTH", ftp_cmd_AUTH, 0, FTP_ARGS_REQUIRED, 0 },
+    { "PBSZ", ftp_cmd_PBSZ, 0, FTP_ARGS_REQUIRED, 0 },
+    { "PROT", ftp_cmd_PROT, 0, FTP_ARGS_REQUIRED, 0 },
 };
 
 static int ftp_session_init(struct FtpSession* session) {
@@ -1302,7 +6805,11 @@ static int ftp_session_init(struct FtpSession* session) {
         session->active = 1;
         session->control_sock = control_sock;
         session->data_connection = FTP_DATA_CONNECTION_NONE;
+        // files are sent as is until the client asks for TYPE A, as clients that never send TYPE expect.
+        session->type = FTP_TYPE_IMAGE;
         session->control_sockaddr = sa;
+        session->peer_sockaddr = sa;
+        ftp_rate_limit_ip_acquire(session, sa.sin_addr);
         addr_len = sizeof(session->control_sockaddr);
         socket_getsockname(session->control_sock, (struct sockaddr*)&session->control_sockaddr, &addr_len);
         strcpy(session->pwd.s, "/");
@@ -1316,14 +6823,33 @@ static int ftp_session_init(struct FtpSession* session) {
 
 static void ftp_session_close(struct FtpSession* session) {
     if (session->active) {
+#if FTP_TLS
+        ftp_tls_close(&session->control_tls, session->control_sock);
+#endif
         ftp_close_socket(&session->control_sock);
+        if (session->transfer && ftp_data_transfer_is_local(session)) {
+            ftp_local_transfer_end(session);
+        }
         ftp_data_transfer_end(session);
+        session->path_pending = FTP_PATH_PENDING_NONE;
+        ftp_transfer_release(session);
+        ftp_rate_limit_ip_release(session);
         memset(session, 0, sizeof(*session));
         g_ftp.session_count--;
         // printf("closing session, count: %d\n", g_ftp.session_count);
     }
 }
 
+// returns true if the command can be run whilst a transfer is in progress. ABOR ends
+// the transfer, the others don't depend on it. line may not be null terminated!
+static bool ftp_cmd_runs_during_transfer(const char* line, int line_len) {
+    if (!strncasecmp(line, "STAT", 4)) {
+        // with a pathname it's a listing, which waits for the transfer like LIST does.
+        return !memchr(line + 4, ' ', line_len - 4);
+    }
+    return !strncasecmp(line, "ABOR", 4) || !strncasecmp(line, "NOOP", 4) || !strncasecmp(line, "SIZE", 4);
+}
+
 // line may not be null terminated!
 static void ftp_session_progress_line(struct FtpSession* session, const char* line, int line_len) {
     char cmd_name[5] = {0};
@@ -1349,9 +6875,11 @@ static void ftp_session_progress_line(struct FtpSession* session, const char* li
             if (cmd->auth_required && session->auth_mode != FTP_AUTH_MODE_VALID) {
                 ftp_client_msg(session, "530 Not logged in.");
             } else {
-                // data transfers are async, but only abort cmd is allowed.
-                if (session->transfer.mode != FTP_TRANSFER_MODE_NONE && strcasecmp(cmd->name, "ABOR")) {
+                // data transfers are async, only commands that don't depend on them are allowed.
+                if (ftp_transfer_mode(session) != FTP_TRANSFER_MODE_NONE && !ftp_cmd_runs_during_transfer(line, line_len)) {
                     ftp_client_msg(session, "501 Syntax error in parameters or arguments.");
+                } else if (cmd->transfer_required && !ftp_cmd_transfer_acquire(session)) {
+                    // replied to by ftp_cmd_transfer_acquire().
                 } else {
                     const char* cmd_args = memchr(line + strlen(cmd->name), ' ', line_len - strlen(cmd->name));
                     if (cmd_args) {
@@ -1372,12 +6900,144 @@ static void ftp_session_progress_line(struct FtpSession* session, const char* li
             }
         }
     }
+
+    ftp_transfer_release(session);
+}
+
+// commands received during a transfer are queued and run in order once it ends, so that the
+// replies are in order too. the ones that can run during a transfer only skip the queue if
+// nothing is waiting in it. line may not be null terminated!
+static void ftp_session_recv_line(struct FtpSession* session, const char* line, int line_len) {
+#if FTP_CMD_QUEUE_SIZE
+    const bool busy = ftp_transfer_mode(session) != FTP_TRANSFER_MODE_NONE;
+    if (busy && session->cmd_queue_len && !strncasecmp(line, "ABOR", 4)) {
+        // the transfer is ended now, the reply to ABOR comes after the replies to the commands queued before it.
+        ftp_data_transfer_abort(session);
+    }
+
+    if (session->cmd_queue_len || (busy && !ftp_cmd_runs_during_transfer(line, line_len))) {
+        if (session->cmd_queue_len + line_len >= sizeof(session->cmd_queue)) {
+            ftp_client_msg(session, "501 Syntax error in parameters or arguments, too many commands queued.");
+        } else {
+            memcpy(session->cmd_queue + session->cmd_queue_len, line, line_len);
+            session->cmd_queue_len += line_len;
+            session->cmd_queue[session->cmd_queue_len] = '\0';
+        }
+        return;
+    }
+#endif
+
+    ftp_session_progress_line(session, line, line_len);
+}
+
+#if FTP_CMD_QUEUE_SIZE
+// runs the commands queued during the last transfer, stopping if one of them starts another.
+static void ftp_session_run_queue(struct FtpSession* session) {
+    while (session->active && session->cmd_queue_len && ftp_transfer_mode(session) == FTP_TRANSFER_MODE_NONE) {
+        char line[FTP_CMD_QUEUE_SIZE];
+        const char* end_line = strstr(session->cmd_queue, TELNET_EOL);
+        const size_t line_len = end_line + strlen(TELNET_EOL) - session->cmd_queue;
+        memcpy(line, session->cmd_queue, line_len);
+        line[line_len] = '\0';
+
+        session->cmd_queue_len -= line_len;
+        memmove(session->cmd_queue, session->cmd_queue + line_len, session->cmd_queue_len + 1);
+        ftp_session_progress_line(session, line, line_len);
+    }
+}
+#endif
+
+#if FTP_TLS
+// returns true if the control connection is polled for writing, for the server's part
+// of the handshake or for the replies that the socket didn't take.
+static bool ftp_session_wants_write(const struct FtpSession* session) {
+    const struct FtpTls* tls = &session->control_tls;
+    if (!tls->ssl) {
+        return false;
+    } else if (!tls->ready) {
+        return tls->want_write;
+    }
+    return tls->bio && BIO_ctrl_pending(tls->bio);
+}
+
+// returns true if the control connection is waiting on the handshake or the socket.
+static bool ftp_session_is_waiting(const struct FtpSession* session) {
+    return session->control_tls.ssl && (!session->control_tls.ready || ftp_session_wants_write(session));
+}
+
+// carries on with the handshake or sends the replies that are queued once the socket is
+// ready, and closes the session if it has been waiting for longer than tls_timeout_ms.
+static void ftp_session_flush(struct FtpSession* session, bool ready) {
+    struct FtpTls* tls = &session->control_tls;
+    if (session->control_dropped) {
+        ftp_session_close(session);
+        return;
+    } else if (ready && !tls->ready && ftp_tls_handshake(tls) < 0) {
+        ftp_session_close(session);
+        return;
+    } else if (ready && tls->ready && ftp_tls_flush(tls, session->control_sock) < 0 && errno != EWOULDBLOCK && errno != EAGAIN) {
+        ftp_session_close(session);
+        return;
+    }
+
+    const unsigned long long now = ftp_get_time_ms();
+    if (!ftp_session_is_waiting(session)) {
+        session->control_wait_ms = 0;
+    } else if (!session->control_wait_ms) {
+        session->control_wait_ms = now;
+    } else if (now - session->control_wait_ms >= (unsigned)g_ftp.cfg.tls_timeout_ms) {
+        ftp_log_callback(FTP_API_LOG_TYPE_ERROR, "tls: timed out waiting for the control connection");
+        ftp_session_close(session);
+    }
+}
+
+// shortens the timeout so that the loop wakes up once a control connection has waited too long,
+// the wait starts now for the ones that started waiting since the last time.
+static int ftp_session_timeout(int timeout_ms) {
+    const unsigned long long now = ftp_get_time_ms();
+    for (size_t i = 0; i < g_ftp.cfg.max_sessions; i++) {
+        struct FtpSession* session = &g_ftp.sessions[i];
+        if (session->active && (ftp_session_is_waiting(session) || session->control_dropped)) {
+            if (!session->control_wait_ms) {
+                session->control_wait_ms = now;
+            }
+            const unsigned long long end = session->control_wait_ms + g_ftp.cfg.tls_timeout_ms;
+            const int wait = now < end && !session->control_dropped ? (int)(end - now) : 0;
+            if (timeout_ms < 0 || wait < timeout_ms) {
+                timeout_ms = wait;
+            }
+        }
+    }
+    return timeout_ms;
 }
+#endif
 
 static void ftp_session_poll(struct FtpSession* session) {
-    memset(g_ftp.data_buf, 0, sizeof(g_ftp.data_buf));
+#if FTP_TLS
+    struct FtpTls* tls = &session->control_tls;
+    if (tls->ssl && !tls->ready) {
+        // the rest of the handshake is sent by the loop once the socket is writable.
+        ftp_session_flush(session, true);
+        return;
+    }
+#endif
+
+    memset(g_ftp.data_buf, 0, g_ftp.cfg.file_buffer_size);
 
-    int rc = socket_recv(session->control_sock, g_ftp.data_buf, sizeof(g_ftp.data_buf) - 1, 0);
+#if FTP_TLS
+    int rc;
+    if (tls->ssl) {
+        rc = ftp_tls_recv(tls, session->control_sock, g_ftp.data_buf, g_ftp.cfg.file_buffer_size - 1);
+        // only part of a record has arrived.
+        if (rc < 0 && (errno == EWOULDBLOCK || errno == EAGAIN)) {
+            return;
+        }
+    } else {
+        rc = socket_recv(session->control_sock, g_ftp.data_buf, g_ftp.cfg.file_buffer_size - 1, 0);
+    }
+#else
+    int rc = socket_recv(session->control_sock, g_ftp.data_buf, g_ftp.cfg.file_buffer_size - 1, 0);
+#endif
     if (rc < 0) {
         // printf("closing session due to recv error\n");
         ftp_session_close(session);
@@ -1395,10 +7055,122 @@ static void ftp_session_poll(struct FtpSession* session) {
             }
 
             // printf("got recv %.*s\n", line_len - 2, line);
-            ftp_session_progress_line(session, line, line_len);
+            ftp_session_recv_line(session, line, line_len);
             line_offset += line_len;
+#if FTP_TLS
+            // anything sent along with AUTH came in the clear, so it isn't run as if it came over TLS.
+            if ((tls->ssl && !tls->ready) || session->control_dropped) {
+                break;
+            }
+#endif
+        }
+    }
+}
+
+// fills in the limits and sizes the config left unset with the defaults.
+static void ftp_config_defaults(struct FtpSrvConfig* cfg) {
+    if (!cfg->max_sessions) {
+        cfg->max_sessions = FTP_MAX_SESSIONS;
+    }
+    if (!cfg->file_buffer_size) {
+        cfg->file_buffer_size = FTP_FILE_BUFFER_SIZE;
+    }
+    // commands are received into the buffer too, so it has to fit a whole line.
+    if (cfg->file_buffer_size < FTP_PATHNAME_SIZE * 2) {
+        cfg->file_buffer_size = FTP_PATHNAME_SIZE * 2;
+    }
+    // kept a multiple of the alignment, as reads using O_DIRECT have to be.
+    cfg->file_buffer_size = (cfg->file_buffer_size + FTP_FILE_BUFFER_ALIGNMENT - 1) / FTP_FILE_BUFFER_ALIGNMENT * FTP_FILE_BUFFER_ALIGNMENT;
+    if (!cfg->max_transfers) {
+        cfg->max_transfers = FTP_MAX_TRANSFERS;
+    }
+    if (!cfg->max_transfers || cfg->max_transfers > cfg->max_sessions) {
+        cfg->max_transfers = cfg->max_sessions;
+    }
+    if (!cfg->backlog) {
+        cfg->backlog = FTP_LISTEN_BACKLOG;
+    }
+    if (!cfg->data_timeout_ms) {
+        cfg->data_timeout_ms = FTP_DATA_OPEN_WAIT_MS;
+    }
+    if (!cfg->tls_timeout_ms) {
+        cfg->tls_timeout_ms = FTP_TLS_WAIT_MS;
+    }
+}
+
+#if defined(HAVE_POLL) && HAVE_POLL
+// server socket + control and data socket per session + striped data connections + io threads pipe.
+static size_t ftp_poll_fd_count(size_t max_sessions) {
+    return 1 + max_sessions * 2 + FTP_STRIPE_COUNT + (FTP_IO_THREADS ? 1 : 0);
+}
+#endif
+
+// returns the offset of the next size bytes of memory, aligned to align.
+static size_t ftp_memory_reserve(size_t* offset, size_t size, size_t align) {
+    const size_t start = (*offset + align - 1) / align * align;
+    *offset = start + size;
+    return start;
+}
+
+// works out where the sessions and buffers go in memory that starts at an aligned
+// address, filling in the pointers if base is set. returns the size needed.
+static size_t ftp_memory_layout(const struct FtpSrvConfig* cfg, unsigned char* base) {
+    size_t offset = 0;
+    const size_t data_buf = ftp_memory_reserve(&offset, cfg->file_buffer_size, FTP_FILE_BUFFER_ALIGNMENT);
+    const size_t sessions = ftp_memory_reserve(&offset, sizeof(struct FtpSession) * cfg->max_sessions, 64);
+    const size_t ip_rate_limits = ftp_memory_reserve(&offset, sizeof(struct FtpRateLimitIp) * cfg->max_sessions, 64);
+    const size_t transfers = ftp_memory_reserve(&offset, sizeof(struct FtpTransfer) * cfg->max_transfers, 64);
+    const size_t transfer_free = ftp_memory_reserve(&offset, sizeof(struct FtpTransfer*) * cfg->max_transfers, 64);
+#if defined(HAVE_POLL) && HAVE_POLL
+    const size_t fds = ftp_memory_reserve(&offset, sizeof(struct pollfd) * ftp_poll_fd_count(cfg->max_sessions), 64);
+#endif
+
+    if (base) {
+        g_ftp.data_buf = base + data_buf;
+        g_ftp.sessions = (struct FtpSession*)(base + sessions);
+        g_ftp.ip_rate_limits = (struct FtpRateLimitIp*)(base + ip_rate_limits);
+        g_ftp.transfers = (struct FtpTransfer*)(base + transfers);
+        g_ftp.transfer_free = (struct FtpTransfer**)(base + transfer_free);
+#if defined(HAVE_POLL) && HAVE_POLL
+        g_ftp.fds = (struct pollfd*)(base + fds);
+#endif
+    }
+
+    return offset;
+}
+
+size_t ftpsrv_memory_size(const struct FtpSrvConfig* cfg) {
+    struct FtpSrvConfig c = *cfg;
+    ftp_config_defaults(&c);
+    // room to align the start of the arena.
+    return ftp_memory_layout(&c, NULL) + FTP_FILE_BUFFER_ALIGNMENT - 1;
+}
+
+// sets up the sessions and buffers in the arena from the config, or allocates memory for them.
+static int ftp_memory_init(void) {
+    const size_t size = ftpsrv_memory_size(&g_ftp.cfg);
+    unsigned char* mem = g_ftp.cfg.arena;
+    if (mem && g_ftp.cfg.arena_size < size) {
+        errno = ENOMEM;
+        return -1;
+    } else if (!mem) {
+        mem = g_ftp.memory = malloc(size);
+        if (!mem) {
+            errno = ENOMEM;
+            return -1;
         }
     }
+
+    const size_t align = (FTP_FILE_BUFFER_ALIGNMENT - (uintptr_t)mem % FTP_FILE_BUFFER_ALIGNMENT) % FTP_FILE_BUFFER_ALIGNMENT;
+    memset(mem, 0, size);
+    ftp_memory_layout(&g_ftp.cfg, mem + align);
+
+    // handed out lowest first.
+    while (g_ftp.transfer_free_count < g_ftp.cfg.max_transfers) {
+        g_ftp.transfer_free[g_ftp.transfer_free_count] = &g_ftp.transfers[g_ftp.cfg.max_transfers - 1 - g_ftp.transfer_free_count];
+        g_ftp.transfer_free_count++;
+    }
+    return 0;
 }
 
 int ftpsrv_init(const struct FtpSrvConfig* cfg) {
@@ -1409,7 +7181,19 @@ int ftpsrv_init(const struct FtpSrvConfig* cfg) {
     } else {
         memset(&g_ftp, 0, sizeof(g_ftp));
         memcpy(&g_ftp.cfg, cfg, sizeof(*cfg));
+        ftp_config_defaults(&g_ftp.cfg);
+        if (ftp_memory_init() < 0) {
+            return -1;
+        }
+
         g_ftp.initialised = 1;
+#if FTP_IO_THREADS
+        ftp_io_init();
+#endif
+#if FTP_TLS
+        ftp_tls_init();
+#endif
+        ftp_pasv_init();
 
         rc = g_ftp.server_sock = socket_open(PF_INET, SOCK_STREAM, 0);
         if (rc < 0) {
@@ -1428,7 +7212,7 @@ int ftpsrv_init(const struct FtpSrvConfig* cfg) {
             rc = socket_bind(g_ftp.server_sock, (struct sockaddr*)&sa, sizeof(sa));
             if (rc < 0) {
             } else {
-                rc = socket_listen(g_ftp.server_sock, 5); /* SOMAXCONN */
+                rc = socket_listen(g_ftp.server_sock, g_ftp.cfg.backlog);
             }
         }
     }
@@ -1442,8 +7226,9 @@ int ftpsrv_loop(int timeout_ms) {
         return FTP_API_LOOP_ERROR_INIT;
     }
 
-    static struct pollfd fds[1 + FTP_MAX_SESSIONS * 2] = {0};
-    const nfds_t nfds = FTP_ARR_SZ(fds);
+    // server socket + control and data socket per session + striped data connections + io threads pipe.
+    struct pollfd* fds = g_ftp.fds;
+    const nfds_t nfds = ftp_poll_fd_count(g_ftp.cfg.max_sessions);
 
     // initialise fds.
     for (size_t i = 0; i < nfds; i++) {
@@ -1456,34 +7241,87 @@ int ftpsrv_loop(int timeout_ms) {
     fds[0].events = POLLIN | POLLPRI;
 
     // add each session control and data socket.
-    for (size_t i = 0; i < FTP_ARR_SZ(g_ftp.sessions); i++) {
+    for (size_t i = 0; i < g_ftp.cfg.max_sessions; i++) {
         const size_t si = 1 + i * 2;
         const size_t sd = 1 + i * 2 + 1;
-        const struct FtpSession* session = &g_ftp.sessions[i];
+        struct FtpSession* session = &g_ftp.sessions[i];
 
         if (session->active) {
             fds[si].fd = session->control_sock;
             fds[si].events = POLLIN | POLLPRI;
+#if FTP_TLS
+            // no more commands are read until the replies queued so far have been sent.
+            if (ftp_session_wants_write(session)) {
+                fds[si].events = POLLOUT;
+            }
+#endif
 
-            if (session->transfer.mode != FTP_TRANSFER_MODE_NONE) {
-                fds[sd].fd = session->data_sock;
-                if (session->transfer.mode == FTP_TRANSFER_MODE_STOR) {
+            if (ftp_transfer_mode(session) != FTP_TRANSFER_MODE_NONE && ftp_data_transfer_wants_io(session)) {
+                fds[sd].fd = ftp_data_transfer_sock(session);
+                if (ftp_data_transfer_wants_read(session, fds[sd].fd)) {
                     fds[sd].events = POLLIN;
                 } else {
                     fds[sd].events = POLLOUT;
                 }
+            } else if (ftp_transfer_mode(session) == FTP_TRANSFER_MODE_NONE) {
+                // the data connection is made while waiting for the transfer command.
+                bool write;
+                fds[sd].fd = ftp_data_early_sock(session, &write);
+                fds[sd].events = write ? POLLOUT : POLLIN;
+            }
+        }
+    }
+
+#if FTP_STRIPE_COUNT
+    // add the striped data connections after the sessions.
+    for (size_t i = 0; i < FTP_ARR_SZ(g_ftp.stripes); i++) {
+        const struct FtpStripe* stripe = &g_ftp.stripes[i];
+        struct pollfd* stripe_fd = &fds[1 + g_ftp.cfg.max_sessions * 2 + i];
+
+        if (stripe->session && ftp_stripe_wants_io(stripe) && ftp_data_transfer_wants_io(stripe->session)) {
+            stripe_fd->fd = stripe->sock;
+            if (stripe->session->transfer->mode == FTP_TRANSFER_MODE_STOR) {
+                stripe_fd->events = POLLIN;
+            } else {
+                stripe_fd->events = POLLOUT;
             }
         }
     }
+#endif
+
+#if FTP_IO_THREADS
+    // add the io threads completion pipe to the last entry.
+    struct pollfd* io_fd = &fds[nfds - 1];
+    if (g_ftp.io.started) {
+        io_fd->fd = g_ftp.io.pipe_fds[0];
+        io_fd->events = POLLIN;
+    }
+#endif
 
-    const int rc = socket_poll(fds, nfds, timeout_ms);
+#if FTP_TLS
+    timeout_ms = ftp_session_timeout(timeout_ms);
+#endif
+    const int rc = socket_poll(fds, nfds, ftp_data_transfer_timeout(timeout_ms));
     if (rc < 0) {
         return FTP_API_LOOP_ERROR_INIT;
     } else {
+#if FTP_IO_THREADS
+        if (io_fd->revents & POLLIN) {
+            ftp_io_poll();
+        }
+#endif
+#if FTP_STRIPE_COUNT
+        for (size_t i = 0; i < FTP_ARR_SZ(g_ftp.stripes); i++) {
+            if (g_ftp.stripes[i].session && fds[1 + g_ftp.cfg.max_sessions * 2 + i].revents) {
+                g_ftp.stripes[i].session->transfer->stripe_ready = 1;
+            }
+        }
+#endif
+
         if (fds[0].revents & (POLLERR | POLLHUP | POLLNVAL)) {
             return FTP_API_LOOP_ERROR_INIT;
         } else if (fds[0].revents & (POLLIN | POLLPRI)) {
-            for (size_t i = 0; i < FTP_ARR_SZ(g_ftp.sessions); i++) {
+            for (size_t i = 0; i < g_ftp.cfg.max_sessions; i++) {
                 if (!g_ftp.sessions[i].active) {
                     ftp_session_init(&g_ftp.sessions[i]);
                     break;
@@ -1491,22 +7329,53 @@ int ftpsrv_loop(int timeout_ms) {
             }
         }
 
-        for (size_t i = 0; i < FTP_ARR_SZ(g_ftp.sessions); i++) {
-            const size_t si = 1 + i * 2;
-            const size_t sd = 1 + i * 2 + 1;
-            struct FtpSession* session = &g_ftp.sessions[i];
+        // commands and listings are serviced in the first pass and bulk
+        // transfers in the second. each pass starts after the session that
+        // was serviced first last time, so that low indexes aren't favoured.
+        for (int bulk = 0; bulk < 2; bulk++) {
+            const size_t start = g_ftp.sched_start[bulk] % g_ftp.cfg.max_sessions;
+            bool first = true;
+            for (size_t j = 0; j < g_ftp.cfg.max_sessions; j++) {
+                const size_t i = (start + j) % g_ftp.cfg.max_sessions;
+                const size_t si = 1 + i * 2;
+                const size_t sd = 1 + i * 2 + 1;
+                struct FtpSession* session = &g_ftp.sessions[i];
+
+                if (!bulk) {
+                    // handled before the commands, so that a transfer command that came in with the connection finds it.
+                    if (session->active && ftp_transfer_mode(session) == FTP_TRANSFER_MODE_NONE && fds[sd].revents) {
+                        ftp_data_early_progress(session);
+                        fds[sd].revents = 0;
+                    }
 
-            if (fds[si].revents & (POLLERR | POLLHUP)) {
-                ftp_session_close(session);
-            } else if (fds[si].revents & (POLLIN | POLLPRI)) {
-                ftp_session_poll(session);
-            }
+                    if (fds[si].revents & (POLLERR | POLLHUP)) {
+                        ftp_session_close(session);
+                    } else {
+#if FTP_TLS
+                        if (session->active && session->control_tls.ssl) {
+                            ftp_session_flush(session, fds[si].revents & POLLOUT);
+                        }
+#endif
+                        if (session->active && (fds[si].revents & (POLLIN | POLLPRI))) {
+                            ftp_session_poll(session);
+                        }
+                    }
+                }
 
-            // don't close data transfer on error as it will confuse the client (ffmpeg)
-            if (session->active && session->transfer.mode != FTP_TRANSFER_MODE_NONE) {
-                if (fds[sd].revents & (POLLIN | POLLOUT)) {
-                    ftp_data_transfer_progress(session);
+                // don't close data transfer on error as it will confuse the client (ffmpeg)
+                if (session->active && ftp_transfer_mode(session) != FTP_TRANSFER_MODE_NONE && ftp_data_transfer_is_bulk(session) == bulk) {
+                    if ((fds[sd].revents & (POLLIN | POLLOUT)) || ftp_data_transfer_is_ready(session)) {
+                        if (first) {
+                            g_ftp.sched_start[bulk] = i + 1;
+                            first = false;
+                        }
+                        ftp_data_transfer_progress(session);
+                    }
                 }
+#if FTP_CMD_QUEUE_SIZE
+                ftp_session_run_queue(session);
+#endif
+                ftp_transfer_release(session);
             }
         }
     }
@@ -1535,22 +7404,59 @@ int ftpsrv_loop(int timeout_ms) {
     FD_SET_HELPER(nfds, g_ftp.server_sock, &rfds);
 
     // add each session control and data socket.
-    for (size_t i = 0; i < FTP_ARR_SZ(g_ftp.sessions); i++) {
-        const struct FtpSession* session = &g_ftp.sessions[i];
+    for (size_t i = 0; i < g_ftp.cfg.max_sessions; i++) {
+        struct FtpSession* session = &g_ftp.sessions[i];
 
         if (session->active) {
+#if FTP_TLS
+            // no more commands are read until the replies queued so far have been sent.
+            if (ftp_session_wants_write(session)) {
+                FD_SET_HELPER(nfds, session->control_sock, &wfds);
+            } else {
+                FD_SET_HELPER(nfds, session->control_sock, &rfds);
+            }
+#else
             FD_SET_HELPER(nfds, session->control_sock, &rfds);
-            if (session->transfer.mode != FTP_TRANSFER_MODE_NONE) {
-                if (session->transfer.mode == FTP_TRANSFER_MODE_STOR) {
-                    FD_SET_HELPER(nfds, session->data_sock, &rfds);
-                } else {
-                    FD_SET_HELPER(nfds, session->data_sock, &wfds);
+#endif
+            if (ftp_transfer_mode(session) != FTP_TRANSFER_MODE_NONE) {
+                const int data_sock = ftp_data_transfer_sock(session);
+                if (data_sock > 0 && ftp_data_transfer_wants_io(session)) {
+                    if (ftp_data_transfer_wants_read(session, data_sock)) {
+                        FD_SET_HELPER(nfds, data_sock, &rfds);
+                    } else {
+                        FD_SET_HELPER(nfds, data_sock, &wfds);
+                    }
                 }
+            } else {
+                // the data connection is made while waiting for the transfer command.
+                bool write;
+                const int early_sock = ftp_data_early_sock(session, &write);
+                if (early_sock > 0) {
+                    FD_SET_HELPER(nfds, early_sock, write ? &wfds : &rfds);
+                }
+            }
+        }
+    }
+
+#if FTP_STRIPE_COUNT
+    // add the striped data connections.
+    for (size_t i = 0; i < FTP_ARR_SZ(g_ftp.stripes); i++) {
+        const struct FtpStripe* stripe = &g_ftp.stripes[i];
+        if (stripe->session && ftp_stripe_wants_io(stripe) && ftp_data_transfer_wants_io(stripe->session)) {
+            if (stripe->session->transfer->mode == FTP_TRANSFER_MODE_STOR) {
+                FD_SET_HELPER(nfds, stripe->sock, &rfds);
+            } else {
+                FD_SET_HELPER(nfds, stripe->sock, &wfds);
             }
         }
     }
+#endif
 
     // if -1, then set tvp to NULL to wait forever.
+#if FTP_TLS
+    timeout_ms = ftp_session_timeout(timeout_ms);
+#endif
+    timeout_ms = ftp_data_transfer_timeout(timeout_ms);
     struct timeval tv;
     struct timeval* tvp = NULL;
     if (timeout_ms >= 0) {
@@ -1559,14 +7465,35 @@ int ftpsrv_loop(int timeout_ms) {
         tv.tv_usec = (timeout_ms % 1000) * 1000;
     }
 
+#if FTP_IO_THREADS
+    // add the io threads completion pipe.
+    if (g_ftp.io.started) {
+        FD_SET_HELPER(nfds, g_ftp.io.pipe_fds[0], &rfds);
+    }
+#endif
+
     const int rc = socket_select(nfds + 1, &rfds, &wfds, &efds, tvp);
     if (rc < 0) {
         return FTP_API_LOOP_ERROR_INIT;
     } else {
+#if FTP_IO_THREADS
+        if (g_ftp.io.started && FD_ISSET(g_ftp.io.pipe_fds[0], &rfds)) {
+            ftp_io_poll();
+        }
+#endif
+#if FTP_STRIPE_COUNT
+        for (size_t i = 0; i < FTP_ARR_SZ(g_ftp.stripes); i++) {
+            const struct FtpStripe* stripe = &g_ftp.stripes[i];
+            if (stripe->session && stripe->sock > 0 && (FD_ISSET(stripe->sock, &rfds) || FD_ISSET(stripe->sock, &wfds) || FD_ISSET(stripe->sock, &efds))) {
+                stripe->session->transfer->stripe_ready = 1;
+            }
+        }
+#endif
+
         if (FD_ISSET(g_ftp.server_sock, &efds)) {
             return FTP_API_LOOP_ERROR_INIT;
         } else if (FD_ISSET(g_ftp.server_sock, &rfds)) {
-            for (size_t i = 0; i < FTP_ARR_SZ(g_ftp.sessions); i++) {
+            for (size_t i = 0; i < g_ftp.cfg.max_sessions; i++) {
                 if (!g_ftp.sessions[i].active) {
                     ftp_session_init(&g_ftp.sessions[i]);
                     break;
@@ -1574,20 +7501,55 @@ int ftpsrv_loop(int timeout_ms) {
             }
         }
 
-        for (size_t i = 0; i < FTP_ARR_SZ(g_ftp.sessions); i++) {
-            struct FtpSession* session = &g_ftp.sessions[i];
+        // commands and listings are serviced in the first pass and bulk
+        // transfers in the second. each pass starts after the session that
+        // was serviced first last time, so that low indexes aren't favoured.
+        for (int bulk = 0; bulk < 2; bulk++) {
+            const size_t start = g_ftp.sched_start[bulk] % g_ftp.cfg.max_sessions;
+            bool first = true;
+            for (size_t j = 0; j < g_ftp.cfg.max_sessions; j++) {
+                const size_t i = (start + j) % g_ftp.cfg.max_sessions;
+                struct FtpSession* session = &g_ftp.sessions[i];
+
+                if (!bulk) {
+                    // handled before the commands, so that a transfer command that came in with the connection finds it.
+                    if (session->active && ftp_transfer_mode(session) == FTP_TRANSFER_MODE_NONE) {
+                        bool write;
+                        const int early_sock = ftp_data_early_sock(session, &write);
+                        if (early_sock > 0 && (FD_ISSET(early_sock, &rfds) || FD_ISSET(early_sock, &wfds) || FD_ISSET(early_sock, &efds))) {
+                            ftp_data_early_progress(session);
+                        }
+                    }
 
-            if (FD_ISSET(session->control_sock, &efds)) {
-                ftp_session_close(session);
-            } else if (FD_ISSET(session->control_sock, &rfds)) {
-                ftp_session_poll(session);
-            }
+                    if (FD_ISSET(session->control_sock, &efds)) {
+                        ftp_session_close(session);
+                    } else {
+#if FTP_TLS
+                        if (session->active && session->control_tls.ssl) {
+                            ftp_session_flush(session, FD_ISSET(session->control_sock, &wfds));
+                        }
+#endif
+                        if (session->active && FD_ISSET(session->control_sock, &rfds)) {
+                            ftp_session_poll(session);
+                        }
+                    }
+                }
 
-            // don't close data transfer on error as it will confuse the client (ffmpeg)
-            if (session->active && session->transfer.mode != FTP_TRANSFER_MODE_NONE) {
-                if (FD_ISSET(session->data_sock, &rfds) || FD_ISSET(session->data_sock, &wfds)) {
-                    ftp_data_transfer_progress(session);
+                // don't close data transfer on error as it will confuse the client (ffmpeg)
+                if (session->active && ftp_transfer_mode(session) != FTP_TRANSFER_MODE_NONE && ftp_data_transfer_is_bulk(session) == bulk) {
+                    const int data_sock = ftp_data_transfer_sock(session);
+                    if ((data_sock > 0 && (FD_ISSET(data_sock, &rfds) || FD_ISSET(data_sock, &wfds))) || ftp_data_transfer_is_ready(session)) {
+                        if (first) {
+                            g_ftp.sched_start[bulk] = i + 1;
+                            first = false;
+                        }
+                        ftp_data_transfer_progress(session);
+                    }
                 }
+#if FTP_CMD_QUEUE_SIZE
+                ftp_session_run_queue(session);
+#endif
+                ftp_transfer_release(session);
             }
         }
     }
@@ -1601,12 +7563,21 @@ void ftpsrv_exit(void) {
         return;
     }
 
-    for (size_t i = 0; i < FTP_ARR_SZ(g_ftp.sessions); i++) {
+    for (size_t i = 0; i < g_ftp.cfg.max_sessions; i++) {
         if (g_ftp.sessions[i].active) {
             ftp_session_close(&g_ftp.sessions[i]);
         }
     }
 
+#if FTP_IO_THREADS
+    ftp_io_exit();
+#endif
+#if FTP_TLS
+    ftp_tls_exit();
+#endif
+    ftp_pasv_exit();
     ftp_close_socket(&g_ftp.server_sock);
+    free(g_ftp.memory);
+    g_ftp.memory = NULL;
     g_ftp.initialised = 0;
 }
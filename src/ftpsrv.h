@@ -9,6 +9,8 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
+
 enum FTP_API_LOG_TYPE {
     FTP_API_LOG_TYPE_COMMAND,
     FTP_API_LOG_TYPE_RESPONSE,
@@ -20,6 +22,13 @@ enum FTP_API_LOOP_ERROR {
     FTP_API_LOOP_ERROR_INIT, // call ftpsrv_exit and ftpsrv_init again
 };
 
+enum FTP_API_CACHE_POLICY {
+    FTP_API_CACHE_POLICY_DEFAULT,     // leave it up to the os.
+    FTP_API_CACHE_POLICY_SEQUENTIAL,  // read ahead more aggressively.
+    FTP_API_CACHE_POLICY_DROP_BEHIND, // same as above, and drop the data from the cache once transferred.
+    FTP_API_CACHE_POLICY_DIRECT,      // bypass the cache (O_DIRECT), falls back to drop behind.
+};
+
 struct FtpSrvDevice {
     char mount[32];
 };
@@ -39,6 +48,41 @@ struct FtpSrvConfig {
     // if set, an account is required for storing files.
     unsigned char write_account_required;
 
+    // page cache policy for transfers, only used for files that are
+    // at least cache_threshold bytes so that small files stay cached.
+    enum FTP_API_CACHE_POLICY cache_policy;
+    unsigned long long cache_threshold;
+
+    // bandwidth limits in bytes per second, 0 = unlimited.
+    unsigned long long rate_limit;         // shared by all sessions.
+    unsigned long long session_rate_limit; // per session.
+    unsigned long long ip_rate_limit;      // shared by all sessions from the same address.
+
+    // range of ports PASV listens on, 0 = 49152 / 65535.
+    unsigned pasv_port_min;
+    unsigned pasv_port_max;
+
+    // deflate level used for MODE Z, 1 (fastest) to 9 (smallest), 0 = zlib default.
+    int compression_level;
+
+    // PEM certificate chain and private key for AUTH TLS, TLS is off if the certificate isn't set.
+    // the key may be left unset if it's in the certificate file.
+    const char* tls_cert;
+    const char* tls_key;
+
+    // limits and sizes, 0 = the default the server was built with.
+    unsigned max_sessions;   // number of clients that can be connected at once.
+    unsigned max_transfers;  // number of sessions that can be running a command or transfer at once.
+    size_t file_buffer_size; // size of the buffer file data is moved through.
+    unsigned backlog;        // connections waiting to be accepted by the server socket.
+    int data_timeout_ms;     // how long a transfer waits for its data connection to be made.
+    int tls_timeout_ms;      // how long a stalled TLS handshake or queued replies are kept before the session is closed.
+
+    // memory for the sessions and buffers, malloc is used if this isn't set.
+    // ftpsrv_memory_size() gives the size needed, ftpsrv_init() fails if it's too small.
+    void* arena;
+    size_t arena_size;
+
     const struct FtpSrvDevice* devices;
     unsigned devices_count;
 
@@ -47,6 +91,7 @@ struct FtpSrvConfig {
 };
 
 int ftpsrv_init(const struct FtpSrvConfig* cfg);
+size_t ftpsrv_memory_size(const struct FtpSrvConfig* cfg);
 int ftpsrv_loop(int timeout_ms);
 void ftpsrv_exit(void);
 
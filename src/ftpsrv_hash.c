@@ -0,0 +1,542 @@
+/**
+ * Copyright 2024 TotalJustice.
+ * SPDX-License-Identifier: MIT
+ */
+#include "ftpsrv_hash.h"
+
+#include <string.h>
+
+// the sha extensions are used on arm if enabled at build time (the switch
+// has them), and on x86 if the cpu reports them at runtime.
+#if (defined(__ARM_FEATURE_SHA2) || defined(__ARM_FEATURE_CRYPTO)) && defined(__ARM_NEON)
+    #define FTP_HASH_ARM_SHA 1
+    #include <arm_neon.h>
+#elif (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+    #define FTP_HASH_X86_SHA 1
+    #include <immintrin.h>
+    #include <cpuid.h>
+#endif
+
+#if defined(__ARM_FEATURE_CRC32)
+    #define FTP_HASH_ARM_CRC32 1
+    #include <arm_acle.h>
+#elif defined(HAVE_ZLIB) && HAVE_ZLIB
+    // zlib's crc32 is faster than the table below on most builds.
+    #include <zlib.h>
+#endif
+
+static const char* FTP_HASH_NAMES[FtpHashType_COUNT] = {
+    [FtpHashType_SHA256] = "SHA-256",
+    [FtpHashType_SHA1] = "SHA-1",
+    [FtpHashType_MD5] = "MD5",
+    [FtpHashType_CRC32] = "CRC32",
+};
+
+static const size_t FTP_HASH_SIZES[FtpHashType_COUNT] = {
+    [FtpHashType_SHA256] = 32,
+    [FtpHashType_SHA1] = 20,
+    [FtpHashType_MD5] = 16,
+    [FtpHashType_CRC32] = 4,
+};
+
+static const uint32_t SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint32_t rol32(uint32_t v, int n) {
+    return (v << n) | (v >> (32 - n));
+}
+
+static inline uint32_t ror32(uint32_t v, int n) {
+    return (v >> n) | (v << (32 - n));
+}
+
+static inline uint32_t load_be32(const unsigned char* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline uint32_t load_le32(const unsigned char* p) {
+    return ((uint32_t)p[3] << 24) | ((uint32_t)p[2] << 16) | ((uint32_t)p[1] << 8) | p[0];
+}
+
+static void sha256_blocks_c(uint32_t state[8], const unsigned char* data, size_t blocks) {
+    for (; blocks--; data += 64) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+            w[i] = load_be32(data + i * 4);
+        }
+        for (int i = 16; i < 64; i++) {
+            const uint32_t s0 = ror32(w[i - 15], 7) ^ ror32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            const uint32_t s1 = ror32(w[i - 2], 17) ^ ror32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++) {
+            const uint32_t t1 = h + (ror32(e, 6) ^ ror32(e, 11) ^ ror32(e, 25)) + ((e & f) ^ (~e & g)) + SHA256_K[i] + w[i];
+            const uint32_t t2 = (ror32(a, 2) ^ ror32(a, 13) ^ ror32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+}
+
+static void sha1_blocks_c(uint32_t state[8], const unsigned char* data, size_t blocks) {
+    for (; blocks--; data += 64) {
+        uint32_t w[80];
+        for (int i = 0; i < 16; i++) {
+            w[i] = load_be32(data + i * 4);
+        }
+        for (int i = 16; i < 80; i++) {
+            w[i] = rol32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+        for (int i = 0; i < 80; i++) {
+            uint32_t f, k;
+            if (i < 20) {
+                f = (b & c) | (~b & d); k = 0x5A827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d; k = 0x6ED9EBA1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC;
+            } else {
+                f = b ^ c ^ d; k = 0xCA62C1D6;
+            }
+            const uint32_t t = rol32(a, 5) + f + e + k + w[i];
+            e = d; d = c; c = rol32(b, 30); b = a; a = t;
+        }
+
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d; state[4] += e;
+    }
+}
+
+static void md5_blocks_c(uint32_t state[8], const unsigned char* data, size_t blocks) {
+    static const uint32_t K[64] = {
+        0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+        0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+        0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+        0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+        0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+        0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+        0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+        0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+    };
+    static const unsigned char S[16] = { 7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21 };
+
+    for (; blocks--; data += 64) {
+        uint32_t m[16];
+        for (int i = 0; i < 16; i++) {
+            m[i] = load_le32(data + i * 4);
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        for (int i = 0; i < 64; i++) {
+            uint32_t f;
+            int g;
+            if (i < 16) {
+                f = (b & c) | (~b & d); g = i;
+            } else if (i < 32) {
+                f = (d & b) | (~d & c); g = (5 * i + 1) & 15;
+            } else if (i < 48) {
+                f = b ^ c ^ d; g = (3 * i + 5) & 15;
+            } else {
+                f = c ^ (b | ~d); g = (7 * i) & 15;
+            }
+            const uint32_t t = d;
+            d = c; c = b;
+            b = b + rol32(a + f + K[i] + m[g], S[(i >> 4) * 4 + (i & 3)]);
+            a = t;
+        }
+
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    }
+}
+
+#if FTP_HASH_ARM_SHA
+static void sha256_blocks_arm(uint32_t state[8], const unsigned char* data, size_t blocks) {
+    uint32x4_t state0 = vld1q_u32(&state[0]);
+    uint32x4_t state1 = vld1q_u32(&state[4]);
+
+    for (; blocks--; data += 64) {
+        const uint32x4_t abcd_save = state0;
+        const uint32x4_t efgh_save = state1;
+        uint32x4_t m[4];
+        for (int i = 0; i < 4; i++) {
+            m[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + i * 16)));
+        }
+
+        // 4 rounds at a time, the schedule for the next 4 is worked out alongside.
+        for (int i = 0; i < 16; i++) {
+            const uint32x4_t wk = vaddq_u32(m[i & 3], vld1q_u32(&SHA256_K[i * 4]));
+            if (i < 12) {
+                m[i & 3] = vsha256su1q_u32(vsha256su0q_u32(m[i & 3], m[(i + 1) & 3]), m[(i + 2) & 3], m[(i + 3) & 3]);
+            }
+            const uint32x4_t tmp = state0;
+            state0 = vsha256hq_u32(state0, state1, wk);
+            state1 = vsha256h2q_u32(state1, tmp, wk);
+        }
+
+        state0 = vaddq_u32(state0, abcd_save);
+        state1 = vaddq_u32(state1, efgh_save);
+    }
+
+    vst1q_u32(&state[0], state0);
+    vst1q_u32(&state[4], state1);
+}
+
+static void sha1_blocks_arm(uint32_t state[8], const unsigned char* data, size_t blocks) {
+    static const uint32_t K[4] = { 0x5A827999, 0x6ED9EBA1, 0x8F1BBCDC, 0xCA62C1D6 };
+    uint32x4_t abcd = vld1q_u32(&state[0]);
+    uint32_t e0 = state[4];
+
+    for (; blocks--; data += 64) {
+        const uint32x4_t abcd_save = abcd;
+        const uint32_t e0_save = e0;
+        uint32x4_t m[4];
+        for (int i = 0; i < 4; i++) {
+            m[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + i * 16)));
+        }
+
+        for (int i = 0; i < 20; i++) {
+            const uint32x4_t wk = vaddq_u32(m[i & 3], vdupq_n_u32(K[i / 5]));
+            if (i < 16) {
+                m[i & 3] = vsha1su1q_u32(vsha1su0q_u32(m[i & 3], m[(i + 1) & 3], m[(i + 2) & 3]), m[(i + 3) & 3]);
+            }
+            const uint32_t e1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+            if (i < 5) {
+                abcd = vsha1cq_u32(abcd, e0, wk);
+            } else if (i >= 10 && i < 15) {
+                abcd = vsha1mq_u32(abcd, e0, wk);
+            } else {
+                abcd = vsha1pq_u32(abcd, e0, wk);
+            }
+            e0 = e1;
+        }
+
+        abcd = vaddq_u32(abcd, abcd_save);
+        e0 += e0_save;
+    }
+
+    vst1q_u32(&state[0], abcd);
+    state[4] = e0;
+}
+#endif // FTP_HASH_ARM_SHA
+
+#if FTP_HASH_X86_SHA
+static int g_has_sha_ni = -1;
+
+static int sha_ni_supported(void) {
+    if (g_has_sha_ni < 0) {
+        unsigned a, b, c, d;
+        g_has_sha_ni = 0;
+        // ssse3 and sse4.1 are needed for the shuffles and blends.
+        if (__get_cpuid(1, &a, &b, &c, &d) && (c & bit_SSSE3) && (c & bit_SSE4_1)) {
+            g_has_sha_ni = __get_cpuid_count(7, 0, &a, &b, &c, &d) && (b & (1u << 29));
+        }
+    }
+    return g_has_sha_ni;
+}
+
+__attribute__((target("sha,sse4.1")))
+static void sha256_blocks_x86(uint32_t state[8], const unsigned char* data, size_t blocks) {
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    // the state is kept as ABEF and CDGH.
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[0]), 0xB1);
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[4]), 0x1B);
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+    for (; blocks--; data += 64) {
+        const __m128i abef_save = state0;
+        const __m128i cdgh_save = state1;
+        __m128i m[4];
+
+        for (int i = 0; i < 16; i++) {
+            if (i < 4) {
+                m[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + i * 16)), mask);
+            } else {
+                const __m128i w7 = _mm_alignr_epi8(m[(i + 3) & 3], m[(i + 2) & 3], 4);
+                m[i & 3] = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32(m[i & 3], m[(i + 1) & 3]), w7), m[(i + 3) & 3]);
+            }
+
+            __m128i wk = _mm_add_epi32(m[i & 3], _mm_loadu_si128((const __m128i*)&SHA256_K[i * 4]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, wk);
+            wk = _mm_shuffle_epi32(wk, 0x0E);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, wk);
+        }
+
+        state0 = _mm_add_epi32(state0, abef_save);
+        state1 = _mm_add_epi32(state1, cdgh_save);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    _mm_storeu_si128((__m128i*)&state[0], _mm_blend_epi16(tmp, state1, 0xF0));
+    _mm_storeu_si128((__m128i*)&state[4], _mm_alignr_epi8(state1, tmp, 8));
+}
+
+// rounds 4 at a time, the rounds function has to be an immediate so this is unrolled by hand.
+#define SHA1_X86_ROUNDS(i, func) do { \
+    if (i < 4) { \
+        m[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + i * 16)), mask); \
+    } \
+    if (i == 0) { \
+        e[0] = _mm_add_epi32(e[0], m[0]); \
+    } else { \
+        e[i & 1] = _mm_sha1nexte_epu32(e[i & 1], m[i & 3]); \
+    } \
+    e[(i + 1) & 1] = abcd; \
+    if (i >= 3) { \
+        m[(i + 1) & 3] = _mm_sha1msg2_epu32(m[(i + 1) & 3], m[i & 3]); \
+    } \
+    abcd = _mm_sha1rnds4_epu32(abcd, e[i & 1], func); \
+    if (i >= 1) { \
+        m[(i + 3) & 3] = _mm_sha1msg1_epu32(m[(i + 3) & 3], m[i & 3]); \
+    } \
+    if (i >= 2) { \
+        m[(i + 2) & 3] = _mm_xor_si128(m[(i + 2) & 3], m[i & 3]); \
+    } \
+} while (0)
+
+__attribute__((target("sha,sse4.1")))
+static void sha1_blocks_x86(uint32_t state[8], const unsigned char* data, size_t blocks) {
+    const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+    __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)state), 0x1B);
+    __m128i e0 = _mm_set_epi32(state[4], 0, 0, 0);
+
+    for (; blocks--; data += 64) {
+        const __m128i abcd_save = abcd;
+        __m128i m[4];
+        __m128i e[2] = { e0, e0 };
+
+        SHA1_X86_ROUNDS(0, 0); SHA1_X86_ROUNDS(1, 0); SHA1_X86_ROUNDS(2, 0); SHA1_X86_ROUNDS(3, 0); SHA1_X86_ROUNDS(4, 0);
+        SHA1_X86_ROUNDS(5, 1); SHA1_X86_ROUNDS(6, 1); SHA1_X86_ROUNDS(7, 1); SHA1_X86_ROUNDS(8, 1); SHA1_X86_ROUNDS(9, 1);
+        SHA1_X86_ROUNDS(10, 2); SHA1_X86_ROUNDS(11, 2); SHA1_X86_ROUNDS(12, 2); SHA1_X86_ROUNDS(13, 2); SHA1_X86_ROUNDS(14, 2);
+        SHA1_X86_ROUNDS(15, 3); SHA1_X86_ROUNDS(16, 3); SHA1_X86_ROUNDS(17, 3); SHA1_X86_ROUNDS(18, 3); SHA1_X86_ROUNDS(19, 3);
+
+        e0 = _mm_sha1nexte_epu32(e[0], e0);
+        abcd = _mm_add_epi32(abcd, abcd_save);
+    }
+
+    _mm_storeu_si128((__m128i*)state, _mm_shuffle_epi32(abcd, 0x1B));
+    state[4] = _mm_extract_epi32(e0, 3);
+}
+#endif // FTP_HASH_X86_SHA
+
+static void sha256_blocks(uint32_t state[8], const unsigned char* data, size_t blocks) {
+#if FTP_HASH_ARM_SHA
+    sha256_blocks_arm(state, data, blocks);
+#else
+    #if FTP_HASH_X86_SHA
+    if (sha_ni_supported()) {
+        sha256_blocks_x86(state, data, blocks);
+        return;
+    }
+    #endif
+    sha256_blocks_c(state, data, blocks);
+#endif
+}
+
+static void sha1_blocks(uint32_t state[8], const unsigned char* data, size_t blocks) {
+#if FTP_HASH_ARM_SHA
+    sha1_blocks_arm(state, data, blocks);
+#else
+    #if FTP_HASH_X86_SHA
+    if (sha_ni_supported()) {
+        sha1_blocks_x86(state, data, blocks);
+        return;
+    }
+    #endif
+    sha1_blocks_c(state, data, blocks);
+#endif
+}
+
+#if !FTP_HASH_ARM_CRC32 && !(defined(HAVE_ZLIB) && HAVE_ZLIB)
+// slicing-by-8 tables, filled in by the first ftp_hash_init().
+static uint32_t g_crc32_table[8][256];
+
+static void crc32_init_table(void) {
+    if (g_crc32_table[0][1]) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = c & 1 ? (c >> 1) ^ 0xEDB88320 : c >> 1;
+        }
+        g_crc32_table[0][i] = c;
+    }
+
+    for (int t = 1; t < 8; t++) {
+        for (int i = 0; i < 256; i++) {
+            const uint32_t c = g_crc32_table[t - 1][i];
+            g_crc32_table[t][i] = (c >> 8) ^ g_crc32_table[0][c & 0xFF];
+        }
+    }
+}
+#endif
+
+static uint32_t crc32_update(uint32_t crc, const unsigned char* data, size_t size) {
+#if FTP_HASH_ARM_CRC32
+    crc = ~crc;
+    for (; size && ((uintptr_t)data & 7); size--) {
+        crc = __crc32b(crc, *data++);
+    }
+    for (; size >= 8; size -= 8, data += 8) {
+        uint64_t v;
+        memcpy(&v, data, sizeof(v));
+        crc = __crc32d(crc, v);
+    }
+    for (; size; size--) {
+        crc = __crc32b(crc, *data++);
+    }
+    return ~crc;
+#elif defined(HAVE_ZLIB) && HAVE_ZLIB
+    while (size) {
+        const uInt n = size > 0x40000000 ? 0x40000000 : size;
+        crc = crc32(crc, data, n);
+        data += n;
+        size -= n;
+    }
+    return crc;
+#else
+    crc = ~crc;
+    for (; size >= 8; size -= 8, data += 8) {
+        const uint32_t lo = load_le32(data) ^ crc;
+        const uint32_t hi = load_le32(data + 4);
+        crc = g_crc32_table[7][lo & 0xFF] ^ g_crc32_table[6][(lo >> 8) & 0xFF] ^
+              g_crc32_table[5][(lo >> 16) & 0xFF] ^ g_crc32_table[4][lo >> 24] ^
+              g_crc32_table[3][hi & 0xFF] ^ g_crc32_table[2][(hi >> 8) & 0xFF] ^
+              g_crc32_table[1][(hi >> 16) & 0xFF] ^ g_crc32_table[0][hi >> 24];
+    }
+    for (; size; size--) {
+        crc = (crc >> 8) ^ g_crc32_table[0][(crc ^ *data++) & 0xFF];
+    }
+    return ~crc;
+#endif
+}
+
+static void hash_blocks(struct FtpHash* h, const unsigned char* data, size_t blocks) {
+    switch (h->type) {
+        case FtpHashType_SHA256: sha256_blocks(h->state, data, blocks); break;
+        case FtpHashType_SHA1: sha1_blocks(h->state, data, blocks); break;
+        case FtpHashType_MD5: md5_blocks_c(h->state, data, blocks); break;
+        default: break;
+    }
+}
+
+const char* ftp_hash_name(enum FtpHashType type) {
+    return FTP_HASH_NAMES[type];
+}
+
+size_t ftp_hash_size(enum FtpHashType type) {
+    return FTP_HASH_SIZES[type];
+}
+
+void ftp_hash_init(struct FtpHash* h, enum FtpHashType type) {
+    static const uint32_t SHA256_IV[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    static const uint32_t SHA1_IV[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+
+    memset(h, 0, sizeof(*h));
+    h->type = type;
+
+    switch (type) {
+        case FtpHashType_SHA256: memcpy(h->state, SHA256_IV, sizeof(SHA256_IV)); break;
+        // md5 uses the same first 4 words as sha1.
+        case FtpHashType_SHA1: memcpy(h->state, SHA1_IV, sizeof(SHA1_IV)); break;
+        case FtpHashType_MD5: memcpy(h->state, SHA1_IV, sizeof(uint32_t) * 4); break;
+        default:
+#if !FTP_HASH_ARM_CRC32 && !(defined(HAVE_ZLIB) && HAVE_ZLIB)
+            crc32_init_table();
+#endif
+            break;
+    }
+}
+
+void ftp_hash_update(struct FtpHash* h, const void* data, size_t size) {
+    const unsigned char* p = data;
+    h->length += size;
+
+    if (h->type == FtpHashType_CRC32) {
+        h->state[0] = crc32_update(h->state[0], p, size);
+        return;
+    }
+
+    if (h->buf_size) {
+        const size_t n = size < sizeof(h->buf) - h->buf_size ? size : sizeof(h->buf) - h->buf_size;
+        memcpy(h->buf + h->buf_size, p, n);
+        h->buf_size += n;
+        p += n;
+        size -= n;
+        if (h->buf_size < sizeof(h->buf)) {
+            return;
+        }
+        hash_blocks(h, h->buf, 1);
+        h->buf_size = 0;
+    }
+
+    if (size >= sizeof(h->buf)) {
+        hash_blocks(h, p, size / sizeof(h->buf));
+        p += size & ~(sizeof(h->buf) - 1);
+        size &= sizeof(h->buf) - 1;
+    }
+
+    memcpy(h->buf, p, size);
+    h->buf_size = size;
+}
+
+size_t ftp_hash_final(struct FtpHash* h, unsigned char out[FTP_HASH_MAX_SIZE]) {
+    const size_t size = ftp_hash_size(h->type);
+
+    if (h->type == FtpHashType_CRC32) {
+        for (int i = 0; i < 4; i++) {
+            out[i] = h->state[0] >> (24 - i * 8);
+        }
+        return size;
+    }
+
+    // pad with 0x80, zeros and the length in bits, md5 is little endian, sha is big endian.
+    const unsigned long long bits = h->length * 8;
+    h->buf[h->buf_size++] = 0x80;
+    if (h->buf_size > sizeof(h->buf) - 8) {
+        memset(h->buf + h->buf_size, 0, sizeof(h->buf) - h->buf_size);
+        hash_blocks(h, h->buf, 1);
+        h->buf_size = 0;
+    }
+    memset(h->buf + h->buf_size, 0, sizeof(h->buf) - 8 - h->buf_size);
+
+    for (int i = 0; i < 8; i++) {
+        if (h->type == FtpHashType_MD5) {
+            h->buf[56 + i] = bits >> (i * 8);
+        } else {
+            h->buf[63 - i] = bits >> (i * 8);
+        }
+    }
+    hash_blocks(h, h->buf, 1);
+
+    for (size_t i = 0; i < size; i++) {
+        const uint32_t word = h->state[i / 4];
+        if (h->type == FtpHashType_MD5) {
+            out[i] = word >> ((i & 3) * 8);
+        } else {
+            out[i] = word >> (24 - (i & 3) * 8);
+        }
+    }
+    return size;
+}
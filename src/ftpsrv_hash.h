@@ -0,0 +1,48 @@
+/**
+ * Copyright 2024 TotalJustice.
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef FTP_SRV_HASH_H
+#define FTP_SRV_HASH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+// largest digest size in bytes (SHA-256).
+#define FTP_HASH_MAX_SIZE 32
+
+enum FtpHashType {
+    FtpHashType_SHA256,
+    FtpHashType_SHA1,
+    FtpHashType_MD5,
+    FtpHashType_CRC32,
+    FtpHashType_COUNT,
+};
+
+struct FtpHash {
+    enum FtpHashType type;
+    uint32_t state[8];
+    unsigned long long length; // bytes hashed so far
+    unsigned char buf[64];     // partial block waiting for more data
+    size_t buf_size;
+};
+
+// name as used by HASH / OPTS HASH, eg "SHA-256".
+const char* ftp_hash_name(enum FtpHashType type);
+// size of the digest in bytes.
+size_t ftp_hash_size(enum FtpHashType type);
+
+void ftp_hash_init(struct FtpHash* h, enum FtpHashType type);
+void ftp_hash_update(struct FtpHash* h, const void* data, size_t size);
+// writes out the digest and returns its size, h has to be init again to be reused.
+size_t ftp_hash_final(struct FtpHash* h, unsigned char out[FTP_HASH_MAX_SIZE]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // FTP_SRV_HASH_H
@@ -14,12 +14,22 @@ enum FtpVfsOpenMode {
     FtpVfsOpenMode_READ,
     FtpVfsOpenMode_WRITE, // create and truncate is implicitly implied
     FtpVfsOpenMode_APPEND,
+    FtpVfsOpenMode_WRITE_AT, // create if needed, no truncate, writes start at the ftp_vfs_seek() offset
+};
+
+enum FtpVfsCache {
+    FtpVfsCache_DEFAULT,     // leave it up to the os
+    FtpVfsCache_SEQUENTIAL,  // the file is accessed sequentially, read ahead more
+    FtpVfsCache_DROP_BEHIND, // same as above, ftp_vfs_drop_cache() is called once data is transferred
+    FtpVfsCache_DIRECT,      // bypass the cache, buffers and offsets should be aligned
 };
 
 struct FtpVfsFile;
 struct FtpVfsDir;
 struct FtpVfsDirEntry;
 
+// sets up f as closed, called before a zeroed file is used, as zero may be a valid handle.
+void ftp_vfs_file_init(struct FtpVfsFile* f);
 int ftp_vfs_open(struct FtpVfsFile* f, const char* path, enum FtpVfsOpenMode mode);
 int ftp_vfs_read(struct FtpVfsFile* f, void* buf, size_t size);
 int ftp_vfs_write(struct FtpVfsFile* f, const void* buf, size_t size);
@@ -27,6 +37,25 @@ int ftp_vfs_seek(struct FtpVfsFile* f, size_t off);
 int ftp_vfs_fstat(struct FtpVfsFile* f, const char* path, struct stat* st);
 int ftp_vfs_close(struct FtpVfsFile* f);
 int ftp_vfs_isfile_open(struct FtpVfsFile* f);
+// reserves space for the file to grow to size bytes, the file size may or may not change.
+// returns -1 and sets errno to ENOSYS if the backend does not support it.
+int ftp_vfs_allocate(struct FtpVfsFile* f, size_t size);
+// sets the size of the file, used to trim any space left over from ftp_vfs_allocate().
+int ftp_vfs_truncate(struct FtpVfsFile* f, size_t size);
+// sets how the file should use the page cache, returns -1 if unsupported.
+int ftp_vfs_set_cache(struct FtpVfsFile* f, enum FtpVfsCache cache);
+// starts writing the range out and removes what is already written from the page cache, without
+// waiting for the writes. dirty pages are left cached, calling it again later drops them.
+int ftp_vfs_drop_cache(struct FtpVfsFile* f, size_t off, size_t size);
+// makes dst share the data of src without copying it (reflink), returns -1 if the fs can't.
+int ftp_vfs_clone(struct FtpVfsFile* dst, struct FtpVfsFile* src);
+// copies up to size bytes from src to dst within the fs, starting at the offset of each.
+// returns the bytes copied, 0 at the end of src, or -1 and sets errno to ENOSYS if it can't
+// be done within the fs, in which case the data has to be read and written instead.
+int ftp_vfs_copy(struct FtpVfsFile* dst, struct FtpVfsFile* src, size_t size);
+// makes the range read back as zeros without writing it, freeing the space it used, the file
+// size isn't changed. returns -1 and sets errno to ENOSYS if the fs can't make holes.
+int ftp_vfs_punch(struct FtpVfsFile* f, size_t off, size_t size);
 
 int ftp_vfs_opendir(struct FtpVfsDir* f, const char* path);
 const char* ftp_vfs_readdir(struct FtpVfsDir* f, struct FtpVfsDirEntry* entry);
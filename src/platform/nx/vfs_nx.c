@@ -52,7 +52,10 @@ writing 400 64k files using setsize takes 9s, whereas without it takes
 
 // given the above, in my testing, 8MiB was the fastest.
 // anything above didn't improve anything, anything less slowed down.
-#define NX_WRITE_CHUNK_SIZE (1024ULL*1024ULL*1ULL)
+// the buffering is now done in ftpsrv.c using a shared pool of write
+// buffers (FTP_WRITE_BUFFER_SIZE), so only sessions doing STOR pay for it.
+// the setsize() trick is also done in ftpsrv.c, which grows the file
+// using ftp_vfs_allocate() and trims it with ftp_vfs_truncate().
 
 enum FsError {
     FsError_PathNotFound = 0x202,
@@ -340,16 +343,6 @@ static time_t fsdev_converttimetoutc(u64 timestamp)
   return posixtime;
 }
 
-#if VFS_NX_BUFFER_WRITES
-static Result flush_buffered_write(struct FtpVfsFile* f) {
-    Result rc;
-    if (R_SUCCEEDED(rc = fsFileSetSize(&f->fd, f->off + f->buf_off))) {
-        rc = fsFileWrite(&f->fd, f->off, f->buf, f->buf_off, FsWriteOption_None);
-    }
-    return rc;
-}
-#endif
-
 static int fstat_internal(FsFile* file, const char* path, struct stat* st) {
     FsFileSystem* fs = NULL;
     char nxpath[FS_MAX_PATH];
@@ -400,10 +393,7 @@ int ftp_vfs_open(struct FtpVfsFile* f, const char* path, enum FtpVfsOpenMode mod
         return set_errno_and_return_minus1(rc);
     }
 
-    f->off = f->chunk_size = 0;
-#if VFS_NX_BUFFER_WRITES
-    f->buf_off = 0;
-#endif
+    f->off = f->size = 0;
 
     if (mode == FtpVfsOpenMode_WRITE) {
         if (R_FAILED(rc = fsFileSetSize(&f->fd, 0))) {
@@ -413,7 +403,11 @@ int ftp_vfs_open(struct FtpVfsFile* f, const char* path, enum FtpVfsOpenMode mod
         if (R_FAILED(rc = fsFileGetSize(&f->fd, &f->off))) {
             goto fail_close;
         }
-        f->chunk_size = f->off;
+        f->size = f->off;
+    } else if (mode == FtpVfsOpenMode_WRITE_AT) {
+        if (R_FAILED(rc = fsFileGetSize(&f->fd, &f->size))) {
+            goto fail_close;
+        }
     }
 
     f->is_valid = true;
@@ -438,35 +432,19 @@ int ftp_vfs_read(struct FtpVfsFile* f, void* buf, size_t size) {
 int ftp_vfs_write(struct FtpVfsFile* f, const void* buf, size_t size) {
     Result rc;
 
-#if VFS_NX_BUFFER_WRITES
-    const size_t ret = size;
-    while (size) {
-        if (f->buf_off + size > sizeof(f->buf)) {
-            const u64 sz = sizeof(f->buf) - f->buf_off;
-            memcpy(f->buf + f->buf_off, buf, sz);
-            f->buf_off += sz;
+    // the file isn't opened with append, so it has to be grown first.
+    // the size is fetched again as another session may have already grown
+    // it (WRITE_AT), in which case setting it would cut off their data.
+    if (f->size < f->off + size) {
+        if (R_FAILED(rc = fsFileGetSize(&f->fd, &f->size))) {
+            return set_errno_and_return_minus1(rc);
+        }
 
-            if (R_FAILED(rc = flush_buffered_write(f))) {
+        if (f->size < f->off + size) {
+            if (R_FAILED(rc = fsFileSetSize(&f->fd, f->off + size))) {
                 return set_errno_and_return_minus1(rc);
             }
-
-            buf += sz;
-            size -= sz;
-            f->off += f->buf_off;
-            f->buf_off = 0;
-        } else {
-            memcpy(f->buf + f->buf_off, buf, size);
-            f->buf_off += size;
-            size = 0;
-        }
-    }
-
-    return ret;
-#else
-    if (f->chunk_size < f->off + size) {
-        f->chunk_size += NX_WRITE_CHUNK_SIZE;
-        if (R_FAILED(rc = fsFileSetSize(&f->fd, f->chunk_size))) {
-            return set_errno_and_return_minus1(rc);
+            f->size = f->off + size;
         }
     }
 
@@ -476,7 +454,6 @@ int ftp_vfs_write(struct FtpVfsFile* f, const void* buf, size_t size) {
 
     f->off += size;
     return size;
-#endif
 }
 
 int ftp_vfs_seek(struct FtpVfsFile* f, size_t off) {
@@ -488,29 +465,69 @@ int ftp_vfs_fstat(struct FtpVfsFile* f, const char* path, struct stat* st) {
     return fstat_internal(&f->fd, path, st);
 }
 
-int ftp_vfs_close(struct FtpVfsFile* f) {
-    if (!ftp_vfs_isfile_open(f)) {
-        return -1;
+int ftp_vfs_allocate(struct FtpVfsFile* f, size_t size) {
+    // there's no way to reserve space without changing the size,
+    // so the file is grown and later trimmed by ftp_vfs_truncate().
+    if (f->size < size) {
+        Result rc;
+        if (R_FAILED(rc = fsFileSetSize(&f->fd, size))) {
+            return set_errno_and_return_minus1(rc);
+        }
+        f->size = size;
     }
+    return 0;
+}
 
-#if VFS_NX_BUFFER_WRITES
-    if (f->buf_off) {
-        flush_buffered_write(f);
-        if (R_SUCCEEDED(fsFileSetSize(&f->fd, f->off + f->buf_off))) {
-            fsFileWrite(&f->fd, f->off, f->buf, f->buf_off, FsWriteOption_None);
-        }
+int ftp_vfs_truncate(struct FtpVfsFile* f, size_t size) {
+    Result rc;
+    if (R_FAILED(rc = fsFileSetSize(&f->fd, size))) {
+        return set_errno_and_return_minus1(rc);
+    }
+    f->size = size;
+    return 0;
+}
+
+int ftp_vfs_set_cache(struct FtpVfsFile* f, enum FtpVfsCache cache) {
+    if (cache == FtpVfsCache_DEFAULT) {
+        return 0;
     }
-#else
-    if (f->chunk_size) {
-        fsFileSetSize(&f->fd, f->off); // shrink
+    errno = ENOSYS;
+    return -1;
+}
+
+int ftp_vfs_drop_cache(struct FtpVfsFile* f, size_t off, size_t size) {
+    return 0;
+}
+
+int ftp_vfs_clone(struct FtpVfsFile* dst, struct FtpVfsFile* src) {
+    errno = ENOSYS;
+    return -1;
+}
+
+int ftp_vfs_copy(struct FtpVfsFile* dst, struct FtpVfsFile* src, size_t size) {
+    errno = ENOSYS;
+    return -1;
+}
+
+int ftp_vfs_punch(struct FtpVfsFile* f, size_t off, size_t size) {
+    errno = ENOSYS;
+    return -1;
+}
+
+int ftp_vfs_close(struct FtpVfsFile* f) {
+    if (!ftp_vfs_isfile_open(f)) {
+        return -1;
     }
-#endif
 
     fsFileClose(&f->fd);
     f->is_valid = false;
     return 0;
 }
 
+void ftp_vfs_file_init(struct FtpVfsFile* f) {
+    f->is_valid = false;
+}
+
 int ftp_vfs_isfile_open(struct FtpVfsFile* f) {
     return f->is_valid;
 }
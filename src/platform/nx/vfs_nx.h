@@ -13,12 +13,8 @@ extern "C" {
 struct FtpVfsFile {
     FsFile fd;
     s64 off;
-    s64 chunk_size;
+    s64 size; // size of the file, may be larger than what has been written.
     bool is_valid;
-#if VFS_NX_BUFFER_WRITES
-    s64 buf_off;
-    u8 buf[1024*1024*1];
-#endif
 };
 
 struct FtpVfsDir {
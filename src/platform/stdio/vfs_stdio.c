@@ -11,6 +11,7 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <errno.h>
 
 #if defined(HAVE_LSTAT) && !HAVE_LSTAT
     #define lstat stat
@@ -27,6 +28,13 @@ int ftp_vfs_open(struct FtpVfsFile* f, const char* path, enum FtpVfsOpenMode mod
         case FtpVfsOpenMode_APPEND:
             f->fd = fopen(path, "wb+");
             break;
+        case FtpVfsOpenMode_WRITE_AT:
+            // "r+" doesn't create the file and "w" truncates it.
+            f->fd = fopen(path, "rb+");
+            if (!f->fd && errno == ENOENT) {
+                f->fd = fopen(path, "wb");
+            }
+            break;
     }
 
     if (!f->fd) {
@@ -52,6 +60,45 @@ int ftp_vfs_fstat(struct FtpVfsFile* f, const char* path, struct stat* st) {
     return fstat(fileno(f->fd), st);
 }
 
+int ftp_vfs_allocate(struct FtpVfsFile* f, size_t size) {
+    errno = ENOSYS;
+    return -1;
+}
+
+int ftp_vfs_truncate(struct FtpVfsFile* f, size_t size) {
+    if (fflush(f->fd)) {
+        return -1;
+    }
+    return ftruncate(fileno(f->fd), size);
+}
+
+int ftp_vfs_set_cache(struct FtpVfsFile* f, enum FtpVfsCache cache) {
+    if (cache == FtpVfsCache_DEFAULT) {
+        return 0;
+    }
+    errno = ENOSYS;
+    return -1;
+}
+
+int ftp_vfs_drop_cache(struct FtpVfsFile* f, size_t off, size_t size) {
+    return 0;
+}
+
+int ftp_vfs_clone(struct FtpVfsFile* dst, struct FtpVfsFile* src) {
+    errno = ENOSYS;
+    return -1;
+}
+
+int ftp_vfs_copy(struct FtpVfsFile* dst, struct FtpVfsFile* src, size_t size) {
+    errno = ENOSYS;
+    return -1;
+}
+
+int ftp_vfs_punch(struct FtpVfsFile* f, size_t off, size_t size) {
+    errno = ENOSYS;
+    return -1;
+}
+
 int ftp_vfs_close(struct FtpVfsFile* f) {
     if (!ftp_vfs_isfile_open(f)) {
         return -1;
@@ -61,6 +108,10 @@ int ftp_vfs_close(struct FtpVfsFile* f) {
     return rc;
 }
 
+void ftp_vfs_file_init(struct FtpVfsFile* f) {
+    f->fd = NULL;
+}
+
 int ftp_vfs_isfile_open(struct FtpVfsFile* f) {
     return f->fd != NULL;
 }
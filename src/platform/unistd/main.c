@@ -7,6 +7,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <signal.h>
 #include <unistd.h>
 
 #include <netinet/in.h>
@@ -25,6 +26,22 @@ enum ArgsId {
     ArgsId_user,
     ArgsId_pass,
     ArgsId_anon,
+    ArgsId_cache,
+    ArgsId_cache_threshold,
+    ArgsId_rate_limit,
+    ArgsId_session_rate_limit,
+    ArgsId_ip_rate_limit,
+    ArgsId_pasv_port_min,
+    ArgsId_pasv_port_max,
+    ArgsId_compression_level,
+    ArgsId_tls_cert,
+    ArgsId_tls_key,
+    ArgsId_max_sessions,
+    ArgsId_max_transfers,
+    ArgsId_buffer_size,
+    ArgsId_backlog,
+    ArgsId_data_timeout,
+    ArgsId_tls_timeout,
 };
 
 #define ARGS_ENTRY(_key, _type, _single) \
@@ -37,6 +54,22 @@ static const struct ArgsMeta ARGS_META[] = {
     ARGS_ENTRY(user, ArgsValueType_STR, 'u')
     ARGS_ENTRY(pass, ArgsValueType_STR, 'p')
     ARGS_ENTRY(anon, ArgsValueType_BOOL, 'a')
+    ARGS_ENTRY(cache, ArgsValueType_STR, 'c')
+    ARGS_ENTRY(cache_threshold, ArgsValueType_INT, 0)
+    ARGS_ENTRY(rate_limit, ArgsValueType_INT, 0)
+    ARGS_ENTRY(session_rate_limit, ArgsValueType_INT, 0)
+    ARGS_ENTRY(ip_rate_limit, ArgsValueType_INT, 0)
+    ARGS_ENTRY(pasv_port_min, ArgsValueType_INT, 0)
+    ARGS_ENTRY(pasv_port_max, ArgsValueType_INT, 0)
+    ARGS_ENTRY(compression_level, ArgsValueType_INT, 0)
+    ARGS_ENTRY(tls_cert, ArgsValueType_STR, 0)
+    ARGS_ENTRY(tls_key, ArgsValueType_STR, 0)
+    ARGS_ENTRY(max_sessions, ArgsValueType_INT, 0)
+    ARGS_ENTRY(max_transfers, ArgsValueType_INT, 0)
+    ARGS_ENTRY(buffer_size, ArgsValueType_INT, 0)
+    ARGS_ENTRY(backlog, ArgsValueType_INT, 0)
+    ARGS_ENTRY(data_timeout, ArgsValueType_INT, 0)
+    ARGS_ENTRY(tls_timeout, ArgsValueType_INT, 0)
 };
 
 static void ftp_log_callback(enum FTP_API_LOG_TYPE type, const char* msg) {
@@ -63,12 +96,31 @@ Usage\n\n\
     -u, --user      = Set username.\n\
     -p, --pass      = Set password.\n\
     -a, --anon      = Enable anonymous login.\n\
+    -c, --cache     = Set cache policy [default, sequential, dropbehind, direct].\n\
+    --cache_threshold = Only use the cache policy for files of at least this many bytes.\n\
+    --rate_limit    = Limit all transfers combined to this many bytes per second.\n\
+    --session_rate_limit = Limit each session to this many bytes per second.\n\
+    --ip_rate_limit = Limit each client address to this many bytes per second.\n\
+    --pasv_port_min = Set the lowest port used by PASV [default 49152].\n\
+    --pasv_port_max = Set the highest port used by PASV [default 65535].\n\
+    --compression_level = Set the MODE Z compression level [1-9].\n\
+    --tls_cert      = Enable AUTH TLS with this PEM certificate chain.\n\
+    --tls_key       = Set the PEM private key, if not in the certificate file.\n\
+    --max_sessions  = Set the number of clients that can be connected at once.\n\
+    --max_transfers = Set the number of clients that can run a command or transfer at once.\n\
+    --buffer_size   = Set the size of the buffer file data is moved through.\n\
+    --backlog       = Set the number of connections waiting to be accepted.\n\
+    --data_timeout  = Set how long a transfer waits for its data connection, in ms.\n\
+    --tls_timeout   = Set how long a stalled TLS control connection is kept, in ms.\n\
     \n");
 
     return code;
 }
 
 int main(int argc, char** argv) {
+    // a peer that resets the connection must only fail the send, not kill the server.
+    signal(SIGPIPE, SIG_IGN);
+
     struct FtpSrvConfig ftpsrv_config = {
         .log_callback = ftp_log_callback,
     };
@@ -93,6 +145,65 @@ int main(int argc, char** argv) {
             case ArgsId_anon:
                 ftpsrv_config.anon = true;
                 break;
+            case ArgsId_cache:
+                if (!strcmp(arg_data.value.s, "default")) {
+                    ftpsrv_config.cache_policy = FTP_API_CACHE_POLICY_DEFAULT;
+                } else if (!strcmp(arg_data.value.s, "sequential")) {
+                    ftpsrv_config.cache_policy = FTP_API_CACHE_POLICY_SEQUENTIAL;
+                } else if (!strcmp(arg_data.value.s, "dropbehind")) {
+                    ftpsrv_config.cache_policy = FTP_API_CACHE_POLICY_DROP_BEHIND;
+                } else if (!strcmp(arg_data.value.s, "direct")) {
+                    ftpsrv_config.cache_policy = FTP_API_CACHE_POLICY_DIRECT;
+                } else {
+                    fprintf(stderr, "unknown cache policy [%s]\n", arg_data.value.s);
+                    return print_usage(EXIT_FAILURE);
+                }
+                break;
+            case ArgsId_cache_threshold:
+                ftpsrv_config.cache_threshold = arg_data.value.i;
+                break;
+            case ArgsId_rate_limit:
+                ftpsrv_config.rate_limit = arg_data.value.i;
+                break;
+            case ArgsId_session_rate_limit:
+                ftpsrv_config.session_rate_limit = arg_data.value.i;
+                break;
+            case ArgsId_ip_rate_limit:
+                ftpsrv_config.ip_rate_limit = arg_data.value.i;
+                break;
+            case ArgsId_pasv_port_min:
+                ftpsrv_config.pasv_port_min = arg_data.value.i;
+                break;
+            case ArgsId_pasv_port_max:
+                ftpsrv_config.pasv_port_max = arg_data.value.i;
+                break;
+            case ArgsId_compression_level:
+                ftpsrv_config.compression_level = arg_data.value.i;
+                break;
+            case ArgsId_tls_cert:
+                ftpsrv_config.tls_cert = arg_data.value.s;
+                break;
+            case ArgsId_tls_key:
+                ftpsrv_config.tls_key = arg_data.value.s;
+                break;
+            case ArgsId_max_sessions:
+                ftpsrv_config.max_sessions = arg_data.value.i;
+                break;
+            case ArgsId_max_transfers:
+                ftpsrv_config.max_transfers = arg_data.value.i;
+                break;
+            case ArgsId_buffer_size:
+                ftpsrv_config.file_buffer_size = arg_data.value.i;
+                break;
+            case ArgsId_backlog:
+                ftpsrv_config.backlog = arg_data.value.i;
+                break;
+            case ArgsId_data_timeout:
+                ftpsrv_config.data_timeout_ms = arg_data.value.i;
+                break;
+            case ArgsId_tls_timeout:
+                ftpsrv_config.tls_timeout_ms = arg_data.value.i;
+                break;
         }
     }
 
@@ -3,6 +3,9 @@
  * SPDX-License-Identifier: MIT
  */
 
+// needed for fallocate(), sync_file_range(), copy_file_range(), O_DIRECT and FALLOC_FL_PUNCH_HOLE.
+#define _GNU_SOURCE
+
 #include "ftpsrv_vfs.h"
 
 #include <stddef.h>
@@ -12,6 +15,12 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <errno.h>
+
+#if defined(HAVE_FICLONE) && HAVE_FICLONE
+    #include <sys/ioctl.h>
+    #include <linux/fs.h>
+#endif
 
 #if defined(HAVE_LSTAT) && !HAVE_LSTAT
     #define lstat stat
@@ -33,17 +42,48 @@ int ftp_vfs_open(struct FtpVfsFile* f, const char* path, enum FtpVfsOpenMode mod
             flags = O_WRONLY | O_CREAT | O_APPEND;
             args = 0666;
             break;
+        case FtpVfsOpenMode_WRITE_AT:
+            flags = O_WRONLY | O_CREAT;
+            args = 0666;
+            break;
     }
 
+    f->direct = 0;
     return f->fd = open(path, flags, args);
 }
 
+#if defined(HAVE_O_DIRECT) && HAVE_O_DIRECT
+// O_DIRECT fails with EINVAL if the buffer, size or offset isn't aligned,
+// which happens at the end of the file or after a short send, so drop back
+// to using the cache for the rest of the transfer.
+static int direct_disable(struct FtpVfsFile* f) {
+    if (!f->direct || errno != EINVAL) {
+        return -1;
+    }
+
+    f->direct = 0;
+    return fcntl(f->fd, F_SETFL, fcntl(f->fd, F_GETFL) & ~O_DIRECT);
+}
+#endif
+
 int ftp_vfs_read(struct FtpVfsFile* f, void* buf, size_t size) {
-    return read(f->fd, buf, size);
+    int rc = read(f->fd, buf, size);
+#if defined(HAVE_O_DIRECT) && HAVE_O_DIRECT
+    if (rc < 0 && !direct_disable(f)) {
+        rc = read(f->fd, buf, size);
+    }
+#endif
+    return rc;
 }
 
 int ftp_vfs_write(struct FtpVfsFile* f, const void* buf, size_t size) {
-    return write(f->fd, buf, size);
+    int rc = write(f->fd, buf, size);
+#if defined(HAVE_O_DIRECT) && HAVE_O_DIRECT
+    if (rc < 0 && !direct_disable(f)) {
+        rc = write(f->fd, buf, size);
+    }
+#endif
+    return rc;
 }
 
 int ftp_vfs_seek(struct FtpVfsFile* f, size_t off) {
@@ -54,6 +94,113 @@ int ftp_vfs_fstat(struct FtpVfsFile* f, const char* path, struct stat* st) {
     return fstat(f->fd, st);
 }
 
+int ftp_vfs_allocate(struct FtpVfsFile* f, size_t size) {
+#if defined(HAVE_FALLOCATE) && HAVE_FALLOCATE
+    // keep the size so that a failed upload doesn't leave the file padded out.
+    return fallocate(f->fd, FALLOC_FL_KEEP_SIZE, 0, size);
+#elif defined(HAVE_POSIX_FALLOCATE) && HAVE_POSIX_FALLOCATE
+    // unlike the other calls, posix_fallocate() returns the error.
+    const int rc = posix_fallocate(f->fd, 0, size);
+    if (rc) {
+        errno = rc;
+        return -1;
+    }
+    return 0;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+int ftp_vfs_truncate(struct FtpVfsFile* f, size_t size) {
+    return ftruncate(f->fd, size);
+}
+
+int ftp_vfs_set_cache(struct FtpVfsFile* f, enum FtpVfsCache cache) {
+    switch (cache) {
+        case FtpVfsCache_DEFAULT:
+            return 0;
+        case FtpVfsCache_SEQUENTIAL:
+        case FtpVfsCache_DROP_BEHIND:
+#if defined(HAVE_POSIX_FADVISE) && HAVE_POSIX_FADVISE
+            // unlike the other calls, posix_fadvise() returns the error.
+            if ((errno = posix_fadvise(f->fd, 0, 0, POSIX_FADV_SEQUENTIAL))) {
+                return -1;
+            }
+            return 0;
+#else
+            break;
+#endif
+        case FtpVfsCache_DIRECT:
+#if defined(HAVE_O_DIRECT) && HAVE_O_DIRECT
+            // not every fs supports O_DIRECT, in which case this fails.
+            if (fcntl(f->fd, F_SETFL, fcntl(f->fd, F_GETFL) | O_DIRECT) < 0) {
+                return -1;
+            }
+            f->direct = 1;
+            return 0;
+#else
+            break;
+#endif
+    }
+
+    errno = ENOSYS;
+    return -1;
+}
+
+int ftp_vfs_drop_cache(struct FtpVfsFile* f, size_t off, size_t size) {
+#if defined(HAVE_SYNC_FILE_RANGE) && HAVE_SYNC_FILE_RANGE
+    // dirty pages are not dropped, start writing them out for the next call
+    // rather than waiting here, as this runs on the loop.
+    sync_file_range(f->fd, off, size, SYNC_FILE_RANGE_WRITE);
+#endif
+#if defined(HAVE_POSIX_FADVISE) && HAVE_POSIX_FADVISE
+    if ((errno = posix_fadvise(f->fd, off, size, POSIX_FADV_DONTNEED))) {
+        return -1;
+    }
+    return 0;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+int ftp_vfs_clone(struct FtpVfsFile* dst, struct FtpVfsFile* src) {
+#if defined(HAVE_FICLONE) && HAVE_FICLONE
+    return ioctl(dst->fd, FICLONE, src->fd);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+int ftp_vfs_copy(struct FtpVfsFile* dst, struct FtpVfsFile* src, size_t size) {
+#if defined(HAVE_COPY_FILE_RANGE) && HAVE_COPY_FILE_RANGE
+    const int rc = copy_file_range(src->fd, NULL, dst->fd, NULL, size, 0);
+    // older kernels can't copy between fs, and some fs don't support it at all.
+    if (rc < 0 && (errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)) {
+        errno = ENOSYS;
+    }
+    return rc;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+int ftp_vfs_punch(struct FtpVfsFile* f, size_t off, size_t size) {
+#if defined(HAVE_PUNCH_HOLE) && HAVE_PUNCH_HOLE
+    const int rc = fallocate(f->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, size);
+    if (rc < 0 && errno == EOPNOTSUPP) {
+        errno = ENOSYS;
+    }
+    return rc;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
 int ftp_vfs_close(struct FtpVfsFile* f) {
     int rc = 0;
     if (ftp_vfs_isfile_open(f)) {
@@ -63,6 +210,11 @@ int ftp_vfs_close(struct FtpVfsFile* f) {
     return rc;
 }
 
+void ftp_vfs_file_init(struct FtpVfsFile* f) {
+    f->fd = -1;
+    f->direct = 0;
+}
+
 int ftp_vfs_isfile_open(struct FtpVfsFile* f) {
     return f->fd >= 0;
 }
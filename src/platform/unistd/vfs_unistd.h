@@ -11,6 +11,7 @@ extern "C" {
 
 struct FtpVfsFile {
     int fd;
+    int direct; // set if opened with O_DIRECT
 };
 
 struct FtpVfsDir {